@@ -24,317 +24,393 @@
 #include <string.h>
 #include <curl/curl.h>
 #include <plist/plist.h>
-#include <libimobiledevice/lockdown.h>
+#include "activate.h"
+#include "arena.h"
+#include "buffer.h"
 #include "cache.h"
+#include "form.h"
+#include "http.h"
+#include "logger.h"
+#include "metrics.h"
+#include "props.h"
+#include "records.h"
+#include "response.h"
+#include "spool.h"
+#include "trace.h"
+#include "transport.h"
 #include "util.h"
+#include "xml.h"
 
-typedef struct {
-	int length;
-	char* content;
-} activate_response;
+/* ActivationInfo is a few KB of mostly base64, start big enough for it */
+#define ACTIVATION_INFO_SIZE 0x4000
 
 typedef struct {
-	char* imei;
-	char* imsi;
-	char* iccid;
-	char* serial_number;
-	char* activation_info;
+	const char* imei;
+	const char* imsi;
+	const char* iccid;
+	const char* serial_number;
 } activate_info;
 
-size_t activate_write_callback(char* data, size_t size, size_t nmemb, activate_response* response) {
-	size_t total = size * nmemb;
-	if (total != 0) {
-		response->content = realloc(response->content, response->length + total + 1);
-		memcpy(response->content + response->length, data, total);
-		response->content[response->length + total] = '\0';
-		response->length += total;
-	}
-	//printf("%s", data);
-	return total;
-}
-
-void deactivate_device(lockdownd_client_t client)
+int deactivate_device(activation_session_t session)
 {
-	printf("Deactivating device... ");
-	int client_error = lockdownd_deactivate(client);
-	if (client_error == LOCKDOWN_E_SUCCESS) {
-		printf("SUCCESS\n");
+	char m[64];
+
+	session_stage(session, ACTIVATION_STAGE_DEACTIVATING);
+	task("Deactivating device...");
+	int client_error = device_transport_current->deactivate(session->link);
+	if (client_error == 0) {
+		task("SUCCESS");
+		return 0;
 	} else {
-		fprintf(stderr, "ERROR\nUnable to deactivate device: %d\n", client_error);
+		snprintf(m, sizeof(m), "Unable to deactivate device: %d", client_error);
+		error(m);
+		return -1;
 	}
 }
 
-int activate_fetch_record(lockdownd_client_t client, plist_t* record, char* cust_imei, char* cust_imsi, char* cust_iccid, char* cust_serial_num) {
-	struct curl_httppost* post = NULL;
-	struct curl_httppost* last = NULL;
-	activate_response* response = NULL;
-
-	plist_t activation_info_node = NULL;
-
-	char* activation_info;
-
-	activate_info* ainfo;
-
-	char* device_class = NULL;
-	device_class=(char*)lockdownd_get_string_value(client, "DeviceClass");
-
-	if (!strcmp(device_class, "iPhone")) {
-		if (use_cache!=1)
-		{
-			if (cust_iccid==NULL)
-			{
-				ainfo->iccid=(char*)lockdownd_get_string_value(client, "IntegratedCircuitCardIdentity");
-			}
-			else {
-				info("ICCID specified on the command line...");
-				ainfo->iccid=cust_iccid;
-			}
-
-			if (cust_imei==NULL)
-			{
-				ainfo->imei=(char*)lockdownd_get_string_value(client, "InternationalMobileEquipmentIdentity");
-			}
-			else {
-				info("IMEI specified on the command line...");
-				ainfo->imei=cust_imei;
-			}
-
-			if (cust_imsi==NULL)
-			{
-				ainfo->imsi=(char*)lockdownd_get_string_value(client, "InternationalMobileSubscriberIdentity");
-			}
-			else {
-				info("IMSI specified on the command line...");
-				ainfo->imsi=cust_imsi;
-			}
-		}
-
-		else {
-			if (cust_iccid==NULL)
-			{
-				ainfo->iccid=get_from_cache("ICCID");
-			}
-			else {
-				ainfo->iccid=cust_iccid;
-			}
-
-			if (cust_imei==NULL)
-			{
-				ainfo->imei=get_from_cache("IMEI");
-			}
-			else {
-				ainfo->imei=cust_imei;
-			}
-
-			if (cust_imsi==NULL)
-			{
-				ainfo->imsi=get_from_cache("IMSI");
-			}
-			else {
-				ainfo->imsi=cust_imsi;
-			}
-		}
+/* Picks the value to send for one field: the command line wins, then the
+ * cache (with -r), then whatever the device reported. A value from the cache
+ * is copied into the session's arena. */
+static const char* activate_pick(activation_session_t session, const char* what, const char* custom, plist_t cached, const char* from_device)
+{
+	if (custom != NULL) {
+		char m[64];
+		snprintf(m, sizeof(m), "%s specified on the command line...", what);
+		info(m);
+		return custom;
 	}
 
-	if (cust_serial_num==NULL)
-	{
-		if (use_cache!=1)
-		{
-			ainfo->serial_number=(char*)lockdownd_get_string_value(client, "SerialNumber");
+	if (session->cache_mode == ACTIVATION_CACHE_READ) {
+		plist_t node = (cached != NULL) ? plist_dict_get_item(cached, what) : NULL;
+		char* value = NULL;
+		const char* copy = NULL;
+		if (node != NULL && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &value);
 		}
-		else {
-			ainfo->serial_number=get_from_cache("SerialNumber");
+		if (value != NULL) {
+			copy = arena_strdup(&session->arena, value);
+			free(value);
 		}
-	}
-	else {
-		info("Serial number specified on the command line...");
-		ainfo->serial_number=cust_serial_num;
+		return copy;
 	}
 
-	lockdownd_get_value(client, NULL, "ActivationInfo", &activation_info_node);
-	int type = plist_get_node_type(activation_info_node);
-	if (!activation_info_node || plist_get_node_type(activation_info_node) != PLIST_DICT) {
-		error("Unable to get ActivationInfo from lockdownd");
-		return -1;
+	return from_device;
+}
+
+static void activate_cache_field(plist_t fields, const char* what, const char* value)
+{
+	if (value != NULL) {
+		plist_dict_set_item(fields, what, plist_new_string(value));
 	}
-	//plist_get_string_val(activation_info_node, &activation_info);
+}
 
-	uint32_t activation_info_size = 0;
-	char* activation_info_data = NULL;
-	plist_to_xml(activation_info_node, &activation_info_data, &activation_info_size);
-	plist_free(activation_info_node);
-	//printf("%s\n\n", activation_info_data);
+/* Builds the whole POST on the session's curl handle, ready to be sent by
+ * whoever drives the transfer. Nothing here waits on the network. */
+static int activate_post(activation_session_t session, device_props* props, plist_t cached) {
+	activation_request* request = &session->request;
 
-	char* activation_info_start = strstr(activation_info_data, "<dict>");
-	if (activation_info_start == NULL) {
-		error("Unable to locate beginning of ActivationInfo");
+	activate_info info_storage;
+	activate_info* ainfo = &info_storage;
+	memset(ainfo, '\0', sizeof(activate_info));
+
+	if (props->device_class == NULL) {
+		error("Unable to get DeviceClass from lockdownd");
 		return -1;
 	}
 
-	char* activation_info_stop = strstr(activation_info_data, "</dict>");
-	if (activation_info_stop == NULL) {
-		error("Unable to locate end of ActivationInfo");
+	plist_t activation_info_node = props->activation_info;
+	if (!activation_info_node || plist_get_node_type(activation_info_node) != PLIST_DICT) {
+		error("Unable to get ActivationInfo from lockdownd");
 		return -1;
 	}
 
-	activation_info_stop += strlen("</dict>");
-	activation_info_size = activation_info_stop - activation_info_start;
-	activation_info = malloc(activation_info_size + 1);
-	memset(activation_info, '\0', activation_info_size + 1);
-	memcpy(activation_info, activation_info_start, activation_info_size);
-	//free(activation_info_data);
+	if (!strcmp(props->device_class, "iPhone")) {
+		ainfo->iccid=activate_pick(session, "ICCID", session->iccid, cached, props->iccid);
+		ainfo->imei=activate_pick(session, "IMEI", session->imei, cached, props->imei);
+		ainfo->imsi=activate_pick(session, "IMSI", session->imsi, cached, props->imsi);
+	}
+
+	ainfo->serial_number=activate_pick(session, "SerialNumber", session->serial_number, cached, props->serial_number);
 
-	curl_global_init(CURL_GLOBAL_ALL);
-	CURL* handle = curl_easy_init();
-	if (handle == NULL) {
-		error("Unable to initialize libcurl");
-		curl_global_cleanup();
+	/* The body is written out in full in the session's arena and curl sends
+	 * it from there as is. The constant parts come from the template in
+	 * form.c, and the fragment is serialized straight into its part, so the
+	 * payload never exists in more than one copy. See activate_discard(). */
+	buffer_t body;
+	if (buffer_init_arena(&body, &session->arena, ACTIVATION_INFO_SIZE) != 0 || form_begin(&body) != 0) {
+		error("Unable to allocate sufficent memory");
 		return -1;
 	}
 
-	curl_formadd(&post, &last, CURLFORM_COPYNAME, "machineName", CURLFORM_COPYCONTENTS, "linux", CURLFORM_END);
-	curl_formadd(&post, &last, CURLFORM_COPYNAME, "InStoreActivation", CURLFORM_COPYCONTENTS, "false", CURLFORM_END);
+	int res = 0;
 	if (ainfo->imei != NULL) {
-		curl_formadd(&post, &last, CURLFORM_COPYNAME, "IMEI", CURLFORM_COPYCONTENTS, ainfo->imei, CURLFORM_END);
-		cache("IMEI", (const char *)ainfo->imei);
-		//free(ainfo->imei);
-	}
-	else {
-		cache("IMEI", "");
+		res |= form_field(&body, "IMEI", ainfo->imei);
 	}
-
 	if (ainfo->imsi != NULL) {
-		curl_formadd(&post, &last, CURLFORM_COPYNAME, "IMSI", CURLFORM_COPYCONTENTS, ainfo->imsi, CURLFORM_END);
-		cache("IMSI", (const char *)ainfo->imsi);
-		//free(ainfo->imsi);
+		res |= form_field(&body, "IMSI", ainfo->imsi);
 	}
-	else {
-		cache("IMSI", "");
-	}
-
 	if (ainfo->iccid != NULL) {
-		curl_formadd(&post, &last, CURLFORM_COPYNAME, "ICCID", CURLFORM_COPYCONTENTS, ainfo->iccid, CURLFORM_END);
-		cache("ICCID", (const char *)ainfo->iccid);
-		//free(ainfo->iccid);
-	}
-	else {
-		cache("ICCID", "");
+		res |= form_field(&body, "ICCID", ainfo->iccid);
 	}
-
 	if (ainfo->serial_number != NULL) {
-		curl_formadd(&post, &last, CURLFORM_COPYNAME, "AppleSerialNumber", CURLFORM_COPYCONTENTS, ainfo->serial_number, CURLFORM_END);
-		cache("SerialNumber", (const char *)ainfo->serial_number);
-		free(ainfo->serial_number);
+		res |= form_field(&body, "AppleSerialNumber", ainfo->serial_number);
 	}
-	else {
-		cache("SeralNumber", "");
+	res |= form_part(&body, "activation-info");
+	if (res != 0) {
+		error("Unable to allocate sufficent memory");
+		buffer_free(&body);
+		return -1;
 	}
 
-	if (activation_info != NULL) {
-		curl_formadd(&post, &last, CURLFORM_COPYNAME, "activation-info", CURLFORM_COPYCONTENTS, activation_info, CURLFORM_END);
-		cache("ActivationInfo", activation_info);
-		free(activation_info);
+	TRACE_BEGIN(serialize_start);
+	size_t info_start = body.length;
+	if (xml_write_fragment(&body, activation_info_node) != 0) {
+		error("Unable to serialize ActivationInfo");
+		buffer_free(&body);
+		return -1;
 	}
+	size_t info_length = body.length - info_start;
+	TRACE_END("serialize_activation_info", serialize_start);
 
-	struct curl_slist* header = NULL;
-	header = curl_slist_append(header, "X-Apple-Tz: -14400");
-	header = curl_slist_append(header, "X-Apple-Store-Front: 143441-1");
+	if (LOGGER_ENABLED(LOGGER_DEBUG)) {
+		logger_payload("ACTIVATION REQUEST", body.data + info_start, info_length);
+	}
+
+	/* all fields of a device go to the cache together, in a single write */
+	if (session->cache_mode == ACTIVATION_CACHE_WRITE) {
+		char* info = arena_alloc(&session->arena, info_length + 1);
+		if (info != NULL) {
+			memcpy(info, body.data + info_start, info_length);
+			info[info_length] = '\0';
+		}
+		plist_t fields = plist_new_dict();
+		activate_cache_field(fields, "UUID", props->uuid);
+		activate_cache_field(fields, "IMEI", ainfo->imei);
+		activate_cache_field(fields, "IMSI", ainfo->imsi);
+		activate_cache_field(fields, "ICCID", ainfo->iccid);
+		activate_cache_field(fields, "SerialNumber", ainfo->serial_number);
+		activate_cache_field(fields, "ActivationInfo", info);
+		cache_device(session->cache, props->uuid, fields);
+		plist_free(fields);
+	}
 
-	response = malloc(sizeof(activate_response));
-	if (response == NULL) {
+	if (form_end(&body) != 0 || response_init_arena(&request->response, &session->arena, RESPONSE_DEFAULT_LIMIT) != 0) {
 		error("Unable to allocate sufficent memory");
+		buffer_free(&body);
 		return -1;
 	}
 
-	response->length = 0;
-	response->content = malloc(1);
+	request->body = body;
+	request->pending = 1;
+
+	/* the headers are the template's, already on the handle, see http_setup() */
+	CURL* handle = session->http;
+	curl_easy_setopt(handle, CURLOPT_POSTFIELDS, body.data);
+	curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body.length);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &request->response);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &response_write_callback);
+	curl_easy_setopt(handle, CURLOPT_MAXFILESIZE, (long)RESPONSE_DEFAULT_LIMIT);
+	curl_easy_setopt(handle, CURLOPT_URL, http_url());
+	return 0;
+}
 
-	curl_easy_setopt(handle, CURLOPT_HTTPPOST, post);
-	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, header);
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, response);
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &activate_write_callback);
-	curl_easy_setopt(handle, CURLOPT_USERAGENT, "iTunes/9.1 (Macintosh; U; Intel Mac OS X 10.5.6)");
-	curl_easy_setopt(handle, CURLOPT_URL, "https://albert.apple.com/WebObjects/ALUnbrick.woa/wa/deviceActivation");
+/* Drops a request whether or not it was ever sent, on every path out of the
+ * request: the parts libplist owns are freed one by one, then everything in
+ * the session's arena goes at once. */
+void activate_discard(activation_session_t session)
+{
+	activation_request* request = &session->request;
 
-	curl_easy_perform(handle);
-	curl_slist_free_all(header);
-	curl_easy_cleanup(handle);
-	curl_global_cleanup();
+	props_release(request->props);
+	if (request->cached != NULL) {
+		plist_free(request->cached);
+	}
 
-	uint32_t ticket_size = response->length;
-	char* ticket_data = response->content;
+	if (request->pending) {
+		http_reset(session->http);
+		buffer_free(&request->body);
+		response_free(&request->response);
+	}
+	memset(request, 0, sizeof(activation_request));
+	arena_reset(&session->arena);
+}
 
-	char* ticket_start = strstr(ticket_data, "<plist");
-	if (ticket_start == NULL) {
-		error("Unable to locate beginning of ActivationInfo");
+/* The device side of the request comes from a single property snapshot, see
+ * props.c, so this costs one lockdownd round trip instead of one per field.
+ * The snapshot (and the cache entry, with -r) is kept with the session for
+ * activate_build(). */
+int activate_query(activation_session_t session) {
+	activation_request* request = &session->request;
+
+	TRACE_BEGIN(props_start);
+	session_stage(session, ACTIVATION_STAGE_QUERYING);
+	request->props = props_get(session->link, session->uuid);
+	TRACE_END("query_properties", props_start);
+	if (request->props == NULL) {
 		return -1;
 	}
 
-	char* ticket_stop = strstr(ticket_data, "</plist>");
-	if (ticket_stop == NULL) {
-		error("Unable to locate end of ActivationInfo");
+	if (session->cache_mode == ACTIVATION_CACHE_READ) {
+		request->cached = cache_lookup(session->cache, request->props->uuid);
+		if (request->cached == NULL) {
+			error("This device isn't in the cache");
+			activate_discard(session);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Turns what activate_query() found into a request waiting on session->http,
+ * to be sent with http_perform() or a multi handle and handed to
+ * activate_complete(). Doesn't touch the device. */
+int activate_build(activation_session_t session) {
+	activation_request* request = &session->request;
+
+	int res = activate_post(session, request->props, request->cached);
+
+	props_release(request->props);
+	request->props = NULL;
+	if (request->cached != NULL) {
+		plist_free(request->cached);
+		request->cached = NULL;
+	}
+
+	if (res != 0) {
+		activate_discard(session);
 		return -1;
 	}
 
-	ticket_stop += strlen("</plist>");
-	ticket_size = ticket_stop - ticket_start;
-	char* ticket = malloc(ticket_size + 1);
-	memset(ticket, '\0', ticket_size + 1);
-	memcpy(ticket, ticket_start, ticket_size);
-	free(ticket_data);
+	session_stage(session, ACTIVATION_STAGE_REQUESTING);
+	return 0;
+}
+
+int activate_prepare(activation_session_t session) {
+	if (activate_query(session) != 0) {
+		return -1;
+	}
+	return activate_build(session);
+}
 
-	//printf("%s\n\n", ticket);
+/* Journals the request activate_build() left on the session instead of
+ * sending it, see spool.c. Returns 1 once it's safely on disk. */
+int activate_spool(activation_session_t session) {
+	activation_request* request = &session->request;
 
-	plist_t ticket_dict = NULL;
-	plist_from_xml(ticket, ticket_size, &ticket_dict);
-	if (ticket_dict == NULL) {
-		error("Unable to convert activation ticket into plist");
+	int res = spool_put(session->uuid, form_boundary(), request->body.data, request->body.length);
+	activate_discard(session);
+	if (res != 0) {
 		return -1;
 	}
 
-	plist_t iphone_activation_node = plist_dict_get_item(ticket_dict, "iphone-activation");
-	if (!iphone_activation_node) {
-		iphone_activation_node = plist_dict_get_item(ticket_dict, "device-activation");
-		if (!iphone_activation_node) {
-			error("Unable to find device activation node");
-			return -1;
+	task("Activation request queued until the server can be reached");
+	return 1;
+}
+
+/* Turns the outcome of the transfer activate_prepare() set up into a record.
+ * With a spool, a request that couldn't get an answer is queued there and
+ * this returns 1. */
+int activate_complete(activation_session_t session, CURLcode res, plist_t* record) {
+	activation_request* request = &session->request;
+
+	/* a transfer we aborted for being too big still leaves a usable error */
+	if (res != CURLE_OK && !request->response.overflow) {
+		char m[256];
+		snprintf(m, sizeof(m), "Unable to reach the activation server: %s", curl_easy_strerror(res));
+		error(m);
+		if (spool_enabled()) {
+			return activate_spool(session);
 		}
+		activate_discard(session);
+		return -1;
 	}
 
-	plist_t activation_record = plist_dict_get_item(iphone_activation_node, "activation-record");
-	if (!activation_record) {
-		error("Unable to find activation record node");
+	/* what's left of a server error we've run out of retries for */
+	if (res == CURLE_OK && (request->response.status == 429 || request->response.status >= 500)) {
+		char m[256];
+		snprintf(m, sizeof(m), "The activation server answered %ld", request->response.status);
+		error(m);
+		if (spool_enabled()) {
+			return activate_spool(session);
+		}
+		activate_discard(session);
 		return -1;
 	}
 
-	*record = plist_copy(activation_record);
+	if (LOGGER_ENABLED(LOGGER_DEBUG)) {
+		logger_payload("ACTIVATION RESPONSE", request->response.body.data, request->response.body.length);
+	}
 
-	//free(response->content);
-	//free(response);
-	return 0;
+	TRACE_BEGIN(parse_start);
+	int ret = response_get_record(&request->response, record);
+	TRACE_END("parse_response", parse_start);
+	activate_discard(session);
+
+	if (ret == 0) {
+		records_save(session->uuid, *record);
+	}
+	return ret;
+}
+
+int activate_fetch_record(activation_session_t session, plist_t* record) {
+	TRACE_BEGIN(fetch_start);
+	if (activate_prepare(session) != 0) {
+		return -1;
+	}
+
+	CURLcode res = http_perform(session->http, &session->request.response, session->cancel);
+	int ret = activate_complete(session, res, record);
+	TRACE_END("fetch_record", fetch_start);
+	return ret;
 }
 
-int do_activation(lockdownd_client_t client, plist_t activation_record)
+static int activate_send(activation_session_t session, plist_t activation_record)
 {
-	printf("Activating device...\n");
+	char m[64];
 
-	// Just my little dump'n'run exercise with the activation record...
-	uint32_t len=0;
-	char **xml=NULL;
+	task("Activating device...");
 
-	plist_to_xml(activation_record, &xml, &len);
-	printf("ACTIVATION RECORD:\n\n%s\n\n", xml);
+	// Whoever is driving the session gets a look at the record first
+	if (session->callbacks.record != NULL) {
+		session->callbacks.record(session, activation_record, session->user_data);
+	}
 
 	// Let's do this!
-	lockdownd_error_t client_error = lockdownd_activate(client, activation_record);
-	if (client_error == LOCKDOWN_E_SUCCESS) {
-		printf("SUCCESS\n");
+	TRACE_BEGIN(activate_start);
+	METRICS_BEGIN(activate_time);
+	int client_error = device_transport_current->activate(session->link, activation_record);
+	TRACE_END("lockdownd_activate", activate_start);
+	METRICS_END(METRICS_LOCKDOWND_ACTIVATE, activate_time);
+	if (client_error == 0) {
+		task("SUCCESS");
 		return 0;
 	} else {
-		fprintf(stderr, "ERROR\nUnable to activate device: %d\n", client_error);
+		snprintf(m, sizeof(m), "Unable to activate device: %d", client_error);
+		error(m);
 		return -1;
 	}
+}
+
+int do_activation(activation_session_t session, plist_t activation_record)
+{
+	session_stage(session, ACTIVATION_STAGE_ACTIVATING);
+	return activate_send(session, activation_record);
+}
+
+/* Activates with the record stored for this device the last time we fetched
+ * one (see records.c), without going anywhere near the network. Returns 1 if
+ * there is no such record, so the caller knows to fetch a fresh one. */
+int activate_from_store(activation_session_t session)
+{
+	plist_t record = records_load(session->uuid);
+	if (record == NULL) {
+		return 1;
+	}
 
-	//plist_free(activation_record);
-	activation_record = NULL;
+	session_stage(session, ACTIVATION_STAGE_ACTIVATING_STORED);
+	info("Using the stored activation record for this device...");
+	int res = activate_send(session, record);
+	plist_free(record);
+	return (res == 0) ? 0 : -1;
 }
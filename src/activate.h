@@ -23,11 +23,18 @@
 #define ACTIVATE_H
 
 #include <plist/plist.h>
-#include <libimobiledevice/lockdown.h>
+#include "session.h"
 
-extern int activate_fetch_record(lockdownd_client_t client, plist_t* record, char* cust_imei, char* cust_imsi, char* cust_iccid, char* cust_serial_num);
-extern int do_activation(lockdownd_client_t client, plist_t activation_record);
+extern int activate_fetch_record(activation_session_t session, plist_t* record);
+extern int activate_prepare(activation_session_t session);
+extern int activate_query(activation_session_t session);
+extern int activate_build(activation_session_t session);
+extern int activate_complete(activation_session_t session, CURLcode res, plist_t* record);
+extern int activate_spool(activation_session_t session);
+extern void activate_discard(activation_session_t session);
+extern int do_activation(activation_session_t session, plist_t activation_record);
+extern int activate_from_store(activation_session_t session);
 
-extern void deactivate_device(lockdownd_client_t client);
+extern int deactivate_device(activation_session_t session);
 
 #endif
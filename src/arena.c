@@ -0,0 +1,111 @@
+/*
+ * arena.c
+ * A per-session bump allocator, released all at once.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+static arena_chunk* arena_chunk_new(size_t size)
+{
+	arena_chunk* chunk = malloc(sizeof(arena_chunk) + size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+int arena_init(arena_t* arena, size_t chunk_size)
+{
+	arena->chunk_size = (chunk_size > 0) ? chunk_size : ARENA_DEFAULT_CHUNK;
+	arena->first = arena_chunk_new(arena->chunk_size);
+	arena->current = arena->first;
+	return (arena->first != NULL) ? 0 : -1;
+}
+
+/* Nothing allocated here is ever freed on its own; it all goes at the next
+ * arena_reset() or arena_free(). Anything bigger than a chunk gets a chunk of
+ * its own. */
+void* arena_alloc(arena_t* arena, size_t size)
+{
+	arena_chunk* chunk = arena->current;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = arena_chunk_new((size > arena->chunk_size) ? size : arena->chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		if (arena->current != NULL) {
+			arena->current->next = chunk;
+		} else {
+			arena->first = chunk;
+		}
+		arena->current = chunk;
+	}
+
+	void* p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+char* arena_strdup(arena_t* arena, const char* str)
+{
+	size_t length = strlen(str) + 1;
+	char* copy = arena_alloc(arena, length);
+	if (copy != NULL) {
+		memcpy(copy, str, length);
+	}
+	return copy;
+}
+
+/* Gives back everything at once, keeping the first chunk for next time. */
+void arena_reset(arena_t* arena)
+{
+	arena_chunk* chunk = NULL;
+
+	if (arena->first == NULL) {
+		return;
+	}
+
+	chunk = arena->first->next;
+	while (chunk != NULL) {
+		arena_chunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->first->next = NULL;
+	arena->first->used = 0;
+	arena->current = arena->first;
+}
+
+void arena_free(arena_t* arena)
+{
+	arena_reset(arena);
+	free(arena->first);
+	arena->first = NULL;
+	arena->current = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * arena.h
+ * A per-session bump allocator, released all at once.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* big enough for one activation request and its reply without a second chunk */
+#define ARENA_DEFAULT_CHUNK 0x10000
+
+typedef struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size;
+	size_t used;
+	char data[];
+} arena_chunk;
+
+typedef struct {
+	arena_chunk* first;    /* kept across resets, so a steady load never mallocs */
+	arena_chunk* current;
+	size_t chunk_size;
+} arena_t;
+
+extern int arena_init(arena_t* arena, size_t chunk_size);
+extern void* arena_alloc(arena_t* arena, size_t size);
+extern char* arena_strdup(arena_t* arena, const char* str);
+extern void arena_reset(arena_t* arena);
+extern void arena_free(arena_t* arena);
+
+#endif
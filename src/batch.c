@@ -0,0 +1,701 @@
+/*
+ * batch.c
+ * Runs a manifest of per-device jobs and reports each as a JSON line.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libideviceactivate.h"
+#include "batch.h"
+#include "buffer.h"
+#include "logger.h"
+#include "trace.h"
+#include "transport.h"
+#include "util.h"
+
+#define BATCH_MAX_COLUMNS 16
+
+typedef enum {
+	BATCH_ACTIVATE = 0,
+	BATCH_DEACTIVATE,
+	BATCH_REACTIVATE   /* deactivate, then activate again */
+} batch_action;
+
+static const char* batch_action_names[] = { "activate", "deactivate", "reactivate" };
+
+static const char* batch_keys[] = {
+	"udid", "uuid", "action", "imei", "imsi", "iccid", "serial", "serial_number", "record", NULL
+};
+
+/* One manifest line. The strings point into the manifest text, which stays
+ * around until the whole batch is done. */
+typedef struct {
+	int line;
+	batch_action action;
+	char* uuid;
+	char* record;            /* activate with this file instead of asking the server */
+	activation_options_t options;
+
+	activation_stage_t stage;
+	activation_error_t err;
+	const char* status;
+	const char* outcome;     /* skipped, activated, deactivated, reactivated or queued */
+	char message[256];       /* the last error the session reported */
+	double elapsed;
+} batch_job;
+
+typedef struct {
+	batch_job* jobs;
+	int count;
+	int next;
+	int failed;
+	int queued;
+	pthread_mutex_t lock;    /* guards next, failed, queued and stdout */
+} batch_queue;
+
+static void batch_error(const char* manifest, int line, const char* what)
+{
+	char m[512];
+	snprintf(m, sizeof(m), "%s:%d: %s", manifest, line, what);
+	error(m);
+}
+
+static int batch_known(const char* key)
+{
+	int i = 0;
+	for (i = 0; batch_keys[i] != NULL; i++) {
+		if (!strcmp(key, batch_keys[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Takes one named value from either format. Empty values are the same as
+ * leaving the column out. */
+static int batch_set(batch_job* job, const char* key, char* value)
+{
+	if (value == NULL || *value == '\0') {
+		return 0;
+	}
+
+	if (!strcmp(key, "udid") || !strcmp(key, "uuid")) {
+		job->uuid = value;
+	} else if (!strcmp(key, "imei")) {
+		job->options.imei = value;
+	} else if (!strcmp(key, "imsi")) {
+		job->options.imsi = value;
+	} else if (!strcmp(key, "iccid")) {
+		job->options.iccid = value;
+	} else if (!strcmp(key, "serial") || !strcmp(key, "serial_number")) {
+		job->options.serial_number = value;
+	} else if (!strcmp(key, "record")) {
+		job->record = value;
+	} else if (!strcmp(key, "action")) {
+		if (!strcasecmp(value, "activate")) {
+			job->action = BATCH_ACTIVATE;
+		} else if (!strcasecmp(value, "deactivate")) {
+			job->action = BATCH_DEACTIVATE;
+		} else if (!strcasecmp(value, "reactivate")) {
+			job->action = BATCH_REACTIVATE;
+		} else {
+			return -1;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static char* batch_trim(char* s)
+{
+	char* end = NULL;
+
+	while (isspace((unsigned char)*s)) {
+		s++;
+	}
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1])) {
+		*--end = '\0';
+	}
+	return s;
+}
+
+/* Splits one CSV line in place. Fields may be "quoted", with "" for a quote
+ * inside. Returns the number of fields, or -1 if there are too many. */
+static int batch_csv_split(char* line, char** fields, int max)
+{
+	int count = 0;
+	char* p = line;
+
+	while (1) {
+		char* field = NULL;
+
+		while (*p == ' ' || *p == '\t') {
+			p++;
+		}
+		if (*p == '"') {
+			char* out = ++p;
+			field = out;
+			while (*p != '\0') {
+				if (*p == '"' && p[1] == '"') {
+					*out++ = '"';
+					p += 2;
+				} else if (*p == '"') {
+					p++;
+					break;
+				} else {
+					*out++ = *p++;
+				}
+			}
+			while (*p != ',' && *p != '\0') {
+				p++;
+			}
+			*out = '\0';
+		} else {
+			field = p;
+			while (*p != ',' && *p != '\0') {
+				p++;
+			}
+		}
+
+		if (count == max) {
+			return -1;
+		}
+
+		int last = (*p == '\0');
+		*p++ = '\0';
+		fields[count++] = batch_trim(field);
+		if (last) {
+			break;
+		}
+	}
+	return count;
+}
+
+static void batch_utf8(char** out, unsigned int c)
+{
+	char* o = *out;
+
+	if (c < 0x80) {
+		*o++ = c;
+	} else if (c < 0x800) {
+		*o++ = 0xc0 | (c >> 6);
+		*o++ = 0x80 | (c & 0x3f);
+	} else {
+		*o++ = 0xe0 | (c >> 12);
+		*o++ = 0x80 | ((c >> 6) & 0x3f);
+		*o++ = 0x80 | (c & 0x3f);
+	}
+	*out = o;
+}
+
+/* Decodes the JSON string starting at the opening quote in place, leaving
+ * *p just past the closing one. Never grows, \uXXXX included. */
+static char* batch_json_string(char** p)
+{
+	char* s = *p;
+	char* out = NULL;
+	char* start = NULL;
+
+	if (*s != '"') {
+		return NULL;
+	}
+	start = out = ++s;
+
+	while (*s != '"') {
+		if (*s == '\0') {
+			return NULL;
+		}
+		if (*s != '\\') {
+			*out++ = *s++;
+			continue;
+		}
+
+		s++;
+		switch (*s++) {
+		case '"': *out++ = '"'; break;
+		case '\\': *out++ = '\\'; break;
+		case '/': *out++ = '/'; break;
+		case 'b': *out++ = '\b'; break;
+		case 'f': *out++ = '\f'; break;
+		case 'n': *out++ = '\n'; break;
+		case 'r': *out++ = '\r'; break;
+		case 't': *out++ = '\t'; break;
+		case 'u': {
+			unsigned int c = 0;
+			int i = 0;
+			for (i = 0; i < 4; i++) {
+				if (!isxdigit((unsigned char)s[i])) {
+					return NULL;
+				}
+				c = (c << 4) | (isdigit((unsigned char)s[i]) ? s[i] - '0' : (tolower((unsigned char)s[i]) - 'a' + 10));
+			}
+			if (c == 0) {
+				return NULL;
+			}
+			batch_utf8(&out, c);
+			s += 4;
+			break;
+		}
+		default:
+			return NULL;
+		}
+	}
+
+	*out = '\0';
+	*p = s + 1;
+	return start;
+}
+
+static void batch_json_space(char** p)
+{
+	while (isspace((unsigned char)**p)) {
+		(*p)++;
+	}
+}
+
+/* A JSONL line is one flat object of strings (or nulls). */
+static int batch_json_line(char* line, batch_job* job)
+{
+	char* p = line;
+
+	batch_json_space(&p);
+	if (*p++ != '{') {
+		return -1;
+	}
+	batch_json_space(&p);
+	while (*p != '}') {
+		char* key = batch_json_string(&p);
+		char* value = NULL;
+
+		if (key == NULL) {
+			return -1;
+		}
+		batch_json_space(&p);
+		if (*p++ != ':') {
+			return -1;
+		}
+		batch_json_space(&p);
+		if (!strncmp(p, "null", 4)) {
+			p += 4;
+		} else if ((value = batch_json_string(&p)) == NULL) {
+			return -1;
+		}
+		if (batch_set(job, key, value) != 0) {
+			return -1;
+		}
+
+		batch_json_space(&p);
+		if (*p == ',') {
+			p++;
+			batch_json_space(&p);
+			if (*p != '"') {
+				return -1;
+			}
+		} else if (*p != '}') {
+			return -1;
+		}
+	}
+	p++;
+
+	batch_json_space(&p);
+	return (*p == '\0') ? 0 : -1;
+}
+
+/* Reads the manifest into jobs. CSV needs a header line naming its columns,
+ * JSONL (told apart by its first line starting with '{') names them on every
+ * line. Blank lines and lines starting with '#' are skipped either way. Any
+ * mistake fails the whole manifest, before a single device is touched. */
+static int batch_load(const char* manifest, char** text, batch_job** jobs, int* count, const activation_options_t* options)
+{
+	char* columns[BATCH_MAX_COLUMNS];
+	int ncolumns = 0;
+	int json = -1;
+	uint32_t length = 0;
+	int line = 0;
+	int i = 0;
+	char* p = NULL;
+
+	*text = NULL;
+	*jobs = NULL;
+	*count = 0;
+
+	if (buffer_read_from_filename(manifest, text, &length) < 0) {
+		return -1;
+	}
+	char* grown = realloc(*text, length + 1);
+	if (grown == NULL) {
+		error("Unable to allocate sufficent memory");
+		return -1;
+	}
+	*text = grown;
+	(*text)[length] = '\0';
+
+	/* one job per line at most */
+	int lines = 1;
+	for (p = *text; *p != '\0'; p++) {
+		lines += (*p == '\n');
+	}
+	*jobs = calloc(lines, sizeof(batch_job));
+	if (*jobs == NULL) {
+		error("Unable to allocate sufficent memory");
+		return -1;
+	}
+
+	char* next = *text;
+	while (next != NULL) {
+		char* raw = next;
+		next = strchr(raw, '\n');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+		line++;
+
+		char* s = batch_trim(raw);
+		if (*s == '\0' || *s == '#') {
+			continue;
+		}
+
+		if (json < 0) {
+			json = (*s == '{');
+			if (!json) {
+				ncolumns = batch_csv_split(s, columns, BATCH_MAX_COLUMNS);
+				if (ncolumns < 0) {
+					batch_error(manifest, line, "too many columns in the header");
+					return -1;
+				}
+				for (i = 0; i < ncolumns; i++) {
+					if (!batch_known(columns[i])) {
+						batch_error(manifest, line, "unknown column in the header");
+						return -1;
+					}
+				}
+				continue;
+			}
+		}
+
+		batch_job* job = &(*jobs)[*count];
+		job->line = line;
+		if (options != NULL) {
+			job->options = *options;
+		}
+
+		if (json) {
+			if (batch_json_line(s, job) != 0) {
+				batch_error(manifest, line, "expected one object of string values with known keys");
+				return -1;
+			}
+		} else {
+			char* fields[BATCH_MAX_COLUMNS];
+			int n = batch_csv_split(s, fields, BATCH_MAX_COLUMNS);
+			if (n < 0 || n > ncolumns) {
+				batch_error(manifest, line, "more fields than the header has columns");
+				return -1;
+			}
+			for (i = 0; i < n; i++) {
+				if (batch_set(job, columns[i], fields[i]) != 0) {
+					batch_error(manifest, line, "unknown action");
+					return -1;
+				}
+			}
+		}
+
+		if (job->uuid == NULL) {
+			batch_error(manifest, line, "no udid");
+			return -1;
+		}
+		if (job->record != NULL && job->action == BATCH_DEACTIVATE) {
+			batch_error(manifest, line, "a record file only makes sense when activating");
+			return -1;
+		}
+		for (i = 0; i < *count; i++) {
+			if (!strcmp((*jobs)[i].uuid, job->uuid)) {
+				batch_error(manifest, line, "this udid is already in the manifest");
+				return -1;
+			}
+		}
+		(*count)++;
+	}
+
+	if (*count == 0) {
+		batch_error(manifest, line, "no devices in the manifest");
+		return -1;
+	}
+	return 0;
+}
+
+static void batch_stage(activation_session_t session, activation_stage_t stage, void* user_data)
+{
+	((batch_job*)user_data)->stage = stage;
+}
+
+/* Keeps the terminal quiet, so stdout is nothing but results, and remembers
+ * the last error for the job's line. */
+static void batch_message(activation_session_t session, int is_error, const char* message, void* user_data)
+{
+	batch_job* job = (batch_job*)user_data;
+	if (is_error) {
+		snprintf(job->message, sizeof(job->message), "%s", message);
+	}
+}
+
+/* What the job did to the device, for the result line: with reconcile (-C)
+ * a device already where the manifest wants it is "skipped". */
+static void batch_activate(batch_job* job)
+{
+	activation_callbacks_t callbacks = { batch_stage, batch_message, NULL, NULL };
+	activation_session_t session = NULL;
+	int deactivated = 0;
+	double start = seconds_now();
+
+	trace_set_uuid(job->uuid);
+	TRACE_BEGIN(job_start);
+
+	job->err = activation_session_new(&session, job->uuid, &job->options, &callbacks, job);
+	if (job->err == ACTIVATION_E_SUCCESS && job->action != BATCH_ACTIVATE) {
+		job->stage = 0;
+		job->err = activation_session_deactivate(session);
+		deactivated = (job->stage != ACTIVATION_STAGE_SKIPPED);
+		job->status = deactivated ? "deactivated" : "already deactivated, skipped";
+		job->outcome = deactivated ? "deactivated" : "skipped";
+	}
+
+	if (job->err == ACTIVATION_E_SUCCESS && job->action != BATCH_DEACTIVATE) {
+		job->stage = 0;
+		if (job->record != NULL) {
+			plist_t record = NULL;
+			if (plist_read_from_filename(&record, job->record) < 0) {
+				snprintf(job->message, sizeof(job->message), "Unable to read activation record from %s", job->record);
+				job->err = ACTIVATION_E_INVALID_ARG;
+			} else {
+				job->err = activation_session_activate(session, record);
+				job->status = deactivated ? "reactivated from record file" : "activated from record file";
+				plist_free(record);
+			}
+		} else {
+			job->err = activation_session_run(session);
+			if (job->stage == ACTIVATION_STAGE_ACTIVATING_STORED) {
+				job->status = deactivated ? "reactivated from stored record" : "activated from stored record";
+			} else {
+				job->status = deactivated ? "reactivated" : "activated";
+			}
+		}
+
+		if (job->stage == ACTIVATION_STAGE_SKIPPED) {
+			job->status = "already activated, skipped";
+			job->outcome = "skipped";
+		} else {
+			job->outcome = deactivated ? "reactivated" : "activated";
+		}
+	}
+	activation_session_free(session);
+
+	if (job->err != ACTIVATION_E_SUCCESS) {
+		job->status = activation_strerror(job->err);
+		job->outcome = (job->err == ACTIVATION_E_QUEUED) ? "queued" : NULL;
+	}
+	job->elapsed = seconds_now() - start;
+
+	TRACE_END("activation", job_start);
+}
+
+static void batch_json_escape(buffer_t* out, const char* s)
+{
+	char hex[8];
+
+	for (; *s != '\0'; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			buffer_append(out, "\\", 1);
+			buffer_append(out, s, 1);
+		} else if (c < 0x20) {
+			snprintf(hex, sizeof(hex), "\\u%04x", c);
+			buffer_append_str(out, hex);
+		} else {
+			buffer_append(out, s, 1);
+		}
+	}
+}
+
+static void batch_json_field(buffer_t* out, const char* key, const char* value)
+{
+	buffer_append_str(out, ",\"");
+	buffer_append_str(out, key);
+	buffer_append_str(out, "\":\"");
+	batch_json_escape(out, value);
+	buffer_append_str(out, "\"");
+}
+
+/* Writes the job's result line as soon as it is through, so whatever reads
+ * the output can act on a device while the rest of the tray is still going. */
+static void batch_report(batch_queue* queue, batch_job* job)
+{
+	buffer_t out;
+	char number[64];
+	int ok = (job->err == ACTIVATION_E_SUCCESS);
+
+	if (buffer_init(&out, 256) != 0) {
+		return;
+	}
+
+	snprintf(number, sizeof(number), "{\"line\":%d", job->line);
+	buffer_append_str(&out, number);
+	batch_json_field(&out, "udid", job->uuid);
+	batch_json_field(&out, "action", batch_action_names[job->action]);
+	buffer_append_str(&out, ok ? ",\"ok\":true" : ",\"ok\":false");
+	if (job->outcome != NULL) {
+		batch_json_field(&out, "outcome", job->outcome);
+	}
+	batch_json_field(&out, "status", job->status ? job->status : "not started");
+	if (!ok && job->message[0] != '\0') {
+		batch_json_field(&out, "message", job->message);
+	}
+	snprintf(number, sizeof(number), ",\"elapsed\":%.3f}\n", job->elapsed);
+	buffer_append_str(&out, number);
+
+	pthread_mutex_lock(&queue->lock);
+	fwrite(out.data, 1, out.length, stdout);
+	fflush(stdout);
+	if (job->err == ACTIVATION_E_QUEUED) {
+		queue->queued++;
+	} else if (!ok) {
+		queue->failed++;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	buffer_free(&out);
+}
+
+static void* batch_worker(void* arg)
+{
+	batch_queue* queue = (batch_queue*)arg;
+
+	while (1) {
+		pthread_mutex_lock(&queue->lock);
+		int index = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (index >= queue->count) {
+			break;
+		}
+
+		batch_activate(&queue->jobs[index]);
+		batch_report(queue, &queue->jobs[index]);
+	}
+
+	return NULL;
+}
+
+/* Runs every job in the manifest, WORKERS devices at a time (zero meaning all
+ * of them), writing one JSON line per device to stdout as it finishes. Jobs
+ * for devices that aren't attached fail straight away. Returns the number of
+ * jobs that failed, or -1 if the manifest couldn't be used at all. */
+int batch_run(const char* manifest, int workers, const activation_options_t* options)
+{
+	batch_queue queue;
+	batch_job* jobs = NULL;
+	char* text = NULL;
+	char** devices = NULL;
+	int attached = 0;
+	int count = 0;
+	int i = 0;
+	int j = 0;
+
+	if (batch_load(manifest, &text, &jobs, &count, options) != 0) {
+		free(jobs);
+		free(text);
+		return -1;
+	}
+
+	if (device_transport_current->list(&devices, &attached) != 0) {
+		devices = NULL;
+		attached = 0;
+	}
+
+	memset(&queue, 0, sizeof(queue));
+	pthread_mutex_init(&queue.lock, NULL);
+
+	/* attached devices go to the front of the queue, the rest are reported now */
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < attached; j++) {
+			if (!strcmp(jobs[i].uuid, devices[j])) {
+				break;
+			}
+		}
+		if (j < attached) {
+			batch_job job = jobs[queue.count];
+			jobs[queue.count++] = jobs[i];
+			jobs[i] = job;
+		} else {
+			jobs[i].err = ACTIVATION_E_NO_DEVICE;
+			jobs[i].status = "not attached";
+			batch_report(&queue, &jobs[i]);
+		}
+	}
+
+	if (workers <= 0 || workers > queue.count) {
+		workers = queue.count;
+	}
+
+	double start = seconds_now();
+	pthread_t* threads = calloc(workers > 0 ? workers : 1, sizeof(pthread_t));
+	queue.jobs = jobs;
+
+	for (i = 0; i < workers; i++) {
+		if (threads == NULL || pthread_create(&threads[i], NULL, batch_worker, &queue) != 0) {
+			error("Unable to start worker thread");
+			workers = i;
+			break;
+		}
+	}
+
+	/* if no thread could be started at all, do the work on this one */
+	if (workers == 0) {
+		batch_worker(&queue);
+	}
+
+	for (i = 0; i < workers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	logger_flush();
+	fprintf(stderr, "%d of %d device(s) succeeded in %.2fs", count - queue.failed - queue.queued, count, seconds_now() - start);
+	if (queue.queued > 0) {
+		fprintf(stderr, ", %d queued until the server can be reached", queue.queued);
+	}
+	fprintf(stderr, "\n");
+
+	int failed = queue.failed;
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+	if (devices != NULL) {
+		device_transport_current->list_free(devices);
+	}
+	free(jobs);
+	free(text);
+
+	return failed;
+}
@@ -0,0 +1,29 @@
+/*
+ * batch.h
+ * Runs a manifest of per-device jobs and reports each as a JSON line.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "libideviceactivate.h"
+
+extern int batch_run(const char* manifest, int workers, const activation_options_t* options);
+
+#endif
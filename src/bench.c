@@ -0,0 +1,812 @@
+/*
+ * bench.c
+ * Microbenchmarks for the plist, XML and string handling on the activation
+ * path. Prints one JSON object per line so runs can be diffed and tracked.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <plist/plist.h>
+
+#include "arena.h"
+#include "buffer.h"
+#include "form.h"
+#include "records.h"
+#include "response.h"
+#include "store.h"
+#include "util.h"
+#include "xml.h"
+
+#define BENCH_RUNS 7
+#define PRELOAD_FILES 2000
+#define PRELOAD_SIZE 8192
+
+/* payload sizes for the large blob in each fixture, roughly what small,
+ * typical and oversized devices send and get back */
+static const int fixture_sizes[] = { 2048, 8192, 65536 };
+#define FIXTURE_COUNT (sizeof(fixture_sizes) / sizeof(fixture_sizes[0]))
+
+static FILE* out = NULL;
+static const char* filter = NULL;
+
+typedef void (*bench_fn)(void* ctx);
+
+/* ------------------------------------------------------------------ */
+/* fixtures                                                            */
+/* ------------------------------------------------------------------ */
+
+/* deterministic filler, so every run benchmarks the same bytes */
+static void fill(char* data, size_t length, uint32_t seed)
+{
+	size_t i = 0;
+	for (i = 0; i < length; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (char)(seed >> 16);
+	}
+}
+
+static plist_t new_blob(size_t length, uint32_t seed)
+{
+	char* data = malloc(length);
+	fill(data, length, seed);
+	plist_t node = plist_new_data(data, length);
+	free(data);
+	return node;
+}
+
+/* Shaped like what lockdownd hands out: a dict of a few base64 blobs. */
+static plist_t fixture_activation_info(int size)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "ActivationInfoComplete", plist_new_bool(1));
+	plist_dict_set_item(dict, "ActivationInfoXML", new_blob(size, 1));
+	plist_dict_set_item(dict, "FairPlayCertChain", new_blob(1200, 2));
+	plist_dict_set_item(dict, "FairPlaySignature", new_blob(128, 3));
+	return dict;
+}
+
+static plist_t fixture_activation_record(int size)
+{
+	plist_t record = plist_new_dict();
+	plist_dict_set_item(record, "AccountTokenCertificate", new_blob(1024, 4));
+	plist_dict_set_item(record, "AccountToken", new_blob(size, 5));
+	plist_dict_set_item(record, "AccountTokenSignature", new_blob(128, 6));
+	plist_dict_set_item(record, "DeviceCertificate", new_blob(2048, 7));
+	plist_dict_set_item(record, "FairPlayKeyData", new_blob(size / 2, 8));
+	plist_dict_set_item(record, "unbrick", plist_new_bool(1));
+	return record;
+}
+
+/* What the server sends back: some HTML around a plist holding the record. */
+static char* fixture_response(int size, size_t* length)
+{
+	char* xml = NULL;
+	uint32_t xml_length = 0;
+	buffer_t body;
+
+	plist_t ticket = plist_new_dict();
+	plist_t activation = plist_new_dict();
+	plist_dict_set_item(activation, "activation-record", fixture_activation_record(size));
+	plist_dict_set_item(activation, "ack-received", plist_new_bool(1));
+	plist_dict_set_item(ticket, "iphone-activation", activation);
+	plist_to_xml(ticket, &xml, &xml_length);
+	plist_free(ticket);
+
+	buffer_init(&body, xml_length + 1024);
+	buffer_append_str(&body, "<!DOCTYPE html>\n<html><head><title>iPhone Activation</title>\n<script id=\"protocol\" type=\"text/x-apple-plist\">");
+	buffer_append(&body, xml, xml_length);
+	buffer_append_str(&body, "</script></head><body></body></html>\n");
+	free(xml);
+
+	*length = body.length;
+	return body.data;
+}
+
+/* Puts a fixture on disk for the file benchmarks, 0 on success */
+static int fixture_write(const char* fname, const char* data, size_t length)
+{
+	FILE* fp = fopen(fname, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to create %s\n", fname);
+		return -1;
+	}
+	size_t written = fwrite(data, 1, length, fp);
+	if (fclose(fp) != 0 || written != length) {
+		fprintf(stderr, "Unable to write %s\n", fname);
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* harness                                                             */
+/* ------------------------------------------------------------------ */
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* Runs fn enough times to take ~20ms, then does that BENCH_RUNS times and
+ * reports the fastest and the median run. */
+static void bench(const char* name, int size, size_t bytes, bench_fn fn, void* ctx)
+{
+	double runs[BENCH_RUNS];
+	long iterations = 1;
+	int i = 0;
+	long n = 0;
+
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+
+	/* warm up and calibrate */
+	while (1) {
+		double start = now_ns();
+		for (n = 0; n < iterations; n++) {
+			fn(ctx);
+		}
+		if (now_ns() - start > 20e6 || iterations >= (1L << 24)) {
+			break;
+		}
+		iterations *= 2;
+	}
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		double start = now_ns();
+		for (n = 0; n < iterations; n++) {
+			fn(ctx);
+		}
+		runs[i] = (now_ns() - start) / iterations;
+	}
+	qsort(runs, BENCH_RUNS, sizeof(double), compare_double);
+
+	fprintf(out, "{\"bench\":\"%s\",\"size\":%d,\"bytes\":%zu,\"iterations\":%ld,\"ns_min\":%.1f,\"ns_median\":%.1f,\"mb_per_s\":%.1f}\n",
+		name, size, bytes, iterations, runs[0], runs[BENCH_RUNS / 2],
+		(bytes > 0) ? (bytes / (runs[BENCH_RUNS / 2] / 1e9)) / 1e6 : 0.0);
+	fflush(out);
+}
+
+/* ------------------------------------------------------------------ */
+/* ActivationInfo serialization                                        */
+/* ------------------------------------------------------------------ */
+
+/* what activate_fetch_record() used to do: whole document, two scans, copy */
+static void legacy_activation_info(void* ctx)
+{
+	uint32_t size = 0;
+	char* data = NULL;
+	plist_to_xml((plist_t)ctx, &data, &size);
+
+	char* start = strstr(data, "<dict>");
+	char* stop = strstr(data, "</dict>") + strlen("</dict>");
+	size = stop - start;
+	char* fragment = malloc(size + 1);
+	memset(fragment, '\0', size + 1);
+	memcpy(fragment, start, size);
+
+	free(fragment);
+	free(data);
+}
+
+static void fragment_activation_info(void* ctx)
+{
+	buffer_t buffer;
+	buffer_init(&buffer, 0x4000);
+	xml_write_fragment(&buffer, (plist_t)ctx);
+	buffer_free(&buffer);
+}
+
+/* ------------------------------------------------------------------ */
+/* request body                                                        */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+	plist_t activation_info;
+	arena_t arena;
+} request_ctx;
+
+static size_t legacy_form_sink(void* arg, const char* data, size_t length)
+{
+	*(size_t*)arg += length;
+	return length;
+}
+
+/* what activate_post() used to do: every field copied by curl_formadd(), a
+ * new header list each time, and libcurl encoding the form as it's sent.
+ * The form API is deprecated, which is the point of the comparison. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+static void legacy_request_body(void* arg)
+{
+	request_ctx* ctx = (request_ctx*)arg;
+	struct curl_httppost* post = NULL;
+	struct curl_httppost* last = NULL;
+	size_t sent = 0;
+
+	buffer_t fragment;
+	buffer_init(&fragment, 0x4000);
+	xml_write_fragment(&fragment, ctx->activation_info);
+
+	curl_formadd(&post, &last, CURLFORM_COPYNAME, "machineName", CURLFORM_COPYCONTENTS, "linux", CURLFORM_END);
+	curl_formadd(&post, &last, CURLFORM_COPYNAME, "InStoreActivation", CURLFORM_COPYCONTENTS, "false", CURLFORM_END);
+	curl_formadd(&post, &last, CURLFORM_COPYNAME, "IMEI", CURLFORM_COPYCONTENTS, "013000000000000", CURLFORM_END);
+	curl_formadd(&post, &last, CURLFORM_COPYNAME, "IMSI", CURLFORM_COPYCONTENTS, "310410000000000", CURLFORM_END);
+	curl_formadd(&post, &last, CURLFORM_COPYNAME, "ICCID", CURLFORM_COPYCONTENTS, "8901410000000000000", CURLFORM_END);
+	curl_formadd(&post, &last, CURLFORM_COPYNAME, "AppleSerialNumber", CURLFORM_COPYCONTENTS, "SERIAL", CURLFORM_END);
+	curl_formadd(&post, &last, CURLFORM_COPYNAME, "activation-info", CURLFORM_PTRCONTENTS, fragment.data, CURLFORM_CONTENTSLENGTH, (long)fragment.length, CURLFORM_END);
+
+	struct curl_slist* header = NULL;
+	header = curl_slist_append(header, "X-Apple-Tz: -14400");
+	header = curl_slist_append(header, "X-Apple-Store-Front: 143441-1");
+
+	curl_formget(post, &sent, legacy_form_sink);
+
+	curl_slist_free_all(header);
+	curl_formfree(post);
+	buffer_free(&fragment);
+}
+#pragma GCC diagnostic pop
+
+static void template_request_body(void* arg)
+{
+	request_ctx* ctx = (request_ctx*)arg;
+	buffer_t body;
+
+	buffer_init_arena(&body, &ctx->arena, 0x4000);
+	form_begin(&body);
+	form_field(&body, "IMEI", "013000000000000");
+	form_field(&body, "IMSI", "310410000000000");
+	form_field(&body, "ICCID", "8901410000000000000");
+	form_field(&body, "AppleSerialNumber", "SERIAL");
+	form_part(&body, "activation-info");
+	xml_write_fragment(&body, ctx->activation_info);
+	form_end(&body);
+
+	arena_reset(&ctx->arena);
+}
+
+/* ------------------------------------------------------------------ */
+/* response accumulation and ticket parsing                            */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+	const char* data;
+	size_t length;
+	size_t chunk;
+} response_ctx;
+
+typedef struct {
+	int length;
+	char* content;
+} legacy_response;
+
+static size_t legacy_write_callback(char* data, size_t size, size_t nmemb, legacy_response* response)
+{
+	size_t total = size * nmemb;
+	if (total != 0) {
+		response->content = realloc(response->content, response->length + total + 1);
+		memcpy(response->content + response->length, data, total);
+		response->content[response->length + total] = '\0';
+		response->length += total;
+	}
+	return total;
+}
+
+static void legacy_accumulate(void* arg)
+{
+	response_ctx* ctx = (response_ctx*)arg;
+	legacy_response response;
+	size_t i = 0;
+
+	response.length = 0;
+	response.content = malloc(1);
+	for (i = 0; i < ctx->length; i += ctx->chunk) {
+		size_t n = (ctx->length - i < ctx->chunk) ? ctx->length - i : ctx->chunk;
+		legacy_write_callback((char*)ctx->data + i, 1, n, &response);
+	}
+
+	/* the scan and copy that used to follow */
+	char* start = strstr(response.content, "<plist");
+	char* stop = strstr(response.content, "</plist>") + strlen("</plist>");
+	char* ticket = malloc(stop - start + 1);
+	memset(ticket, '\0', stop - start + 1);
+	memcpy(ticket, start, stop - start);
+
+	free(ticket);
+	free(response.content);
+}
+
+static void streaming_accumulate(void* arg)
+{
+	response_ctx* ctx = (response_ctx*)arg;
+	activate_response response;
+	size_t i = 0;
+
+	response_init(&response, 0);
+	for (i = 0; i < ctx->length; i += ctx->chunk) {
+		size_t n = (ctx->length - i < ctx->chunk) ? ctx->length - i : ctx->chunk;
+		response_write_callback((char*)ctx->data + i, 1, n, &response);
+	}
+	response_free(&response);
+}
+
+static void legacy_ticket_parse(void* arg)
+{
+	response_ctx* ctx = (response_ctx*)arg;
+	plist_t ticket_dict = NULL;
+
+	char* start = strstr(ctx->data, "<plist");
+	char* stop = strstr(ctx->data, "</plist>") + strlen("</plist>");
+	uint32_t size = stop - start;
+	char* ticket = malloc(size + 1);
+	memset(ticket, '\0', size + 1);
+	memcpy(ticket, start, size);
+
+	plist_from_xml(ticket, size, &ticket_dict);
+	plist_t record = plist_copy(plist_dict_get_item(plist_dict_get_item(ticket_dict, "iphone-activation"), "activation-record"));
+
+	plist_free(record);
+	plist_free(ticket_dict);
+	free(ticket);
+}
+
+static void streaming_ticket_parse(void* arg)
+{
+	response_ctx* ctx = (response_ctx*)arg;
+	activate_response response;
+	plist_t record = NULL;
+
+	response_init(&response, 0);
+	response_feed(&response, ctx->data, ctx->length);
+	response_get_record(&response, &record);
+	plist_free(record);
+	response_free(&response);
+}
+
+/* ------------------------------------------------------------------ */
+/* record files                                                        */
+/* ------------------------------------------------------------------ */
+
+/* what plist_read_from_filename() used to do: fseek/ftell, malloc, fread */
+static plist_t legacy_read_plist(const char* filename)
+{
+	plist_t record = NULL;
+	FILE* f = fopen(filename, "rb");
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	char* data = malloc(size);
+	if (fread(data, 1, size, f) == (size_t)size) {
+		if (memcmp(data, "bplist00", 8) == 0) {
+			plist_from_bin(data, size, &record);
+		} else {
+			plist_from_xml(data, size, &record);
+		}
+	}
+	free(data);
+	fclose(f);
+	return record;
+}
+
+static void legacy_read_record_file(void* ctx)
+{
+	plist_free(legacy_read_plist((const char*)ctx));
+}
+
+static void read_record_file(void* ctx)
+{
+	plist_t record = NULL;
+	plist_read_from_filename(&record, (const char*)ctx);
+	plist_free(record);
+}
+
+/* ------------------------------------------------------------------ */
+/* cache                                                               */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+	store_t* store;
+	plist_t fields;
+	char* dir;
+	int next;
+	int keys;
+} cache_ctx;
+
+static const char* cache_fields[] = { "UUID", "IMEI", "IMSI", "ICCID", "SerialNumber", "ActivationInfo" };
+
+static void cache_key(char* key, int i)
+{
+	snprintf(key, 48, "%040d", i);
+}
+
+static void store_write(void* arg)
+{
+	cache_ctx* ctx = (cache_ctx*)arg;
+	char key[48];
+	cache_key(key, ctx->next++ % ctx->keys);
+	store_put(ctx->store, key, ctx->fields);
+}
+
+static void store_read(void* arg)
+{
+	cache_ctx* ctx = (cache_ctx*)arg;
+	char key[48];
+	plist_t fields = NULL;
+	cache_key(key, ctx->next++ % ctx->keys);
+	store_get(ctx->store, key, &fields);
+	plist_free(fields);
+}
+
+/* the old layout: one directory per device, one small file per field */
+static void legacy_cache_write(void* arg)
+{
+	cache_ctx* ctx = (cache_ctx*)arg;
+	char fname[512];
+	unsigned int i = 0;
+
+	for (i = 0; i < sizeof(cache_fields) / sizeof(cache_fields[0]); i++) {
+		char* value = NULL;
+		plist_get_string_val(plist_dict_get_item(ctx->fields, cache_fields[i]), &value);
+		snprintf(fname, sizeof(fname), "%s/%s", ctx->dir, cache_fields[i]);
+		FILE* f = fopen(fname, "w");
+		fwrite(value, strlen(value), 1, f);
+		fclose(f);
+		free(value);
+	}
+}
+
+static void legacy_cache_read(void* arg)
+{
+	cache_ctx* ctx = (cache_ctx*)arg;
+	char fname[512];
+	unsigned int i = 0;
+
+	for (i = 0; i < sizeof(cache_fields) / sizeof(cache_fields[0]); i++) {
+		char* data = NULL;
+		uint32_t length = 0;
+		snprintf(fname, sizeof(fname), "%s/%s", ctx->dir, cache_fields[i]);
+		buffer_read_from_filename(fname, &data, &length);
+		free(data);
+	}
+}
+
+static plist_t fixture_cache_fields(plist_t activation_info)
+{
+	buffer_t fragment;
+	buffer_init(&fragment, 0x4000);
+	xml_write_fragment(&fragment, activation_info);
+
+	plist_t fields = plist_new_dict();
+	plist_dict_set_item(fields, "UUID", plist_new_string("0123456789abcdef0123456789abcdef01234567"));
+	plist_dict_set_item(fields, "IMEI", plist_new_string("012345678901234"));
+	plist_dict_set_item(fields, "IMSI", plist_new_string("310410123456789"));
+	plist_dict_set_item(fields, "ICCID", plist_new_string("89014104212345678901"));
+	plist_dict_set_item(fields, "SerialNumber", plist_new_string("88012ABCDEF"));
+	plist_dict_set_item(fields, "ActivationInfo", plist_new_string(fragment.data));
+	buffer_free(&fragment);
+	return fields;
+}
+
+/* ------------------------------------------------------------------ */
+/* loading a directory of records, timed once with peak RSS            */
+/* ------------------------------------------------------------------ */
+
+/* VmHWM, VmRSS and so on out of /proc/self/status, in kB */
+static long proc_status_kb(const char* field)
+{
+	char line[256];
+	long value = -1;
+	size_t length = strlen(field);
+
+	FILE* f = fopen("/proc/self/status", "r");
+	if (f == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, length) == 0 && line[length] == ':') {
+			value = atol(line + length + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return value;
+}
+
+/* Starts a new peak RSS measurement; Linux resets VmHWM on "5". */
+static void reset_peak_rss()
+{
+	FILE* f = fopen("/proc/self/clear_refs", "w");
+	if (f != NULL) {
+		fputs("5", f);
+		fclose(f);
+	}
+}
+
+/* the old way in: every file read and parsed on its own, one store_put()
+ * (and one fdatasync) per record */
+static int legacy_load_dir(const char* dir, const char* store_dir, int files)
+{
+	char fname[1024];
+	int i = 0;
+	int loaded = 0;
+
+	snprintf(fname, sizeof(fname), "%s/%s", store_dir, RECORDS_FILE);
+	store_t* store = store_open(fname);
+	if (store == NULL) {
+		return -1;
+	}
+	for (i = 0; i < files; i++) {
+		char key[48];
+		cache_key(key, i);
+		snprintf(fname, sizeof(fname), "%s/%s.plist", dir, key);
+		plist_t record = legacy_read_plist(fname);
+		if (record != NULL && store_put(store, key, record) == 0) {
+			loaded++;
+		}
+		plist_free(record);
+	}
+	store_close(store);
+	return loaded;
+}
+
+static int preload_dir(const char* dir, const char* store_dir, int threads)
+{
+	if (records_open(store_dir) != 0) {
+		return -1;
+	}
+	int loaded = records_preload(dir, threads);
+	records_close();
+	return loaded;
+}
+
+/* threads of zero means the legacy loader */
+static void bench_load(const char* name, const char* format, const char* dir, const char* scratch, int threads)
+{
+	char store_dir[512];
+	static int runs = 0;
+
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+
+	snprintf(store_dir, sizeof(store_dir), "%s/store-%d", scratch, runs++);
+	mkdir(store_dir, 0700);
+
+	reset_peak_rss();
+	long rss_before = proc_status_kb("VmRSS");
+	double start = now_ns();
+	int loaded = (threads == 0) ? legacy_load_dir(dir, store_dir, PRELOAD_FILES) : preload_dir(dir, store_dir, threads);
+	double elapsed = now_ns() - start;
+	long rss_peak = proc_status_kb("VmHWM");
+
+	fprintf(out, "{\"bench\":\"%s\",\"format\":\"%s\",\"size\":%d,\"files\":%d,\"loaded\":%d,\"threads\":%d,\"ms\":%.1f,\"records_per_s\":%.0f,\"rss_peak_kb\":%ld,\"rss_growth_kb\":%ld}\n",
+		name, format, PRELOAD_SIZE, PRELOAD_FILES, loaded, (threads == 0) ? 1 : threads, elapsed / 1e6,
+		loaded / (elapsed / 1e9), rss_peak, (rss_peak >= 0 && rss_before >= 0) ? rss_peak - rss_before : -1);
+	fflush(out);
+}
+
+/* ------------------------------------------------------------------ */
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+	return remove(path);
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [-o FILE] [-b FILTER]\n", name);
+	printf("Runs the activation path microbenchmarks and prints JSON lines.\n\n");
+	printf("  -o FILE\twrite results to FILE instead of stdout\n");
+	printf("  -b FILTER\tonly run benchmarks whose name contains FILTER\n");
+	printf("  -h\t\tprints usage information\n");
+}
+
+int main(int argc, char* argv[])
+{
+	char dir[] = "/tmp/ideviceactivate-bench.XXXXXX";
+	char fname[1024];
+	unsigned int i = 0;
+	int opt = 0;
+
+	out = stdout;
+	while ((opt = getopt(argc, argv, "ho:b:")) > 0) {
+		switch (opt) {
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				fprintf(stderr, "Unable to open %s\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 'b':
+			filter = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : -1;
+		}
+	}
+
+	if (mkdtemp(dir) == NULL) {
+		error("Unable to create a scratch directory");
+		return -1;
+	}
+	if (form_init() != 0) {
+		return -1;
+	}
+
+	for (i = 0; i < FIXTURE_COUNT; i++) {
+		int size = fixture_sizes[i];
+
+		/* ActivationInfo serialization */
+		plist_t activation_info = fixture_activation_info(size);
+		buffer_t fragment;
+		buffer_init(&fragment, 0);
+		xml_write_fragment(&fragment, activation_info);
+		bench("activation_info.legacy_to_xml_strstr", size, fragment.length, legacy_activation_info, activation_info);
+		bench("activation_info.fragment", size, fragment.length, fragment_activation_info, activation_info);
+		buffer_free(&fragment);
+
+		/* the whole POST body, curl's form API vs the template */
+		request_ctx qctx;
+		qctx.activation_info = activation_info;
+		arena_init(&qctx.arena, ARENA_DEFAULT_CHUNK);
+		bench("request_body.legacy_formadd", size, 0, legacy_request_body, &qctx);
+		bench("request_body.template", size, 0, template_request_body, &qctx);
+		arena_free(&qctx.arena);
+
+		/* response accumulation, in chunk sizes from a trickle to a gush */
+		response_ctx rctx;
+		rctx.data = fixture_response(size, &rctx.length);
+		size_t chunks[] = { 64, 1024, 16384 };
+		unsigned int c = 0;
+		for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+			char name[128];
+			rctx.chunk = chunks[c];
+			snprintf(name, sizeof(name), "response.legacy_realloc.chunk%zu", chunks[c]);
+			bench(name, size, rctx.length, legacy_accumulate, &rctx);
+			snprintf(name, sizeof(name), "response.streaming.chunk%zu", chunks[c]);
+			bench(name, size, rctx.length, streaming_accumulate, &rctx);
+		}
+
+		/* ticket boundary scan + plist_from_xml */
+		bench("ticket.legacy_strstr_copy_parse", size, rctx.length, legacy_ticket_parse, &rctx);
+		bench("ticket.in_place_parse", size, rctx.length, streaming_ticket_parse, &rctx);
+		free((char*)rctx.data);
+
+		/* plist_read_from_filename, XML vs binary */
+		plist_t record = fixture_activation_record(size);
+		char* data = NULL;
+		uint32_t length = 0;
+		const char* formats[] = { "xml", "bin" };
+		unsigned int f = 0;
+		for (f = 0; f < 2; f++) {
+			char name[128];
+			if (f == 0) {
+				plist_to_xml(record, &data, &length);
+			} else {
+				plist_to_bin(record, &data, &length);
+			}
+			snprintf(fname, sizeof(fname), "%s/record-%d.%s", dir, size, formats[f]);
+			int written = fixture_write(fname, data, length);
+			free(data);
+			if (written != 0) {
+				continue;
+			}
+
+			snprintf(name, sizeof(name), "record_file.legacy_read_%s", formats[f]);
+			bench(name, size, length, legacy_read_record_file, fname);
+			snprintf(name, sizeof(name), "record_file.read_%s", formats[f]);
+			bench(name, size, length, read_record_file, fname);
+		}
+		plist_free(record);
+
+		/* cache writes and reads, old file per field layout vs store */
+		cache_ctx cctx;
+		memset(&cctx, '\0', sizeof(cctx));
+		cctx.fields = fixture_cache_fields(activation_info);
+		cctx.keys = 1000;
+		cctx.dir = dir;
+		snprintf(fname, sizeof(fname), "%s/cache-%d.db", dir, size);
+		cctx.store = store_open(fname);
+		for (cctx.next = 0; cctx.next < cctx.keys; ) {
+			store_write(&cctx);
+		}
+		bench("cache.legacy_files_write", size, 0, legacy_cache_write, &cctx);
+		bench("cache.legacy_files_read", size, 0, legacy_cache_read, &cctx);
+		bench("cache.store_write", size, 0, store_write, &cctx);
+		bench("cache.store_read", size, 0, store_read, &cctx);
+		store_close(cctx.store);
+		plist_free(cctx.fields);
+
+		plist_free(activation_info);
+	}
+
+	/* a directory of staged records, loaded the old way and preloaded */
+	if (filter == NULL || strstr("records.legacy_load records.preload", filter) != NULL) {
+		plist_t record = fixture_activation_record(PRELOAD_SIZE);
+		const char* formats[] = { "xml", "bin" };
+		int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		unsigned int f = 0;
+
+		for (f = 0; f < 2; f++) {
+			char records_dir[512];
+			char* data = NULL;
+			uint32_t length = 0;
+			int n = 0;
+
+			if (f == 0) {
+				plist_to_xml(record, &data, &length);
+			} else {
+				plist_to_bin(record, &data, &length);
+			}
+
+			snprintf(records_dir, sizeof(records_dir), "%s/records-%s", dir, formats[f]);
+			mkdir(records_dir, 0700);
+			for (n = 0; n < PRELOAD_FILES; n++) {
+				char key[48];
+				cache_key(key, n);
+				if (snprintf(fname, sizeof(fname), "%s/%s.plist", records_dir, key) >= (int)sizeof(fname) ||
+					fixture_write(fname, data, length) != 0) {
+					break;
+				}
+			}
+			free(data);
+			if (n < PRELOAD_FILES) {
+				continue;
+			}
+
+			bench_load("records.legacy_load", formats[f], records_dir, dir, 0);
+			bench_load("records.preload", formats[f], records_dir, dir, 1);
+			if (threads > 1) {
+				bench_load("records.preload", formats[f], records_dir, dir, threads);
+			}
+		}
+		plist_free(record);
+	}
+
+	/* leave nothing behind */
+	nftw(dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+	form_cleanup();
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
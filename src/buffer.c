@@ -0,0 +1,111 @@
+/*
+ * buffer.c
+ * A growable byte buffer that always stays NUL terminated.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+int buffer_init(buffer_t* buffer, size_t capacity)
+{
+	return buffer_init_arena(buffer, NULL, capacity);
+}
+
+/* A buffer living in an arena is never freed by itself: growing it leaves the
+ * old copy behind until the arena is reset, and buffer_free() only forgets it. */
+int buffer_init_arena(buffer_t* buffer, arena_t* arena, size_t capacity)
+{
+	if (capacity == 0) {
+		capacity = 64;
+	}
+
+	buffer->arena = arena;
+	buffer->data = (arena != NULL) ? arena_alloc(arena, capacity) : malloc(capacity);
+	if (buffer->data == NULL) {
+		buffer->length = 0;
+		buffer->capacity = 0;
+		return -1;
+	}
+
+	buffer->data[0] = '\0';
+	buffer->length = 0;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+/* Makes room for extra more bytes plus the terminator. Growth is geometric so
+ * appending n bytes a few at a time stays O(n) overall. */
+int buffer_reserve(buffer_t* buffer, size_t extra)
+{
+	size_t needed = buffer->length + extra + 1;
+	if (needed <= buffer->capacity) {
+		return 0;
+	}
+
+	size_t capacity = (buffer->capacity > 0) ? buffer->capacity : 64;
+	while (capacity < needed) {
+		capacity *= 2;
+	}
+
+	char* data = NULL;
+	if (buffer->arena != NULL) {
+		data = arena_alloc(buffer->arena, capacity);
+		if (data != NULL && buffer->data != NULL) {
+			memcpy(data, buffer->data, buffer->length + 1);
+		}
+	} else {
+		data = realloc(buffer->data, capacity);
+	}
+	if (data == NULL) {
+		return -1;
+	}
+
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+int buffer_append(buffer_t* buffer, const char* data, size_t length)
+{
+	if (buffer_reserve(buffer, length) != 0) {
+		return -1;
+	}
+
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+	return 0;
+}
+
+int buffer_append_str(buffer_t* buffer, const char* str)
+{
+	return buffer_append(buffer, str, strlen(str));
+}
+
+void buffer_free(buffer_t* buffer)
+{
+	if (buffer->arena == NULL) {
+		free(buffer->data);
+	}
+	buffer->data = NULL;
+	buffer->length = 0;
+	buffer->capacity = 0;
+}
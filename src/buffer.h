@@ -0,0 +1,42 @@
+/*
+ * buffer.h
+ * A growable byte buffer that always stays NUL terminated.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include "arena.h"
+
+typedef struct {
+	char* data;
+	size_t length;
+	size_t capacity;
+	arena_t* arena;   /* where data comes from, NULL for the heap */
+} buffer_t;
+
+extern int buffer_init(buffer_t* buffer, size_t capacity);
+extern int buffer_init_arena(buffer_t* buffer, arena_t* arena, size_t capacity);
+extern int buffer_reserve(buffer_t* buffer, size_t extra);
+extern int buffer_append(buffer_t* buffer, const char* data, size_t length);
+extern int buffer_append_str(buffer_t* buffer, const char* str);
+extern void buffer_free(buffer_t* buffer);
+
+#endif
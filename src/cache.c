@@ -19,107 +19,122 @@
  */
 
 #include <plist/plist.h>
-#include <libimobiledevice/lockdown.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "cache.h"
+#include "props.h"
+#include "store.h"
 #include "util.h"
 
-int write_file(const char *filename, char data[BUFSIZE])
-{
-	FILE *f=fopen(filename, "w");
-
-	if (f==NULL)
-	{
-		printf("ERROR: Could not open %s for writing\n", filename);
-		fclose(f);
-		return -1;
-	}
+/* Every device lives in one store file in the cache directory, keyed by its
+ * UUID, with all of its fields together in one dict. See store.c. Each
+ * session opens its own handle on it; the store takes care of several
+ * handles (or processes) sharing the file. */
 
-	else {
-		fwrite(data, strlen(data), 1, f);
-		fclose(f);
+/* The field names, both as dict keys and as the file names the old one
+ * file per field cache used. */
+static const char* cache_fields[] = { "UUID", "IMEI", "IMSI", "ICCID", "SerialNumber", "ActivationInfo", NULL };
 
-		return 0;
-	}
-}
-
-int read_file(const char *filename, char data[BUFSIZE])
+/* Caches made by older versions kept a single device as loose files in the
+ * cache directory, pull such a device into the store the first time round. */
+static void cache_import_legacy(store_t* store, const char* cachedir)
 {
-	FILE *f=fopen(filename, "r");
+	char fname[512];
+	char* data = NULL;
+	uint32_t length = 0;
+	int i = 0;
 
-	if (f==NULL)
-	{
-		printf("ERROR: Could not open %s for reading\n", filename);
-		fclose(f);
-		return -1;
+	snprintf(fname, sizeof(fname), "%s/UUID", cachedir);
+	if (access(fname, R_OK) != 0) {
+		return;
 	}
 
-	else {
-		uint32_t read=fread(data, 1, BUFSIZE, f);
-
-		while (read>0)
-		{
-			read=fread(data, 1, BUFSIZE, f);
-			printf(".");
+	plist_t fields = plist_new_dict();
+	for (i = 0; cache_fields[i] != NULL; i++) {
+		snprintf(fname, sizeof(fname), "%s/%s", cachedir, cache_fields[i]);
+		if (access(fname, R_OK) != 0 || buffer_read_from_filename(fname, &data, &length) != 0 || data == NULL) {
+			continue;
 		}
+		char* value = malloc(length + 1);
+		memcpy(value, data, length);
+		value[length] = '\0';
+		plist_dict_set_item(fields, cache_fields[i], plist_new_string(value));
+		free(value);
+		free(data);
+		data = NULL;
+	}
 
-		printf("\nINFO: Read sucessfully from %s\n", filename);
+	plist_t uuid_node = plist_dict_get_item(fields, "UUID");
+	char* uuid = NULL;
+	if (uuid_node != NULL) {
+		plist_get_string_val(uuid_node, &uuid);
+	}
+
+	plist_t existing = NULL;
+	if (uuid != NULL && store_get(store, uuid, &existing) != 0) {
+		info("Importing the old style cache into the cache file...");
+		store_put(store, uuid, fields);
+	}
 
-		return 0;
+	if (existing != NULL) {
+		plist_free(existing);
 	}
+	free(uuid);
+	plist_free(fields);
 }
 
-int cache(const char *fname, const char *what)
+store_t* cache_open(const char *dir)
 {
-	if (backup_to_cache==1)
-	{
-		char data[BUFSIZE];
-		snprintf(data, BUFSIZE, "%s", what);
-
-		char f_name[512];
-		snprintf(f_name, BUFSIZE, "%s/%s", cachedir, fname);
-
-		if (write_file((const char *)f_name, data)!=0)
-		{
-			return -1;
-		}
+	char fname[512];
 
-		return 0;
+	snprintf(fname, sizeof(fname), "%s/%s", dir, CACHE_FILE);
+	store_t* cache = store_open(fname);
+	if (cache != NULL) {
+		cache_import_legacy(cache, dir);
 	}
 
-	else {
-		return -1;
-	}
+	return cache;
 }
 
-int cache_plist(const char *fname, plist_t plist)
+void cache_close(store_t *cache)
 {
-	if (backup_to_cache==1)
-	{
-		uint32_t len=0;
-		char **xml=NULL;
-
-		plist_to_xml(plist, &xml, &len);
+	store_close(cache);
+}
 
-		return cache(fname, (const char *)xml);
+/* Writes every field for a device in one go, so a device is either cached
+ * completely or not at all. */
+int cache_device(store_t *cache, const char *uuid, plist_t fields)
+{
+	if (cache==NULL)
+	{
+		return -1;
 	}
 
-	else {
+	if (store_put(cache, uuid, fields)!=0)
+	{
+		char m[96];
+		snprintf(m, sizeof(m), "Could not write %s to the cache", uuid);
+		error(m);
 		return -1;
 	}
+
+	return 0;
 }
 
-char* get_from_cache(const char *what)
+/* Returns the cached fields for a device as a dict the caller frees, or NULL. */
+plist_t cache_lookup(store_t *cache, const char *uuid)
 {
-	char fname[512];
-	snprintf(fname, 512, "%s/%s", cachedir, what);
+	plist_t fields=NULL;
 
-	char *d[BUFSIZE];
-	read_file((const char *)fname, &d);
+	if (cache==NULL || uuid==NULL)
+	{
+		return NULL;
+	}
 
-	return (char *)d;
+	store_get(cache, uuid, &fields);
+	return fields;
 }
 
 /* Just prints a little notice about what caching actually does... */
@@ -130,11 +145,24 @@ void cache_warning()
 	getchar();
 }
 
-/* Validates the cache to make sure it really is the cache for the connected device... */
-int check_cache(lockdownd_client_t c)
+/* Validates the cache to make sure it really has data for the connected device... */
+int check_cache(store_t *cache, device_link* link, const char* uuid)
 {
-	char* uuid_from_cache=get_from_cache("UUID");
-	char* uuid_from_device=(char *)lockdownd_get_string_value(c, "UniqueDeviceID");
+	device_props* props=props_get(link, uuid);
+	if (props==NULL || props->uuid==NULL)
+	{
+		props_release(props);
+		return -1;
+	}
+
+	plist_t fields=cache_lookup(cache, props->uuid);
+	props_release(props);
+
+	if (fields==NULL)
+	{
+		return -1;
+	}
 
-	return strcmp(uuid_from_cache, uuid_from_device);
+	plist_free(fields);
+	return 0;
 }
@@ -19,18 +19,17 @@
  */
 
 #include <plist/plist.h>
+#include "store.h"
+#include "transport.h"
 
-#define BUFSIZE 0x200000
+#define CACHE_FILE "cache.db"
 
-extern char* cachedir;
-extern int use_cache;
-extern int backup_to_cache;
+extern store_t* cache_open(const char *dir);
+extern void cache_close(store_t *cache);
 
-extern int write_file(const char *filename, char data[BUFSIZE]);
-extern int cache(const char *fname, const char *what);
-extern int cache_plist(const char *fname, plist_t plist);
-extern char* get_from_cache(const char *what);
+extern int cache_device(store_t *cache, const char *uuid, plist_t fields);
+extern plist_t cache_lookup(store_t *cache, const char *uuid);
 
 extern void cache_warning();
 
-extern int check_cache(lockdownd_client_t c);
+extern int check_cache(store_t *cache, device_link* link, const char* uuid);
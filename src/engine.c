@@ -0,0 +1,581 @@
+/*
+ * engine.c
+ * Drives many activations at once from a single event loop.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <curl/curl.h>
+
+#include "http.h"
+#include "metrics.h"
+#include "session.h"
+#include "trace.h"
+#include "util.h"
+
+#define ENGINE_DEFAULT_DEVICE_THREADS 4
+#define ENGINE_MAX_EVENTS 64
+#define ENGINE_MAX_CONNECTIONS 64
+
+/* Each session moves through the engine as one of these. Device threads run
+ * the lockdownd side (connect, query, build the request) and hand it to the
+ * loop, which sends it with everybody else's on one curl multi handle and
+ * hands it back once the answer is in (parse, activate). Nothing ever blocks
+ * the loop, and nothing but the loop touches the multi handle. A request
+ * waiting to be hedged or retried sits on the loop's timer list until due. */
+typedef struct engine_item {
+	activation_session_t session;
+	int finishing;
+	CURLcode res;
+	http_request transfer;
+	uint64_t due;
+	int retrying;
+	struct engine_item* next;
+	struct engine_item* timer_next;
+	struct engine_item* active_next;
+} engine_item;
+
+typedef struct {
+	engine_item* head;
+	engine_item* tail;
+} engine_list;
+
+typedef struct {
+	CURLM* multi;
+	int epoll_fd;
+	int timer_fd;
+	int wake_fd;
+	int deactivate;
+	int remaining;
+	int stopping;
+
+	engine_list device_queue;
+	pthread_mutex_t device_lock;
+	pthread_cond_t device_ready;
+
+	engine_list network_queue;
+	pthread_mutex_t network_lock;
+
+	engine_item* timers;
+	engine_item* active;    /* everything the loop has taken and not handed back */
+} engine;
+
+static void engine_list_push(engine_list* list, engine_item* item)
+{
+	item->next = NULL;
+	if (list->tail != NULL) {
+		list->tail->next = item;
+	} else {
+		list->head = item;
+	}
+	list->tail = item;
+}
+
+static engine_item* engine_list_pop(engine_list* list)
+{
+	engine_item* item = list->head;
+	if (item != NULL) {
+		list->head = item->next;
+		if (list->head == NULL) {
+			list->tail = NULL;
+		}
+		item->next = NULL;
+	}
+	return item;
+}
+
+static void engine_wake(engine* e)
+{
+	uint64_t one = 1;
+	if (write(e->wake_fd, &one, sizeof(one)) < 0) {
+		/* already has a wakeup pending, which is just as good */
+	}
+}
+
+static void engine_to_device(engine* e, engine_item* item)
+{
+	pthread_mutex_lock(&e->device_lock);
+	engine_list_push(&e->device_queue, item);
+	METRICS_QUEUE(METRICS_QUEUE_ENGINE_DEVICE, 1);
+	pthread_cond_signal(&e->device_ready);
+	pthread_mutex_unlock(&e->device_lock);
+}
+
+static void engine_to_network(engine* e, engine_item* item)
+{
+	pthread_mutex_lock(&e->network_lock);
+	engine_list_push(&e->network_queue, item);
+	METRICS_QUEUE(METRICS_QUEUE_ENGINE_NETWORK, 1);
+	pthread_mutex_unlock(&e->network_lock);
+	engine_wake(e);
+}
+
+static void* engine_device_worker(void* arg)
+{
+	engine* e = (engine*)arg;
+
+	while (1) {
+		pthread_mutex_lock(&e->device_lock);
+		while (e->device_queue.head == NULL && !e->stopping) {
+			pthread_cond_wait(&e->device_ready, &e->device_lock);
+		}
+		engine_item* item = engine_list_pop(&e->device_queue);
+		pthread_mutex_unlock(&e->device_lock);
+
+		if (item == NULL) {
+			break;
+		}
+		METRICS_QUEUE(METRICS_QUEUE_ENGINE_DEVICE, -1);
+
+		activation_session_t session = item->session;
+		activation_error_t err = ACTIVATION_E_SUCCESS;
+		int finished = 1;
+
+		session_enter(session);
+		trace_set_uuid(session->uuid);
+		if (e->deactivate) {
+			err = session_deactivate(session);
+		} else if (!item->finishing) {
+			err = session_start(session, &finished);
+		} else {
+			err = session_finish(session, item->res);
+		}
+
+		if (err == ACTIVATION_E_SUCCESS && !finished) {
+			session_leave(session);
+			engine_to_network(e, item);
+			continue;
+		}
+
+		session_done(session, err);
+		session_leave(session);
+		free(item);
+
+		if (__sync_sub_and_fetch(&e->remaining, 1) == 0) {
+			engine_wake(e);
+		}
+	}
+
+	return NULL;
+}
+
+/* curl tells us which sockets to watch for what, we keep epoll in sync. A
+ * socket curl has seen before carries a non-NULL socketp. */
+static int engine_socket(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
+{
+	engine* e = (engine*)userp;
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = s;
+
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+		return 0;
+	}
+
+	if (what & CURL_POLL_IN) {
+		ev.events |= EPOLLIN;
+	}
+	if (what & CURL_POLL_OUT) {
+		ev.events |= EPOLLOUT;
+	}
+
+	if (socketp != NULL) {
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_MOD, s, &ev);
+	} else {
+		epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, s, &ev);
+		curl_multi_assign(e->multi, s, e);
+	}
+	return 0;
+}
+
+static int engine_timer(CURLM* multi, long timeout_ms, void* userp)
+{
+	engine* e = (engine*)userp;
+	struct itimerspec its;
+
+	/* -1 disarms, 0 means as soon as possible */
+	memset(&its, 0, sizeof(its));
+	if (timeout_ms > 0) {
+		its.it_value.tv_sec = timeout_ms / 1000;
+		its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+	} else if (timeout_ms == 0) {
+		its.it_value.tv_nsec = 1;
+	}
+	timerfd_settime(e->timer_fd, 0, &its, NULL);
+	return 0;
+}
+
+static void engine_schedule(engine* e, engine_item* item, long ms)
+{
+	item->due = trace_now() + (uint64_t)ms * 1000000;
+	item->timer_next = e->timers;
+	e->timers = item;
+}
+
+static void engine_unschedule(engine* e, engine_item* item)
+{
+	engine_item** link = &e->timers;
+	while (*link != NULL) {
+		if (*link == item) {
+			*link = item->timer_next;
+			item->timer_next = NULL;
+			return;
+		}
+		link = &(*link)->timer_next;
+	}
+}
+
+/* ms until the first timer is due, -1 without any */
+static int engine_next_timer(engine* e)
+{
+	engine_item* item = NULL;
+	uint64_t now = trace_now();
+	uint64_t first = 0;
+
+	for (item = e->timers; item != NULL; item = item->timer_next) {
+		if (first == 0 || item->due < first) {
+			first = item->due;
+		}
+	}
+	if (first == 0) {
+		return -1;
+	}
+	return (first <= now) ? 0 : (int)((first - now + 999999) / 1000000);
+}
+
+static void engine_done_with(engine* e, engine_item* item)
+{
+	engine_item** link = &e->active;
+	while (*link != NULL) {
+		if (*link == item) {
+			*link = item->active_next;
+			item->active_next = NULL;
+			break;
+		}
+		link = &(*link)->active_next;
+	}
+
+	http_request_finish(&item->transfer);
+	item->res = item->transfer.res;
+	item->finishing = 1;
+	engine_to_device(e, item);
+}
+
+/* Starts an attempt, with a timer for its hedge if it gets one. */
+static void engine_send(engine* e, engine_item* item)
+{
+	if (http_request_send(&item->transfer, e->multi) != 0) {
+		engine_done_with(e, item);
+		return;
+	}
+
+	long hedge = http_request_hedge_in(&item->transfer);
+	if (hedge >= 0) {
+		engine_schedule(e, item, hedge);
+	}
+}
+
+/* Hedges and retries whose time has come. */
+static void engine_run_timers(engine* e)
+{
+	uint64_t now = trace_now();
+	engine_item** link = &e->timers;
+
+	while (*link != NULL) {
+		engine_item* item = *link;
+		if (item->due > now) {
+			link = &item->timer_next;
+			continue;
+		}
+
+		*link = item->timer_next;
+		item->timer_next = NULL;
+		if (item->retrying) {
+			item->retrying = 0;
+			engine_send(e, item);
+		} else {
+			http_request_send_hedge(&item->transfer, e->multi);
+		}
+	}
+}
+
+/* Picks up requests the device threads have finished building. */
+static void engine_add_requests(engine* e)
+{
+	engine_list ready;
+
+	pthread_mutex_lock(&e->network_lock);
+	ready = e->network_queue;
+	e->network_queue.head = NULL;
+	e->network_queue.tail = NULL;
+	pthread_mutex_unlock(&e->network_lock);
+
+	engine_item* item = NULL;
+	while ((item = engine_list_pop(&ready)) != NULL) {
+		METRICS_QUEUE(METRICS_QUEUE_ENGINE_NETWORK, -1);
+		CURL* handle = item->session->http;
+		http_request_init(&item->transfer, handle, &item->session->request.response);
+		curl_easy_setopt(handle, CURLOPT_PRIVATE, item);
+		item->active_next = e->active;
+		e->active = item;
+		engine_send(e, item);
+	}
+}
+
+/* Settles every finished transfer, then either schedules a retry or hands
+ * the session back to the device side. */
+static void engine_collect(engine* e)
+{
+	CURLMsg* msg = NULL;
+	int left = 0;
+
+	while ((msg = curl_multi_info_read(e->multi, &left)) != NULL) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+
+		CURL* handle = msg->easy_handle;
+		CURLcode res = msg->data.result;
+		engine_item* item = NULL;
+		curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char**)&item);
+
+		trace_set_uuid(item->session->uuid);
+		if (!http_request_done(&item->transfer, e->multi, handle, res)) {
+			continue;
+		}
+		engine_unschedule(e, item);
+
+		/* so the retry message goes wherever the session's messages go */
+		session_enter(item->session);
+		long delay = http_request_retry_in(&item->transfer);
+		session_leave(item->session);
+		if (delay >= 0) {
+			item->retrying = 1;
+			engine_schedule(e, item, delay);
+		} else {
+			engine_done_with(e, item);
+		}
+	}
+}
+
+static void engine_loop(engine* e)
+{
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+	uint64_t count = 0;
+	int running = 0;
+	int i = 0;
+
+	while (__sync_fetch_and_add(&e->remaining, 0) > 0) {
+		int n = epoll_wait(e->epoll_fd, events, ENGINE_MAX_EVENTS, engine_next_timer(e));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error("Unable to wait for network events");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == e->wake_fd) {
+				if (read(e->wake_fd, &count, sizeof(count)) < 0) {
+					/* nothing to drain */
+				}
+				engine_add_requests(e);
+			} else if (fd == e->timer_fd) {
+				if (read(e->timer_fd, &count, sizeof(count)) < 0) {
+					/* fired and got rearmed in between */
+				}
+				curl_multi_socket_action(e->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+			} else {
+				int flags = 0;
+				if (events[i].events & EPOLLIN) {
+					flags |= CURL_CSELECT_IN;
+				}
+				if (events[i].events & EPOLLOUT) {
+					flags |= CURL_CSELECT_OUT;
+				}
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					flags |= CURL_CSELECT_ERR;
+				}
+				curl_multi_socket_action(e->multi, fd, flags, &running);
+			}
+		}
+
+		engine_collect(e);
+		engine_run_timers(e);
+	}
+}
+
+/* For when the loop gave up with sessions still out: takes their transfers
+ * off the multi handle and finishes each with an error. Only once the device
+ * threads are gone, as they may still have handed the loop more. */
+static void engine_abandon(engine* e)
+{
+	engine_item* item = NULL;
+	engine_list failed;
+
+	failed.head = NULL;
+	failed.tail = NULL;
+	while ((item = engine_list_pop(&e->network_queue)) != NULL) {
+		METRICS_QUEUE(METRICS_QUEUE_ENGINE_NETWORK, -1);
+		engine_list_push(&failed, item);
+	}
+	while ((item = e->active) != NULL) {
+		e->active = item->active_next;
+		http_request_abandon(&item->transfer, e->multi);
+		http_request_finish(&item->transfer);
+		engine_list_push(&failed, item);
+	}
+	e->timers = NULL;
+
+	while ((item = engine_list_pop(&failed)) != NULL) {
+		session_enter(item->session);
+		session_done(item->session, ACTIVATION_E_FETCH_FAILED);
+		session_leave(item->session);
+		free(item);
+	}
+}
+
+static int engine_watch(engine* e, int fd)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Runs every session to completion, reporting each through its done
+ * callback. The calling thread becomes the event loop, so the whole lot
+ * takes device_threads + 1 threads however many sessions there are. */
+activation_error_t activation_engine_run(activation_session_t* sessions, int count, int device_threads, int deactivate)
+{
+	engine e;
+	pthread_t* threads = NULL;
+	int started = 0;
+	int i = 0;
+
+	if (sessions == NULL || count <= 0) {
+		return ACTIVATION_E_INVALID_ARG;
+	}
+
+	if (device_threads <= 0) {
+		device_threads = ENGINE_DEFAULT_DEVICE_THREADS;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.deactivate = deactivate;
+	e.remaining = count;
+	pthread_mutex_init(&e.device_lock, NULL);
+	pthread_cond_init(&e.device_ready, NULL);
+	pthread_mutex_init(&e.network_lock, NULL);
+
+	e.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	e.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	e.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	e.multi = curl_multi_init();
+
+	activation_error_t err = ACTIVATION_E_SUCCESS;
+	if (e.epoll_fd < 0 || e.timer_fd < 0 || e.wake_fd < 0 || e.multi == NULL || engine_watch(&e, e.timer_fd) != 0 || engine_watch(&e, e.wake_fd) != 0) {
+		error("Unable to set up the event loop");
+		err = ACTIVATION_E_NO_MEMORY;
+		for (i = 0; i < count; i++) {
+			session_done(sessions[i], err);
+		}
+		goto done;
+	}
+
+	curl_multi_setopt(e.multi, CURLMOPT_SOCKETFUNCTION, engine_socket);
+	curl_multi_setopt(e.multi, CURLMOPT_SOCKETDATA, &e);
+	curl_multi_setopt(e.multi, CURLMOPT_TIMERFUNCTION, engine_timer);
+	curl_multi_setopt(e.multi, CURLMOPT_TIMERDATA, &e);
+	curl_multi_setopt(e.multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)ENGINE_MAX_CONNECTIONS);
+
+	for (i = 0; i < count; i++) {
+		engine_item* item = calloc(1, sizeof(engine_item));
+		if (item == NULL) {
+			/* whatever didn't make it in is done already */
+			session_done(sessions[i], ACTIVATION_E_NO_MEMORY);
+			__sync_sub_and_fetch(&e.remaining, 1);
+			continue;
+		}
+		item->session = sessions[i];
+		engine_list_push(&e.device_queue, item);
+		METRICS_QUEUE(METRICS_QUEUE_ENGINE_DEVICE, 1);
+	}
+
+	threads = calloc(device_threads, sizeof(pthread_t));
+	for (i = 0; threads != NULL && i < device_threads; i++) {
+		if (pthread_create(&threads[i], NULL, engine_device_worker, &e) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	if (started == 0) {
+		error("Unable to start worker thread");
+		err = ACTIVATION_E_NO_MEMORY;
+		engine_item* item = NULL;
+		while ((item = engine_list_pop(&e.device_queue)) != NULL) {
+			METRICS_QUEUE(METRICS_QUEUE_ENGINE_DEVICE, -1);
+			session_done(item->session, err);
+			free(item);
+		}
+	} else {
+		engine_loop(&e);
+	}
+
+	pthread_mutex_lock(&e.device_lock);
+	e.stopping = 1;
+	pthread_cond_broadcast(&e.device_ready);
+	pthread_mutex_unlock(&e.device_lock);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	engine_abandon(&e);
+
+done:
+	if (e.multi != NULL) {
+		curl_multi_cleanup(e.multi);
+	}
+	if (e.wake_fd >= 0) {
+		close(e.wake_fd);
+	}
+	if (e.timer_fd >= 0) {
+		close(e.timer_fd);
+	}
+	if (e.epoll_fd >= 0) {
+		close(e.epoll_fd);
+	}
+	pthread_mutex_destroy(&e.network_lock);
+	pthread_cond_destroy(&e.device_ready);
+	pthread_mutex_destroy(&e.device_lock);
+	return err;
+}
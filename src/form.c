@@ -0,0 +1,181 @@
+/*
+ * form.c
+ * The multipart/form-data body of an activation request.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+#include "buffer.h"
+#include "form.h"
+#include "util.h"
+
+/* What libcurl's form API used to send for us, written out once instead of
+ * being put together (and every value copied) again for each request. */
+static const char* form_constant[][2] = {
+	{ "machineName", "linux" },
+	{ "InStoreActivation", "false" },
+};
+
+static char form_boundary_text[48];
+static char form_open[96];      /* everything in a part's head before its name */
+static size_t form_open_len = 0;
+static char form_close[64];     /* ends the last part and the body */
+static size_t form_close_len = 0;
+static buffer_t form_prefix;    /* the constant parts, copied into each body */
+static struct curl_slist* form_header_list = NULL;
+
+/* A boundary only has to not turn up in the body, and nothing in an
+ * activation request looks anything like this. */
+static void form_make_boundary()
+{
+	uint64_t seed = 0;
+
+	FILE* f = fopen("/dev/urandom", "rb");
+	if (f == NULL || fread(&seed, sizeof(seed), 1, f) != 1) {
+		seed = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	snprintf(form_boundary_text, sizeof(form_boundary_text), "------------------------%016llx", (unsigned long long)seed);
+}
+
+int form_init()
+{
+	char line[128];
+	size_t i = 0;
+
+	form_make_boundary();
+	form_open_len = snprintf(form_open, sizeof(form_open), "--%s\r\nContent-Disposition: form-data; name=\"", form_boundary_text);
+	form_close_len = snprintf(form_close, sizeof(form_close), "\r\n--%s--\r\n", form_boundary_text);
+
+	if (buffer_init(&form_prefix, 512) != 0) {
+		error("Unable to allocate sufficent memory");
+		return -1;
+	}
+	for (i = 0; i < sizeof(form_constant) / sizeof(form_constant[0]); i++) {
+		if (form_field(&form_prefix, form_constant[i][0], form_constant[i][1]) != 0) {
+			form_cleanup();
+			error("Unable to allocate sufficent memory");
+			return -1;
+		}
+	}
+
+	snprintf(line, sizeof(line), "Content-Type: multipart/form-data; boundary=%s", form_boundary_text);
+	const char* headers[] = {
+		"X-Apple-Tz: -14400",
+		"X-Apple-Store-Front: 143441-1",
+		"User-Agent: iTunes/9.1 (Macintosh; U; Intel Mac OS X 10.5.6)",
+		line,
+		/* the server answers straight away, waiting for a 100 only costs a round trip */
+		"Expect:",
+	};
+	for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+		struct curl_slist* list = curl_slist_append(form_header_list, headers[i]);
+		if (list == NULL) {
+			form_cleanup();
+			error("Unable to allocate sufficent memory");
+			return -1;
+		}
+		form_header_list = list;
+	}
+
+	return 0;
+}
+
+void form_cleanup()
+{
+	buffer_free(&form_prefix);
+	curl_slist_free_all(form_header_list);
+	form_header_list = NULL;
+}
+
+struct curl_slist* form_headers()
+{
+	return form_header_list;
+}
+
+const char* form_boundary()
+{
+	return form_boundary_text;
+}
+
+/* The same headers for a body some other process built, see spool.c, for
+ * the caller to free. *headers is NULL when the boundary is ours and
+ * form_headers() already fits. */
+int form_headers_for(const char* boundary, struct curl_slist** headers)
+{
+	struct curl_slist* list = NULL;
+	struct curl_slist* item = NULL;
+	char line[128];
+
+	*headers = NULL;
+	if (!strcmp(boundary, form_boundary_text)) {
+		return 0;
+	}
+
+	for (item = form_header_list; item != NULL; item = item->next) {
+		const char* header = item->data;
+		if (!strncmp(header, "Content-Type:", 13)) {
+			snprintf(line, sizeof(line), "Content-Type: multipart/form-data; boundary=%s", boundary);
+			header = line;
+		}
+		struct curl_slist* grown = curl_slist_append(list, header);
+		if (grown == NULL) {
+			curl_slist_free_all(list);
+			return -1;
+		}
+		list = grown;
+	}
+	*headers = list;
+	return 0;
+}
+
+int form_begin(buffer_t* body)
+{
+	return buffer_append(body, form_prefix.data, form_prefix.length);
+}
+
+int form_part(buffer_t* body, const char* name)
+{
+	if (buffer_append(body, form_open, form_open_len) != 0 || buffer_append_str(body, name) != 0) {
+		return -1;
+	}
+	return buffer_append(body, "\"\r\n\r\n", 5);
+}
+
+int form_field(buffer_t* body, const char* name, const char* value)
+{
+	if (form_part(body, name) != 0 || buffer_append_str(body, value) != 0) {
+		return -1;
+	}
+	return buffer_append(body, "\r\n", 2);
+}
+
+int form_end(buffer_t* body)
+{
+	return buffer_append(body, form_close, form_close_len);
+}
@@ -0,0 +1,48 @@
+/*
+ * form.h
+ * The multipart/form-data body of an activation request.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef FORM_H
+#define FORM_H
+
+#include <curl/curl.h>
+#include "buffer.h"
+
+/* Builds the parts every request shares, once per process, see http_init() */
+extern int form_init();
+extern void form_cleanup();
+
+/* Every header a request sends, the Content-Type with our boundary included.
+ * Shared by all handles and never changed once built. */
+extern struct curl_slist* form_headers();
+
+/* Bodies outlive the process when they are spooled, so the boundary goes
+ * with them and the headers can be rebuilt around another one. */
+extern const char* form_boundary();
+extern int form_headers_for(const char* boundary, struct curl_slist** headers);
+
+/* A body is the constant parts, then form_field()s, then one last part
+ * opened with form_part(), written by the caller and closed by form_end(). */
+extern int form_begin(buffer_t* body);
+extern int form_field(buffer_t* body, const char* name, const char* value);
+extern int form_part(buffer_t* body, const char* name);
+extern int form_end(buffer_t* body);
+
+#endif
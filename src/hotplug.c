@@ -0,0 +1,226 @@
+/*
+ * hotplug.c
+ * Long running mode that activates devices as soon as they are plugged in.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "hotplug.h"
+#include "logger.h"
+#include "station.h"
+#include "transport.h"
+#include "util.h"
+
+/* One entry per device we've seen plugged in. An entry stays around until the
+ * device is unplugged *and* its worker is done with it, whichever is last. */
+typedef struct hotplug_device {
+	activation_job job;
+	int running;
+	int removed;
+	struct hotplug_device* next;
+} hotplug_device;
+
+static hotplug_device* devices = NULL;
+static int hotplug_deactivate = 0;
+static const activation_options_t* hotplug_options = NULL;
+static int hotplug_running = 0;
+static int hotplug_done = 0;
+static int hotplug_failed = 0;
+static int hotplug_queued = 0;
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_idle = PTHREAD_COND_INITIALIZER;
+
+/* hotplug_lock must be held */
+static hotplug_device* hotplug_find(const char* uuid)
+{
+	hotplug_device* dev = NULL;
+	for (dev = devices; dev != NULL; dev = dev->next) {
+		if (!dev->removed && !strcmp(dev->job.uuid, uuid)) {
+			return dev;
+		}
+	}
+	return NULL;
+}
+
+/* hotplug_lock must be held */
+static void hotplug_forget(hotplug_device* dev)
+{
+	hotplug_device** link = &devices;
+	while (*link != NULL) {
+		if (*link == dev) {
+			*link = dev->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	free(dev->job.uuid);
+	free(dev);
+}
+
+static void* hotplug_worker(void* arg)
+{
+	hotplug_device* dev = (hotplug_device*)arg;
+
+	char m[128];
+
+	station_activate(&dev->job);
+
+	pthread_mutex_lock(&hotplug_lock);
+	snprintf(m, sizeof(m), "%s  %-7s  %6.2fs  %s", dev->job.uuid, station_label(&dev->job), dev->job.elapsed, dev->job.status);
+	task(m);
+	hotplug_done++;
+	if (dev->job.result < 0) {
+		hotplug_failed++;
+	} else if (dev->job.result > 0) {
+		hotplug_queued++;
+	}
+	dev->running = 0;
+	hotplug_running--;
+	if (dev->removed) {
+		hotplug_forget(dev);
+	}
+	pthread_cond_broadcast(&hotplug_idle);
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return NULL;
+}
+
+static void hotplug_device_added(const char* uuid)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	/* the same device can be announced more than once, only handle it once */
+	if (hotplug_find(uuid) != NULL) {
+		return;
+	}
+
+	hotplug_device* dev = calloc(1, sizeof(hotplug_device));
+	if (dev == NULL) {
+		error("Unable to allocate sufficent memory");
+		return;
+	}
+	dev->job.uuid = strdup(uuid);
+	dev->job.deactivate = hotplug_deactivate;
+	dev->job.options = hotplug_options;
+	dev->job.status = "not started";
+	dev->running = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, hotplug_worker, dev) != 0) {
+		error("Unable to start worker thread");
+		free(dev->job.uuid);
+		free(dev);
+	} else {
+		dev->next = devices;
+		devices = dev;
+		hotplug_running++;
+		char m[64];
+		snprintf(m, sizeof(m), "%s  plugged in", uuid);
+		task(m);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void hotplug_device_removed(const char* uuid)
+{
+	hotplug_device* dev = hotplug_find(uuid);
+	if (dev == NULL) {
+		return;
+	}
+
+	dev->removed = 1;
+	if (dev->running) {
+		/* the worker notices between stages and frees the entry itself */
+		dev->job.cancelled = 1;
+		char m[64];
+		snprintf(m, sizeof(m), "%s  unplugged, cancelling", uuid);
+		task(m);
+	} else {
+		hotplug_forget(dev);
+	}
+}
+
+static void hotplug_event(device_event_t event, const char* uuid, void* user_data)
+{
+	/* a lockdownd session from before the device was unplugged is of no use */
+	activation_forget_device(uuid);
+
+	pthread_mutex_lock(&hotplug_lock);
+	if (event == DEVICE_ADDED) {
+		hotplug_device_added(uuid);
+	} else if (event == DEVICE_REMOVED) {
+		hotplug_device_removed(uuid);
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+}
+
+/* Waits for devices to show up and activates (or deactivates) each one on its
+ * own thread as soon as it does. Runs until SIGINT or SIGTERM, then cancels
+ * whatever is still in flight and waits for it to wind down. */
+int hotplug_run(int deactivate, const activation_options_t* options)
+{
+	sigset_t signals;
+	int sig = 0;
+
+	hotplug_deactivate = deactivate;
+	hotplug_options = options;
+
+	/* block these before any thread exists so only sigwait() ever sees them */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if (device_transport_current->subscribe(hotplug_event, NULL) != 0) {
+		error("Unable to subscribe to device events, is usbmuxd running?");
+		return -1;
+	}
+
+	info("Waiting for devices, press CONTROL-C to stop");
+	sigwait(&signals, &sig);
+
+	device_transport_current->unsubscribe();
+
+	pthread_mutex_lock(&hotplug_lock);
+	hotplug_device* dev = NULL;
+	for (dev = devices; dev != NULL; dev = dev->next) {
+		dev->job.cancelled = 1;
+	}
+	while (hotplug_running > 0) {
+		pthread_cond_wait(&hotplug_idle, &hotplug_lock);
+	}
+	while (devices != NULL) {
+		hotplug_forget(devices);
+	}
+	logger_flush();
+	printf("\n%d of %d device(s) succeeded", hotplug_done - hotplug_failed - hotplug_queued, hotplug_done);
+	if (hotplug_queued > 0) {
+		printf(", %d queued until the server can be reached", hotplug_queued);
+	}
+	printf("\n");
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return 0;
+}
@@ -0,0 +1,742 @@
+/*
+ * http.c
+ * Process wide pool of curl handles that keeps connections to the activation
+ * server alive between requests.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "form.h"
+#include "http.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+
+#define HTTP_POOL_SIZE 64
+
+/* no hedging until the p95 means something, and never sooner than this */
+#define HTTP_HEDGE_MIN_SAMPLES 20
+#define HTTP_HEDGE_MIN_MS 10
+#define HTTP_CANCEL_CHECK_MS 50  /* how often a backoff wait looks at the cancel flag */
+
+/* latencies in microseconds, 8 buckets per doubling (about 9% apart) up to
+ * a couple of hours */
+#define HTTP_HISTOGRAM_STEPS 8
+#define HTTP_HISTOGRAM_SIZE (32 * HTTP_HISTOGRAM_STEPS)
+
+typedef struct {
+	unsigned long counts[HTTP_HISTOGRAM_SIZE];
+	unsigned long total;
+	uint64_t max;
+} http_histogram;
+
+/* Idle handles are kept on a simple stack. Every handle is attached to the
+ * same share object, so DNS results, TLS sessions and open connections are
+ * reused no matter which handle a request ends up on. */
+static CURL* pool[HTTP_POOL_SIZE];
+static int pool_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CURLSH* share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+/* Set once by http_configure() before any session exists, read-only after */
+static activation_http_config_t policy;
+static char* policy_url = NULL;
+
+/* bumped atomically, every worker thread goes through here per request */
+static unsigned long requests = 0;
+static unsigned long reused = 0;
+static unsigned long retried = 0;
+static unsigned long hedged = 0;
+static unsigned long hedges_won = 0;
+
+/* answered attempts, which the hedge delay comes from, and whole requests
+ * from first attempt to last, which is what the stats report */
+static http_histogram attempt_latency;
+static http_histogram request_latency;
+
+static __thread unsigned int http_seed = 0;
+
+static void http_share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* user)
+{
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+static void http_share_unlock(CURL* handle, curl_lock_data data, void* user)
+{
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+/* Options every pooled handle carries. curl_easy_reset() wipes these along
+ * with the per-request ones, so they're put back on every release. */
+static void http_setup(CURL* handle)
+{
+	curl_easy_setopt(handle, CURLOPT_SHARE, share);
+	curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, (long)HTTP_MAX_CONNECTS);
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, policy.connect_timeout_ms);
+	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, form_headers());
+}
+
+void http_defaults(activation_http_config_t* config)
+{
+	memset(config, 0, sizeof(activation_http_config_t));
+	config->url = HTTP_DEFAULT_URL;
+	config->connect_timeout_ms = 10000;
+	config->timeout_ms = 60000;
+	config->retries = 3;
+	config->backoff_ms = 250;
+	config->backoff_max_ms = 4000;
+	config->hedge = 0;
+}
+
+/* Must be called after http_init() and before the first handle is handed
+ * out. A timeout of zero means none. */
+int http_configure(const activation_http_config_t* config)
+{
+	if (config->connect_timeout_ms < 0 || config->timeout_ms < 0 || config->retries < 0 || config->backoff_ms < 0 || config->backoff_max_ms < config->backoff_ms) {
+		error("Invalid HTTP settings");
+		return -1;
+	}
+
+	char* url = strdup((config->url != NULL) ? config->url : HTTP_DEFAULT_URL);
+	if (url == NULL) {
+		error("Unable to allocate sufficent memory");
+		return -1;
+	}
+
+	free(policy_url);
+	policy_url = url;
+	policy = *config;
+	policy.url = policy_url;
+	return 0;
+}
+
+const char* http_url()
+{
+	return (policy.url != NULL) ? policy.url : HTTP_DEFAULT_URL;
+}
+
+/* Must be called once, before any thread is started. */
+int http_init()
+{
+	int i = 0;
+
+	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+		error("Unable to initialize libcurl");
+		return -1;
+	}
+
+	http_defaults(&policy);
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_init(&share_locks[i], NULL);
+	}
+
+	share = curl_share_init();
+	if (share == NULL) {
+		error("Unable to initialize libcurl");
+		curl_global_cleanup();
+		return -1;
+	}
+
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, http_share_lock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	if (form_init() != 0) {
+		curl_share_cleanup(share);
+		share = NULL;
+		curl_global_cleanup();
+		return -1;
+	}
+
+	return 0;
+}
+
+void http_cleanup()
+{
+	int i = 0;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < pool_count; i++) {
+		curl_easy_cleanup(pool[i]);
+	}
+	pool_count = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	if (share != NULL) {
+		curl_share_cleanup(share);
+		share = NULL;
+	}
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_destroy(&share_locks[i]);
+	}
+
+	free(policy_url);
+	policy_url = NULL;
+	policy.url = NULL;
+
+	form_cleanup();
+	curl_global_cleanup();
+}
+
+/* Hands out an idle handle, or a fresh one if they're all busy. */
+CURL* http_acquire()
+{
+	CURL* handle = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count > 0) {
+		handle = pool[--pool_count];
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (handle == NULL) {
+		handle = curl_easy_init();
+		if (handle == NULL) {
+			return NULL;
+		}
+		http_setup(handle);
+	}
+
+	return handle;
+}
+
+/* Clears whatever the last request set, for a caller that keeps its handle
+ * across requests instead of giving it back to the pool. */
+void http_reset(CURL* handle)
+{
+	curl_easy_reset(handle);
+	http_setup(handle);
+}
+
+void http_release(CURL* handle)
+{
+	if (handle == NULL) {
+		return;
+	}
+
+	http_reset(handle);
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < HTTP_POOL_SIZE) {
+		pool[pool_count++] = handle;
+		handle = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (handle != NULL) {
+		curl_easy_cleanup(handle);
+	}
+}
+
+/* Breaks a finished transfer down using curl's own timers, which count
+ * microseconds from the start of the request. Phases that didn't happen,
+ * like DNS or TLS on a reused connection, come out as zero and are skipped. */
+static void http_trace(CURL* handle, uint64_t start)
+{
+	curl_off_t dns = 0, tcp = 0, tls = 0, sent = 0, first = 0, total = 0;
+
+	curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+	curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &tcp);
+	curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &tls);
+	curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &sent);
+	curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &first);
+	curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+
+	if (dns > 0) {
+		trace_span("http_dns", start, start + dns * 1000);
+	}
+	if (tcp > dns) {
+		trace_span("http_connect", start + dns * 1000, start + tcp * 1000);
+	}
+	if (tls > tcp) {
+		trace_span("http_tls", start + tcp * 1000, start + tls * 1000);
+	}
+	if (first > sent) {
+		trace_span("http_wait", start + sent * 1000, start + first * 1000);
+	}
+	if (total > first && first > 0) {
+		trace_span("http_receive", start + first * 1000, start + total * 1000);
+	}
+}
+
+static int http_bucket(uint64_t us)
+{
+	if (us < HTTP_HISTOGRAM_STEPS) {
+		return (int)us;
+	}
+
+	int octave = 63 - __builtin_clzll(us);
+	int bucket = (octave - 2) * HTTP_HISTOGRAM_STEPS + (int)((us >> (octave - 3)) & (HTTP_HISTOGRAM_STEPS - 1));
+	return (bucket < HTTP_HISTOGRAM_SIZE) ? bucket : HTTP_HISTOGRAM_SIZE - 1;
+}
+
+/* the smallest latency that lands in a bucket */
+static uint64_t http_bucket_floor(int bucket)
+{
+	if (bucket < HTTP_HISTOGRAM_STEPS) {
+		return bucket;
+	}
+
+	int octave = bucket / HTTP_HISTOGRAM_STEPS + 2;
+	uint64_t step = bucket % HTTP_HISTOGRAM_STEPS;
+	return (HTTP_HISTOGRAM_STEPS + step) << (octave - 3);
+}
+
+static void http_histogram_add(http_histogram* histogram, uint64_t us)
+{
+	__sync_fetch_and_add(&histogram->counts[http_bucket(us)], 1);
+	__sync_fetch_and_add(&histogram->total, 1);
+
+	uint64_t max = __sync_fetch_and_add(&histogram->max, 0);
+	while (us > max && !__sync_bool_compare_and_swap(&histogram->max, max, us)) {
+		max = __sync_fetch_and_add(&histogram->max, 0);
+	}
+}
+
+/* The latency below which a share p of the samples fall, rounded up to the
+ * top of its bucket so it is never optimistic. */
+static uint64_t http_percentile(http_histogram* histogram, double p)
+{
+	unsigned long total = __sync_fetch_and_add(&histogram->total, 0);
+	unsigned long rank = (unsigned long)(p * total + 0.5);
+	unsigned long seen = 0;
+	int i = 0;
+
+	if (total == 0) {
+		return 0;
+	}
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	for (i = 0; i < HTTP_HISTOGRAM_SIZE; i++) {
+		seen += __sync_fetch_and_add(&histogram->counts[i], 0);
+		if (seen >= rank) {
+			uint64_t top = http_bucket_floor(i + 1);
+			uint64_t max = __sync_fetch_and_add(&histogram->max, 0);
+			return (top < max) ? top : max;
+		}
+	}
+	return __sync_fetch_and_add(&histogram->max, 0);
+}
+
+/* Bookkeeping for a finished transfer, however it was driven. A request that
+ * didn't have to open a new connection counts as a reused one. start is the
+ * trace_now() reading from when it was sent. */
+static void http_finished(CURL* handle, CURLcode res, uint64_t start)
+{
+	long connects = 0;
+	uint64_t end = trace_now();
+
+	if (trace_enabled) {
+		trace_span("http_post", start, end);
+		http_trace(handle, start);
+	}
+	if (metrics_enabled) {
+		metrics_observe(METRICS_HTTP_FETCH, end - start);
+	}
+	curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+
+	__sync_fetch_and_add(&requests, 1);
+	if (res == CURLE_OK) {
+		http_histogram_add(&attempt_latency, (end - start) / 1000);
+		if (connects == 0) {
+			__sync_fetch_and_add(&reused, 1);
+		}
+	}
+}
+
+/* Failures worth another go: the network, an overloaded server, a timeout.
+ * Anything else (a bad URL, a reply we refused to buffer) would only fail
+ * the same way again. */
+static int http_transient(CURLcode res, long status)
+{
+	switch (res) {
+	case CURLE_OK:
+		return (status == 429 || status == 500 || status == 502 || status == 503 || status == 504);
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* What's left of the request's total timeout in ms, LONG_MAX without one */
+static long http_remaining(http_request* request)
+{
+	if (policy.timeout_ms <= 0) {
+		return LONG_MAX;
+	}
+	return policy.timeout_ms - (long)((trace_now() - request->first) / 1000000);
+}
+
+/* Caps a transfer at whatever the request has left */
+static void http_arm(http_request* request, CURL* handle)
+{
+	long remaining = http_remaining(request);
+	if (remaining != LONG_MAX) {
+		curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, (remaining > 0) ? remaining : 1L);
+	}
+}
+
+void http_request_init(http_request* request, CURL* handle, activate_response* response)
+{
+	memset(request, 0, sizeof(http_request));
+	request->handle = handle;
+	request->response = response;
+	request->first = trace_now();
+}
+
+/* Starts an attempt on multi. */
+int http_request_send(http_request* request, CURLM* multi)
+{
+	http_arm(request, request->handle);
+	request->sent = trace_now();
+	request->done = 0;
+	request->settled = 0;
+	request->hedged = 0;
+
+	if (curl_multi_add_handle(multi, request->handle) != CURLM_OK) {
+		request->res = CURLE_FAILED_INIT;
+		request->done = 1;
+		request->settled = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/* How many ms from now the current attempt should be hedged: once it has
+ * taken as long as 95% of answered attempts do. -1 when it won't be. */
+long http_request_hedge_in(http_request* request)
+{
+	if (!policy.hedge || request->hedged || request->done) {
+		return -1;
+	}
+	if (__sync_fetch_and_add(&attempt_latency.total, 0) < HTTP_HEDGE_MIN_SAMPLES) {
+		return -1;
+	}
+
+	long p95 = (long)(http_percentile(&attempt_latency, 0.95) / 1000);
+	if (p95 < HTTP_HEDGE_MIN_MS) {
+		p95 = HTTP_HEDGE_MIN_MS;
+	}
+
+	long waited = (long)((trace_now() - request->sent) / 1000000);
+	return (waited >= p95) ? 0 : p95 - waited;
+}
+
+/* Sends a copy of the current attempt alongside it, with its own response
+ * buffer; whichever answers first is the one http_request_done() keeps. */
+int http_request_send_hedge(http_request* request, CURLM* multi)
+{
+	request->hedged = 1;
+
+	CURL* hedge = curl_easy_duphandle(request->handle);
+	if (hedge == NULL) {
+		return -1;
+	}
+	if (response_init_arena(&request->hedge_response, request->response->body.arena, request->response->limit) != 0) {
+		curl_easy_cleanup(hedge);
+		return -1;
+	}
+
+	/* a duplicate starts out without the share, so it wouldn't reuse a thing */
+	curl_easy_setopt(hedge, CURLOPT_SHARE, share);
+	curl_easy_setopt(hedge, CURLOPT_WRITEDATA, &request->hedge_response);
+	http_arm(request, hedge);
+
+	request->hedge = hedge;
+	request->hedge_sent = trace_now();
+	request->hedge_done = 0;
+	if (curl_multi_add_handle(multi, hedge) != CURLM_OK) {
+		curl_easy_cleanup(hedge);
+		response_free(&request->hedge_response);
+		request->hedge = NULL;
+		return -1;
+	}
+
+	__sync_fetch_and_add(&hedged, 1);
+	return 0;
+}
+
+/* Keeps the winner's result (and body) and drops the other transfer, done or not. */
+static void http_request_settle(http_request* request, CURLM* multi, int hedge_won)
+{
+	CURL* winner = hedge_won ? request->hedge : request->handle;
+
+	curl_easy_getinfo(winner, CURLINFO_RESPONSE_CODE, &request->status);
+	curl_easy_getinfo(winner, CURLINFO_RETRY_AFTER, &request->retry_after);
+
+	if (hedge_won) {
+		activate_response swap = *request->response;
+		*request->response = request->hedge_response;
+		request->hedge_response = swap;
+		request->res = request->hedge_res;
+		if (!request->done) {
+			curl_multi_remove_handle(multi, request->handle);
+		}
+		__sync_fetch_and_add(&hedges_won, 1);
+	} else if (request->hedge != NULL && !request->hedge_done) {
+		curl_multi_remove_handle(multi, request->hedge);
+	}
+
+	if (request->hedge != NULL) {
+		curl_easy_cleanup(request->hedge);
+		response_free(&request->hedge_response);
+		request->hedge = NULL;
+	}
+
+	request->response->status = request->status;
+	request->done = 1;
+	request->settled = 1;
+}
+
+/* Call for every transfer of the request multi reports done, the hedge
+ * included. Returns 1 once the attempt is settled: the first transfer to
+ * succeed wins, a failure only counts once there's nothing left running. */
+int http_request_done(http_request* request, CURLM* multi, CURL* easy, CURLcode res)
+{
+	int is_hedge = (request->hedge != NULL && easy == request->hedge);
+
+	curl_multi_remove_handle(multi, easy);
+	http_finished(easy, res, is_hedge ? request->hedge_sent : request->sent);
+
+	if (is_hedge) {
+		request->hedge_done = 1;
+		request->hedge_res = res;
+	} else {
+		request->done = 1;
+		request->res = res;
+	}
+
+	int primary_ok = request->done && request->res == CURLE_OK;
+	int hedge_ok = request->hedge_done && request->hedge_res == CURLE_OK;
+	int all_done = request->done && (request->hedge == NULL || request->hedge_done);
+
+	if (hedge_ok && !primary_ok) {
+		http_request_settle(request, multi, 1);
+	} else if (primary_ok || all_done) {
+		http_request_settle(request, multi, 0);
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/* Once an attempt is settled: how many ms to wait before the next one, or
+ * -1 if there shouldn't be one. The wait doubles with every attempt, up to
+ * backoff_max_ms, and is picked at random from its upper half so a rack of
+ * devices that failed together doesn't come back together. A Retry-After
+ * from the server is honoured, as long as it fits in the total timeout. */
+long http_request_retry_in(http_request* request)
+{
+	if (!http_transient(request->res, request->status) || request->attempt >= policy.retries) {
+		return -1;
+	}
+
+	long cap = policy.backoff_ms;
+	int i = 0;
+	for (i = 0; i < request->attempt && cap < policy.backoff_max_ms; i++) {
+		cap *= 2;
+	}
+	if (cap > policy.backoff_max_ms) {
+		cap = policy.backoff_max_ms;
+	}
+
+	if (http_seed == 0) {
+		http_seed = (unsigned int)trace_now() ^ (unsigned int)pthread_self();
+	}
+	long delay = cap / 2 + ((cap > 1) ? (long)(rand_r(&http_seed) % (cap - cap / 2 + 1)) : cap);
+	if (request->retry_after > 0 && request->retry_after * 1000 > delay) {
+		delay = (long)request->retry_after * 1000;
+	}
+
+	if (delay >= http_remaining(request)) {
+		return -1;
+	}
+
+	char m[256];
+	if (request->res == CURLE_OK) {
+		snprintf(m, sizeof(m), "Activation server answered %ld, retrying in %ldms", request->status, delay);
+	} else {
+		snprintf(m, sizeof(m), "Activation request failed (%s), retrying in %ldms", curl_easy_strerror(request->res), delay);
+	}
+	info(m);
+
+	request->attempt++;
+	response_reset(request->response);
+	__sync_fetch_and_add(&retried, 1);
+	return delay;
+}
+
+/* Call once a request has had its last attempt. */
+/* Takes whatever of an unsettled request is still on multi off it, for when
+ * nobody is going to wait for the answer any more. */
+void http_request_abandon(http_request* request, CURLM* multi)
+{
+	if (!request->done) {
+		curl_multi_remove_handle(multi, request->handle);
+		request->res = CURLE_ABORTED_BY_CALLBACK;
+		request->done = 1;
+	}
+	if (request->hedge != NULL) {
+		if (!request->hedge_done) {
+			curl_multi_remove_handle(multi, request->hedge);
+		}
+		curl_easy_cleanup(request->hedge);
+		response_free(&request->hedge_response);
+		request->hedge = NULL;
+	}
+	request->settled = 1;
+}
+
+void http_request_finish(http_request* request)
+{
+	http_histogram_add(&request_latency, (trace_now() - request->first) / 1000);
+}
+
+/* One attempt, start to finish. Without a hedge to send there's no need for
+ * a multi handle of our own. */
+static void http_request_wait(http_request* request)
+{
+	CURLMsg* msg = NULL;
+	int running = 0;
+	int left = 0;
+
+	CURLM* multi = (http_request_hedge_in(request) >= 0) ? curl_multi_init() : NULL;
+	if (multi == NULL) {
+		http_arm(request, request->handle);
+		request->sent = trace_now();
+		request->res = curl_easy_perform(request->handle);
+		http_finished(request->handle, request->res, request->sent);
+		curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE, &request->status);
+		curl_easy_getinfo(request->handle, CURLINFO_RETRY_AFTER, &request->retry_after);
+		request->response->status = request->status;
+		request->done = 1;
+		request->settled = 1;
+		return;
+	}
+
+	if (http_request_send(request, multi) == 0) {
+		while (!request->settled) {
+			curl_multi_perform(multi, &running);
+			while (!request->settled && (msg = curl_multi_info_read(multi, &left)) != NULL) {
+				if (msg->msg == CURLMSG_DONE) {
+					http_request_done(request, multi, msg->easy_handle, msg->data.result);
+				}
+			}
+			if (request->settled) {
+				break;
+			}
+
+			long wait = http_request_hedge_in(request);
+			if (wait == 0) {
+				http_request_send_hedge(request, multi);
+				continue;
+			}
+			curl_multi_poll(multi, NULL, 0, (wait < 0 || wait > 1000) ? 1000 : (int)wait, NULL);
+		}
+	}
+
+	curl_multi_cleanup(multi);
+}
+
+/* Sleeps between attempts in short slices, so a session cancelled in the
+ * meantime (its device unplugged) doesn't sit out the whole backoff.
+ * Returns -1 once *cancel is set. */
+static int http_backoff(long ms, volatile int* cancel)
+{
+	while (ms > 0) {
+		if (cancel != NULL && *cancel) {
+			return -1;
+		}
+		long slice = (ms < HTTP_CANCEL_CHECK_MS) ? ms : HTTP_CANCEL_CHECK_MS;
+		usleep(slice * 1000);
+		ms -= slice;
+	}
+	return (cancel != NULL && *cancel) ? -1 : 0;
+}
+
+/* Sends a request and waits for the answer, retrying and hedging as
+ * configured; response gets the body of whichever attempt counted. Once
+ * *cancel (which may be NULL) is set no further attempt is made, and the
+ * last attempt's result is returned. */
+CURLcode http_perform(CURL* handle, activate_response* response, volatile int* cancel)
+{
+	http_request request;
+	long delay = 0;
+
+	http_request_init(&request, handle, response);
+	do {
+		if (delay > 0 && http_backoff(delay, cancel) != 0) {
+			break;
+		}
+		http_request_wait(&request);
+	} while ((delay = http_request_retry_in(&request)) >= 0);
+	http_request_finish(&request);
+
+	return request.res;
+}
+
+void http_stats(unsigned long* total, unsigned long* reused_total)
+{
+	*total = __sync_fetch_and_add(&requests, 0);
+	*reused_total = __sync_fetch_and_add(&reused, 0);
+}
+
+void http_print_stats(FILE* out)
+{
+	unsigned long total = 0;
+	unsigned long reused_total = 0;
+
+	http_stats(&total, &reused_total);
+	if (total == 0) {
+		return;
+	}
+
+	fprintf(out, "HTTP: %lu request(s), %lu on a reused connection (%.0f%%)\n", total, reused_total, 100.0 * reused_total / total);
+	fprintf(out, "HTTP: latency p50 %.1fms p95 %.1fms p99 %.1fms max %.1fms, %lu retried, %lu hedged (%lu won)\n",
+		http_percentile(&request_latency, 0.50) / 1000.0, http_percentile(&request_latency, 0.95) / 1000.0,
+		http_percentile(&request_latency, 0.99) / 1000.0, __sync_fetch_and_add(&request_latency.max, 0) / 1000.0,
+		__sync_fetch_and_add(&retried, 0), __sync_fetch_and_add(&hedged, 0), __sync_fetch_and_add(&hedges_won, 0));
+}
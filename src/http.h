@@ -0,0 +1,86 @@
+/*
+ * http.h
+ * Process wide pool of curl handles that keeps connections to the activation
+ * server alive between requests.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <curl/curl.h>
+
+#include "libideviceactivate.h"
+#include "response.h"
+
+#define HTTP_DEFAULT_URL "https://albert.apple.com/WebObjects/ALUnbrick.woa/wa/deviceActivation"
+
+/* Idle connections the shared cache keeps, at least one per device talking
+ * at once. libcurl's default of 5 had every request past the fifth
+ * concurrent one open a new connection. */
+#define HTTP_MAX_CONNECTS 256
+
+/* One request, through however many attempts and hedged copies it takes.
+ * Whoever drives the transfers (http_perform() here, or the engine) adds the
+ * handles to a multi handle and reports back through http_request_done(). */
+typedef struct {
+	CURL* handle;
+	activate_response* response;
+	uint64_t first;       /* when the first attempt went out */
+	uint64_t sent;        /* when this attempt went out */
+	int attempt;
+	int done;             /* this attempt's own transfer has finished */
+	int settled;          /* and either it or the hedge won */
+	CURLcode res;
+	long status;
+	curl_off_t retry_after;
+
+	int hedged;           /* a copy was tried for this attempt */
+	CURL* hedge;
+	activate_response hedge_response;
+	uint64_t hedge_sent;
+	int hedge_done;
+	CURLcode hedge_res;
+} http_request;
+
+extern int http_init();
+extern void http_cleanup();
+extern void http_defaults(activation_http_config_t* config);
+extern int http_configure(const activation_http_config_t* config);
+extern const char* http_url();
+
+extern CURL* http_acquire();
+extern void http_release(CURL* handle);
+extern void http_reset(CURL* handle);
+extern CURLcode http_perform(CURL* handle, activate_response* response, volatile int* cancel);
+
+extern void http_request_init(http_request* request, CURL* handle, activate_response* response);
+extern int http_request_send(http_request* request, CURLM* multi);
+extern long http_request_hedge_in(http_request* request);
+extern int http_request_send_hedge(http_request* request, CURLM* multi);
+extern int http_request_done(http_request* request, CURLM* multi, CURL* easy, CURLcode res);
+extern long http_request_retry_in(http_request* request);
+extern void http_request_abandon(http_request* request, CURLM* multi);
+extern void http_request_finish(http_request* request);
+
+extern void http_stats(unsigned long* requests, unsigned long* reused);
+extern void http_print_stats(FILE* out);
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * idevice.c
+ * Handles stuff like freeing up & starting connections
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "idevice.h"
+#include "metrics.h"
+#include "trace.h"
+#include "transport.h"
+#include "util.h"
+
+/* An established lockdownd session nobody is using right now. There is at most
+ * one per device; taking it out of the pool hands it over to one caller. */
+typedef struct device_pooled {
+	char* uuid;
+	device_link* link;
+	time_t idle_since;
+	struct device_pooled* next;
+} device_pooled;
+
+/* Set once, before the first connection, and only read after that */
+const device_transport* device_transport_current = &lockdown_transport;
+
+static device_pooled* device_pool = NULL;
+static pthread_mutex_t device_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long device_handshakes = 0;
+static unsigned long device_reused = 0;
+
+static void device_pooled_free(device_pooled* entry)
+{
+	disconnect_device(entry->link);
+	free(entry->uuid);
+	free(entry);
+}
+
+/* Takes the pooled session for uuid if there is one and it still answers.
+ * lockdownd drops sessions that sit idle too long, so old ones aren't even
+ * asked. */
+static int device_pool_take(const char* uuid, device_link** link)
+{
+	device_pooled** prev = NULL;
+	device_pooled* entry = NULL;
+
+	pthread_mutex_lock(&device_pool_lock);
+	for (prev = &device_pool; *prev != NULL; prev = &(*prev)->next) {
+		if (!strcmp((*prev)->uuid, uuid)) {
+			entry = *prev;
+			*prev = entry->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&device_pool_lock);
+
+	if (entry == NULL) {
+		return -1;
+	}
+
+	if (time(NULL) - entry->idle_since > DEVICE_POOL_IDLE_MAX) {
+		device_pooled_free(entry);
+		return -1;
+	}
+
+	if (trace_enabled) {
+		trace_set_uuid(uuid);
+	}
+	TRACE_BEGIN(check_start);
+	int res = device_transport_current->check(entry->link);
+	TRACE_END("lockdownd_check", check_start);
+	if (res != 0) {
+		device_pooled_free(entry);
+		return -1;
+	}
+
+	*link = entry->link;
+	entry->link = NULL;
+	device_pooled_free(entry);
+
+	__sync_fetch_and_add(&device_reused, 1);
+	return 0;
+}
+
+/* Opens a device and a lockdownd session on it without touching any globals,
+ * so several devices can be handled at once from different threads. With a
+ * UUID, a session release_device() pooled is reused if it still works, and
+ * only the first connection to a device pays for the handshake. */
+int connect_device(const char* uuid, device_link** link)
+{
+	*link = NULL;
+
+	if (uuid != NULL && device_pool_take(uuid, link) == 0) {
+		return 0;
+	}
+
+	TRACE_BEGIN(connect_start);
+	METRICS_BEGIN(connect_time);
+	if (device_transport_current->connect(uuid, link) != 0) {
+		error("No device found, is it plugged in?");
+		return -1;
+	}
+
+	if (trace_enabled) {
+		char* found = NULL;
+		if (uuid == NULL && (found = device_transport_current->get_uuid(*link)) != NULL) {
+			trace_set_uuid(found);
+			free(found);
+		} else {
+			trace_set_uuid(uuid);
+		}
+	}
+	TRACE_END("usbmux_connect", connect_start);
+	METRICS_END(METRICS_USBMUX_CONNECT, connect_time);
+
+	TRACE_BEGIN(handshake_start);
+	METRICS_BEGIN(handshake_time);
+	int client_error = device_transport_current->handshake(*link);
+	TRACE_END("lockdownd_handshake", handshake_start);
+	METRICS_END(METRICS_LOCKDOWND_HANDSHAKE, handshake_time);
+	if (client_error != 0) {
+		error("Unable to connect to lockdownd");
+		disconnect_device(*link);
+		*link = NULL;
+		return -1;
+	}
+
+	__sync_fetch_and_add(&device_handshakes, 1);
+	return 0;
+}
+
+void disconnect_device(device_link* link)
+{
+	if (link != NULL)
+	{
+		device_transport_current->disconnect(link);
+	}
+}
+
+/* Swaps the transport, before anything has been connected through the old one */
+void transport_use(const device_transport* t)
+{
+	device_transport_current = t;
+}
+
+/* Hands a connection back for the next connect_device() on the same device,
+ * unless the caller says it is no good any more. A device already with a
+ * session in the pool keeps that one. */
+void release_device(const char* uuid, device_link* link, int reusable)
+{
+	device_pooled* entry = NULL;
+
+	if (!reusable || uuid == NULL || link == NULL) {
+		disconnect_device(link);
+		return;
+	}
+
+	pthread_mutex_lock(&device_pool_lock);
+	for (entry = device_pool; entry != NULL; entry = entry->next) {
+		if (!strcmp(entry->uuid, uuid)) {
+			break;
+		}
+	}
+	if (entry == NULL) {
+		entry = calloc(1, sizeof(device_pooled));
+		if (entry != NULL && (entry->uuid = strdup(uuid)) != NULL) {
+			entry->link = link;
+			entry->idle_since = time(NULL);
+			entry->next = device_pool;
+			device_pool = entry;
+			link = NULL;
+		} else {
+			free(entry);
+		}
+	}
+	pthread_mutex_unlock(&device_pool_lock);
+
+	disconnect_device(link);
+}
+
+/* Drops the pooled session of one device (every device when uuid is NULL),
+ * for when it is unplugged or the process is done with them. */
+void device_pool_evict(const char* uuid)
+{
+	device_pooled** link = &device_pool;
+	device_pooled* evicted = NULL;
+
+	pthread_mutex_lock(&device_pool_lock);
+	while (*link != NULL) {
+		device_pooled* entry = *link;
+		if (uuid == NULL || !strcmp(entry->uuid, uuid)) {
+			*link = entry->next;
+			entry->next = evicted;
+			evicted = entry;
+		} else {
+			link = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&device_pool_lock);
+
+	/* disconnecting talks to the device, so not under the lock */
+	while (evicted != NULL) {
+		device_pooled* next = evicted->next;
+		device_pooled_free(evicted);
+		evicted = next;
+	}
+}
+
+void device_pool_stats(unsigned long* handshakes, unsigned long* reused)
+{
+	*handshakes = __sync_fetch_and_add(&device_handshakes, 0);
+	*reused = __sync_fetch_and_add(&device_reused, 0);
+}
+
+void device_pool_print_stats(FILE* out)
+{
+	unsigned long handshakes = 0, reused = 0;
+	device_pool_stats(&handshakes, &reused);
+
+	if (handshakes + reused == 0) {
+		return;
+	}
+	fprintf(out, "LOCKDOWN: %lu connection(s), %lu reused from the pool (%.0f%%)\n",
+		handshakes + reused, reused, 100.0 * reused / (handshakes + reused));
+}
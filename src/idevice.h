@@ -21,6 +21,16 @@
 #ifndef IDEVICE_H
 	#define IDEVICE_H
 
-	extern void init_lockdownd(char* uuid);
-	extern void free_up();
+	#include <stdio.h>
+	#include "transport.h"
+
+	/* seconds a pooled lockdownd session may sit unused and still be trusted */
+	#define DEVICE_POOL_IDLE_MAX 60
+
+	extern int connect_device(const char* uuid, device_link** link);
+	extern void disconnect_device(device_link* link);
+	extern void release_device(const char* uuid, device_link* link, int reusable);
+	extern void device_pool_evict(const char* uuid);
+	extern void device_pool_stats(unsigned long* handshakes, unsigned long* reused);
+	extern void device_pool_print_stats(FILE* out);
 #endif
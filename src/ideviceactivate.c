@@ -24,20 +24,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <plist/plist.h>
-#include <libimobiledevice/lockdown.h>
-#include <libimobiledevice/libimobiledevice.h>
 
-#include "activate.h"
+#include "libideviceactivate.h"
 #include "cache.h"
 #include "util.h"
+#include "station.h"
+#include "hotplug.h"
+#include "batch.h"
+#include "http.h"
 #include "idevice.h"
-
-char* cachedir = NULL;
-int use_cache=0;
-int backup_to_cache=0;
-
-idevice_t device = NULL;
-lockdownd_client_t client = NULL;
+#include "spool.h"
+#include "trace.h"
+#include "logger.h"
 
 static void usage(int argc, char** argv) {
 	char* name = strrchr(argv[0], '/');
@@ -45,7 +43,7 @@ static void usage(int argc, char** argv) {
 	printf("Activate or Deactivate an iPhone device .\n\n");
 	printf("options:\n");
 	printf("  -x\t\tdeactivate the target device\n");
-	printf("  -d\t\tenable communication debugging\n");
+	printf("  -d\t\tenable communication debugging (log every request, reply and record in full)\n");
 	printf("  -h\t\tprints usage information\n");
 	printf("  -u UUID\ttarget specific device by its 40-digit device UUID\n");
 	printf("  -e IMEI\tprovide the IMEI to use when sending the activation request\n");
@@ -55,17 +53,150 @@ static void usage(int argc, char** argv) {
 	printf("  -f FILE\tactivates device with local activation record\n");
 	printf("  -c DIR\tcaches activation data, enabling you to reactivate later\n");
 	printf("  -r DIR\tuses the specfied cache to activate the device\n");
+	printf("  -a\t\tactivate every attached device at once (station mode)\n");
+	printf("  -j WORKERS\tnumber of devices to work on at once with -a (default: all)\n");
+	printf("  -m MODE\thow -a runs: threads (one per device, default), engine (one event loop,\n\t\tWORKERS threads for the device side) or pipeline (a pool per stage)\n");
+	printf("  -p POOLS\tpool sizes for -m pipeline, e.g. query=4,build=1,fetch=16,parse=1,activate=4,queue=32\n");
+	printf("  -C\t\treconcile: skip devices that are already activated (or deactivated, with -x)\n");
+	printf("  -w\t\tkeep running and activate devices as they are plugged in\n");
+	printf("  -b FILE\trun the jobs in a CSV or JSONL manifest, one JSON result line per device\n");
+	printf("  -k DIR\tkeep fetched activation records in DIR and reuse them next time\n");
+	printf("  -l DIR\tpreload every <UUID>.plist in DIR into the -k record store first\n");
+	printf("  -t FILE\twrite how long each stage of every activation took to FILE\n");
+	printf("  -L FILE\tlog to FILE, one JSON object per line, instead of the terminal\n");
+	printf("  -q DIR\t\tqueue requests in DIR while the server can't be reached and send them once it can\n");
+	printf("  -F SECONDS\twait up to SECONDS for the -q queue to empty before exiting; on its own, only that\n");
+	printf("  -M ADDRESS\tserve Prometheus metrics on ADDRESS: a port, HOST:PORT or a Unix socket path\n");
+	printf("  -V SPEC\tsimulated devices instead of real ones, e.g. count=1000,query=8,activate=300\n\t\t(see README for the rest)\n");
+	printf("  -E URL\t\tsend activation requests to URL instead of Apple's server\n");
+	printf("  -T MS[,MS]\tconnect timeout, and total timeout per request including retries (default: 10000,60000)\n");
+	printf("  -R N\t\tretry a request that failed for a transient reason up to N times (default: 3)\n");
+	printf("  -H\t\thedge: send a second copy of a request still unanswered at the p95 latency\n");
 	printf("\n");
 	printf("Note: There is no point in the -e -s and -i flags for iPods!\n");
 	printf("\n");
 	printf("\n");
 }
 
+/* Parses -p, a comma separated list of stage=workers plus queue=size for
+ * every queue. Stages left out keep the library's defaults. */
+static int parse_pools(char* spec, activation_pipeline_config_t* config)
+{
+	char* save = NULL;
+	char* item = NULL;
+	int i = 0;
+
+	for (item = strtok_r(spec, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		char* value = strchr(item, '=');
+		if (value == NULL || atoi(value + 1) <= 0) {
+			return -1;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(item, "queue")) {
+			for (i = 0; i < ACTIVATION_PIPE_STAGES; i++) {
+				config->queue_size[i] = atoi(value);
+			}
+			continue;
+		}
+
+		for (i = 0; i < ACTIVATION_PIPE_STAGES; i++) {
+			if (!strcmp(item, activation_pipe_stage_name(i))) {
+				config->workers[i] = atoi(value);
+				break;
+			}
+		}
+		if (i == ACTIVATION_PIPE_STAGES) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Parses -V, a device count on its own or a comma separated list of
+ * setting=value, see activation_virtual_config_t. */
+static int parse_virtual(char* spec, activation_virtual_config_t* config)
+{
+	char* save = NULL;
+	char* item = NULL;
+
+	for (item = strtok_r(spec, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		char* value = strchr(item, '=');
+		if (value == NULL) {
+			config->count = atoi(item);
+			continue;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(item, "count")) {
+			config->count = atoi(value);
+		} else if (!strcmp(item, "props")) {
+			config->properties = value;
+		} else if (!strcmp(item, "state")) {
+			config->activation_state = value;
+		} else if (!strcmp(item, "info")) {
+			config->activation_info_size = atol(value);
+		} else if (!strcmp(item, "connect")) {
+			config->connect_ms = atol(value);
+		} else if (!strcmp(item, "handshake")) {
+			config->handshake_ms = atol(value);
+		} else if (!strcmp(item, "query")) {
+			config->query_ms = atol(value);
+		} else if (!strcmp(item, "generate")) {
+			config->activation_info_ms = atol(value);
+		} else if (!strcmp(item, "activate")) {
+			config->activate_ms = atol(value);
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Shows the record before it goes to the device, with -d */
+static void print_record(activation_session_t session, plist_t record, void* user_data)
+{
+	uint32_t len=0;
+	char *xml=NULL;
+
+	if (!LOGGER_ENABLED(LOGGER_DEBUG)) {
+		return;
+	}
+
+	plist_to_xml(record, &xml, &len);
+	if (xml != NULL) {
+		logger_payload("ACTIVATION RECORD", xml, len);
+		free(xml);
+	}
+}
+
 int main(int argc, char* argv[]) {
 	int opt = 0;
 	int debug = 0;
 	char* uuid = NULL;
 	char* file = NULL;
+	char* records_dir = NULL;
+	char* preload_dir = NULL;
+	char* manifest = NULL;
+	char* log_file = NULL;
+	char* spool_dir = NULL;
+	char* metrics_address = NULL;
+	long flush_wait = -1;
+
+	activation_options_t options;
+	memset(&options, 0, sizeof(options));
+
+	activation_pipeline_config_t pools;
+	memset(&pools, 0, sizeof(pools));
+
+	activation_http_config_t http;
+	activation_http_defaults(&http);
+
+	activation_virtual_config_t devices;
+	activation_virtual_defaults(&devices);
+	int simulate = 0;
 
 	char* cust_imei=NULL;
 	char* cust_imsi=NULL;
@@ -73,8 +204,12 @@ int main(int argc, char* argv[]) {
 	char* cust_serial_num=NULL;
 
 	int deactivate = 0;
+	int station = 0;
+	int watch = 0;
+	int workers = 0;
+	int mode = STATION_THREADS;
 
-	while ((opt = getopt(argc, argv, "dhxu:f:c:r:e:s:i:n:")) > 0) {
+	while ((opt = getopt(argc, argv, "dhxawHCu:f:c:r:e:s:i:n:j:k:l:t:m:p:E:T:R:b:L:V:q:F:M:")) > 0) {
 		switch (opt) {
 		case 'h':
 			usage(argc, argv);
@@ -97,14 +232,14 @@ int main(int argc, char* argv[]) {
 			break;
 
 		case 'c':
-			cachedir = optarg;
-			backup_to_cache=1;
+			options.cache_dir = optarg;
+			options.cache_mode = ACTIVATION_CACHE_WRITE;
 			cache_warning();
 			break;
 
 		case 'r':
-			cachedir = optarg;
-			use_cache=1;
+			options.cache_dir = optarg;
+			options.cache_mode = ACTIVATION_CACHE_READ;
 			break;
 
 		case 'e':
@@ -123,6 +258,103 @@ int main(int argc, char* argv[]) {
 			cust_serial_num=optarg;
 			break;
 
+		case 'a':
+			station = 1;
+			break;
+
+		case 'j':
+			workers = atoi(optarg);
+			break;
+
+		case 'w':
+			watch = 1;
+			break;
+
+		case 'b':
+			manifest = optarg;
+			break;
+
+		case 'm':
+			if (!strcmp(optarg, "engine")) {
+				mode = STATION_ENGINE;
+			} else if (!strcmp(optarg, "threads")) {
+				mode = STATION_THREADS;
+			} else if (!strcmp(optarg, "pipeline")) {
+				mode = STATION_PIPELINE;
+			} else {
+				usage(argc, argv);
+				return -1;
+			}
+			break;
+
+		case 'p':
+			if (parse_pools(optarg, &pools) != 0) {
+				usage(argc, argv);
+				return -1;
+			}
+			break;
+
+		case 'k':
+			records_dir = optarg;
+			break;
+
+		case 'l':
+			preload_dir = optarg;
+			break;
+
+		case 'E':
+			http.url = optarg;
+			break;
+
+		case 'T':
+			http.connect_timeout_ms = atol(optarg);
+			if (strchr(optarg, ',') != NULL) {
+				http.timeout_ms = atol(strchr(optarg, ',') + 1);
+			}
+			break;
+
+		case 'R':
+			http.retries = atoi(optarg);
+			break;
+
+		case 'H':
+			http.hedge = 1;
+			break;
+
+		case 'C':
+			options.reconcile = 1;
+			break;
+
+		case 't':
+			if (trace_open(optarg) != 0) {
+				return -1;
+			}
+			break;
+
+		case 'L':
+			log_file = optarg;
+			break;
+
+		case 'q':
+			spool_dir = optarg;
+			break;
+
+		case 'F':
+			flush_wait = atol(optarg);
+			break;
+
+		case 'M':
+			metrics_address = optarg;
+			break;
+
+		case 'V':
+			if (parse_virtual(optarg, &devices) != 0) {
+				usage(argc, argv);
+				return -1;
+			}
+			simulate = 1;
+			break;
+
 		default:
 			usage(argc, argv);
 			return -1;
@@ -132,75 +364,126 @@ int main(int argc, char* argv[]) {
 	argc -= optind;
 	argv += optind;
 
-	init_lockdownd(uuid);
+	if ((station || watch) && (uuid != NULL || file != NULL || cust_imei != NULL || cust_imsi != NULL || cust_iccid != NULL || cust_serial_num != NULL)) {
+		error("Station (-a) and watch (-w) modes work on every device, they can't be combined with -u, -f, -e, -s, -i or -n");
+		return -1;
+	}
 
-	if (use_cache==1)
-	{
-		if (check_cache(client)!=0)
-		{
-			error("The selected cache does not match this device :(");
-			free_up();
-			return -1;
-		}
+	if (manifest != NULL && (station || watch || deactivate || uuid != NULL || file != NULL || cust_imei != NULL || cust_imsi != NULL || cust_iccid != NULL || cust_serial_num != NULL)) {
+		error("Batch mode (-b) takes the devices, actions and overrides from the manifest, it can't be combined with -a, -w, -x, -u, -f, -e, -s, -i or -n");
+		return -1;
 	}
 
-	plist_t activation_record = NULL;
-	if (deactivate) {
-		deactivate_device(client);
-	} else {
-		if (file != NULL) {
-			printf("Reading activation record from %s\n", file);
-			if (plist_read_from_filename(&activation_record, file) < 0) {
-				error("Unable to find activation record");
-				free_up();
-				return -1;
-			}
+	options.imei = cust_imei;
+	options.imsi = cust_imsi;
+	options.iccid = cust_iccid;
+	options.serial_number = cust_serial_num;
 
-		} else {
-			printf("Creating activation request\n");
-			if(activate_fetch_record(client, &activation_record, cust_imei, cust_imsi, cust_iccid, cust_serial_num) < 0) {
-				error("Unable to fetch activation request");
-				free_up();
-				return -1;
-			}
-		}
+	if (preload_dir != NULL && records_dir == NULL) {
+		error("Preloading records (-l) needs a record store (-k)");
+		return -1;
+	}
+
+	if (flush_wait >= 0 && spool_dir == NULL) {
+		error("Waiting for the queue (-F) needs one (-q)");
+		return -1;
+	}
+
+	/* from here on messages are written by the logger's own thread */
+	if (logger_open(log_file, debug ? LOGGER_DEBUG : LOGGER_INFO) != 0) {
+		return -1;
+	}
+
+	if (activation_init() != 0) {
+		logger_close();
+		return -1;
+	}
+	if (activation_set_http(&http) != 0 || (records_dir != NULL && activation_keep_records(records_dir) != 0) ||
+		(simulate && activation_use_virtual_devices(&devices) != 0) ||
+		(metrics_address != NULL && activation_metrics_serve(metrics_address) != 0) ||
+		(spool_dir != NULL && activation_spool(spool_dir) != 0)) {
+		activation_cleanup();
+		logger_close();
+		return -1;
+	}
 
-		if (do_activation(client, activation_record)!=0)
-		{
-			free_up();
+	if (preload_dir != NULL) {
+		int loaded = activation_preload_records(preload_dir, 0);
+		if (loaded < 0) {
+			activation_cleanup();
+			logger_close();
 			return -1;
 		}
+		logger_flush();
+		fprintf((manifest != NULL) ? stderr : stdout, "Preloaded %d activation record(s) from %s\n", loaded, preload_dir);
 	}
 
-	free_up();
-	return 0;
-}
-
-void init_lockdownd(char* uuid)
-{
-	idevice_error_t device_error = idevice_new(&device, uuid);
-	if (device_error != IDEVICE_E_SUCCESS) {
-		error("No device found, is it plugged in?");
-		exit(-1);
+	if (station || watch || manifest != NULL) {
+		int failed = 0;
+		if (manifest != NULL) {
+			failed = batch_run(manifest, workers, &options);
+		} else if (watch) {
+			failed = hotplug_run(deactivate, &options);
+		} else {
+			failed = station_run(workers, deactivate, &options, mode, &pools);
+		}
+		if (flush_wait > 0) {
+			activation_spool_wait(flush_wait * 1000);
+		}
+		/* in batch mode stdout is only for the result lines */
+		logger_flush();
+		http_print_stats((manifest != NULL) ? stderr : stdout);
+		device_pool_print_stats((manifest != NULL) ? stderr : stdout);
+		spool_print_stats((manifest != NULL) ? stderr : stdout);
+		activation_cleanup();
+		logger_close();
+		trace_close();
+		return (failed == 0) ? 0 : -1;
 	}
 
-	lockdownd_error_t client_error = lockdownd_client_new_with_handshake(device, &client, "ideviceactivate");
-	if (client_error != LOCKDOWN_E_SUCCESS) {
-		error("Unable to connect to lockdownd");
-		free_up();
-		exit(-1);
+	/* -F without a device to work on just sees the queue out */
+	if (flush_wait >= 0 && !deactivate && uuid == NULL && file == NULL) {
+		int left = activation_spool_wait(flush_wait * 1000);
+		logger_flush();
+		spool_print_stats(stdout);
+		activation_cleanup();
+		logger_close();
+		trace_close();
+		return (left == 0) ? 0 : -1;
 	}
-}
 
-void free_up()
-{
-	if (device!=NULL)
-	{
-		idevice_free(device);
+	activation_session_t session = NULL;
+	activation_callbacks_t callbacks = { NULL, NULL, print_record, NULL };
+	activation_error_t err = activation_session_new(&session, uuid, &options, &callbacks, NULL);
+
+	if (err == ACTIVATION_E_SUCCESS) {
+		if (deactivate) {
+			err = activation_session_deactivate(session);
+		} else if (file != NULL) {
+			plist_t activation_record = NULL;
+			char m[512];
+			snprintf(m, sizeof(m), "Reading activation record from %s", file);
+			task(m);
+			if (plist_read_from_filename(&activation_record, file) < 0) {
+				error("Unable to find activation record");
+				err = ACTIVATION_E_INVALID_ARG;
+			} else {
+				err = activation_session_activate(session, activation_record);
+				plist_free(activation_record);
+			}
+		} else {
+			err = activation_session_run(session);
+		}
 	}
 
-	if (client!=NULL)
-	{
-		lockdownd_client_free(client);
+	activation_session_free(session);
+	if (flush_wait > 0) {
+		activation_spool_wait(flush_wait * 1000);
 	}
+	logger_flush();
+	spool_print_stats(stdout);
+	activation_cleanup();
+	logger_close();
+	trace_close();
+	return (err == ACTIVATION_E_SUCCESS || err == ACTIVATION_E_QUEUED) ? 0 : -1;
 }
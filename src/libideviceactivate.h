@@ -0,0 +1,201 @@
+/*
+ * libideviceactivate.h
+ * Embeddable activation API. Everything a device needs lives in its own
+ * session, so any number of sessions can run at once, one per thread.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LIBIDEVICEACTIVATE_H
+#define LIBIDEVICEACTIVATE_H
+
+#include <plist/plist.h>
+
+#define ACTIVATION_E_SUCCESS             0
+#define ACTIVATION_E_INVALID_ARG        -1
+#define ACTIVATION_E_NO_MEMORY          -2
+#define ACTIVATION_E_NO_DEVICE          -3
+#define ACTIVATION_E_CACHE_FAILED       -4
+#define ACTIVATION_E_CACHE_MISMATCH     -5
+#define ACTIVATION_E_FETCH_FAILED       -6
+#define ACTIVATION_E_ACTIVATE_FAILED    -7
+#define ACTIVATION_E_DEACTIVATE_FAILED  -8
+#define ACTIVATION_E_CANCELLED          -9
+#define ACTIVATION_E_QUEUED            -10  /* in the spool, see activation_spool() */
+
+typedef int activation_error_t;
+
+/* Reported through the stage callback as a session moves along */
+typedef enum {
+	ACTIVATION_STAGE_CONNECTING = 1,
+	ACTIVATION_STAGE_QUERYING,
+	ACTIVATION_STAGE_REQUESTING,
+	ACTIVATION_STAGE_ACTIVATING,
+	ACTIVATION_STAGE_ACTIVATING_STORED,
+	ACTIVATION_STAGE_DEACTIVATING,
+	ACTIVATION_STAGE_SKIPPED            /* reconcile found nothing to do */
+} activation_stage_t;
+
+/* What the session does with the cache directory, -c and -r on the command line */
+typedef enum {
+	ACTIVATION_CACHE_NONE = 0,
+	ACTIVATION_CACHE_WRITE,
+	ACTIVATION_CACHE_READ
+} activation_cache_mode_t;
+
+typedef struct {
+	const char* cache_dir;
+	activation_cache_mode_t cache_mode;
+
+	/* sent instead of what the device reports, when not NULL */
+	const char* imei;
+	const char* imsi;
+	const char* iccid;
+	const char* serial_number;
+
+	/* another thread may set *cancel to abandon the session between stages */
+	volatile int* cancel;
+
+	/* check ActivationState first and leave a device that is already
+	 * activated (or deactivated, when deactivating) alone */
+	int reconcile;
+} activation_options_t;
+
+typedef struct activation_session_private activation_session_private;
+typedef activation_session_private* activation_session_t;
+
+/* Any of these may be NULL. Messages without a callback go to the terminal.
+ * done is called once a run, a deactivation or an engine is through with
+ * the session, with the same result the call returns. */
+typedef struct {
+	void (*stage)(activation_session_t session, activation_stage_t stage, void* user_data);
+	void (*message)(activation_session_t session, int is_error, const char* message, void* user_data);
+	void (*record)(activation_session_t session, plist_t record, void* user_data);
+	void (*done)(activation_session_t session, activation_error_t result, void* user_data);
+} activation_callbacks_t;
+
+/* How activation requests are sent, process wide. Start from
+ * activation_http_defaults() and change what you need. */
+typedef struct {
+	const char* url;           /* the activation server */
+	long connect_timeout_ms;   /* per connection attempt */
+	long timeout_ms;           /* per request, every retry and backoff included */
+	int retries;               /* extra attempts after a transient failure */
+	long backoff_ms;           /* the first retry waits up to this, doubling from there */
+	long backoff_max_ms;
+	int hedge;                 /* send a second copy of a request still unanswered at the p95 latency */
+} activation_http_config_t;
+
+/* Process wide setup, call once before the first session is created */
+extern int activation_init();
+extern void activation_cleanup();
+extern int activation_keep_records(const char* dir);
+extern int activation_preload_records(const char* dir, int threads);
+extern void activation_http_defaults(activation_http_config_t* config);
+extern int activation_set_http(const activation_http_config_t* config);
+
+/* Keeps requests the server can't be reached for in dir, sends them once it
+ * can and activates their devices if they are still attached. Sessions
+ * that queue a request finish with ACTIVATION_E_QUEUED. activation_spool_wait()
+ * gives it up to timeout_ms to empty and returns how many are left. */
+extern int activation_spool(const char* dir);
+extern int activation_spool_wait(long timeout_ms);
+
+/* Answers GET /metrics on address (a port on 127.0.0.1, HOST:PORT or a Unix
+ * socket path) with counters and stage latencies in the Prometheus text
+ * format, until activation_cleanup(). Only sessions created after this
+ * are counted. */
+extern int activation_metrics_serve(const char* address);
+
+/* Simulated devices to use instead of whatever is plugged in, for loading
+ * the whole flow with more devices than there are on the bench. Latencies
+ * are means, each call takes anywhere from half to one and a half times as
+ * long. Start from activation_virtual_defaults(). */
+typedef struct {
+	int count;
+	const char* properties;       /* plist file of values every device reports on top of its own, may be NULL */
+	const char* activation_state; /* what every device starts out as */
+	long activation_info_size;    /* bytes of ActivationInfoXML */
+	long connect_ms;              /* reaching the device through usbmux */
+	long handshake_ms;            /* opening a lockdownd session */
+	long query_ms;                /* any other GetValue */
+	long activation_info_ms;      /* GetValue ActivationInfo, the device generates it */
+	long activate_ms;             /* activating or deactivating */
+} activation_virtual_config_t;
+
+extern void activation_virtual_defaults(activation_virtual_config_t* config);
+extern int activation_use_virtual_devices(const activation_virtual_config_t* config);
+
+/* lockdownd sessions outlive the activation sessions that opened them and
+ * are reused by the next one for the same UUID. Call this when a device is
+ * unplugged; activation_cleanup() drops the rest. */
+extern void activation_forget_device(const char* uuid);
+
+extern activation_error_t activation_session_new(activation_session_t* session, const char* uuid, const activation_options_t* options, const activation_callbacks_t* callbacks, void* user_data);
+extern void activation_session_free(activation_session_t session);
+extern const char* activation_session_get_uuid(activation_session_t session);
+
+extern activation_error_t activation_session_connect(activation_session_t session);
+extern activation_error_t activation_session_fetch_record(activation_session_t session, plist_t* record);
+extern activation_error_t activation_session_activate(activation_session_t session, plist_t record);
+extern activation_error_t activation_session_deactivate(activation_session_t session);
+extern activation_error_t activation_session_run(activation_session_t session);
+
+/* Runs every session on a single event loop for the network side plus
+ * device_threads threads for the device side, see engine.c */
+extern activation_error_t activation_engine_run(activation_session_t* sessions, int count, int device_threads, int deactivate);
+
+/* The stages of activation_pipeline_run(), in the order a session goes
+ * through them. Query and activate talk to the device, fetch waits on the
+ * server, build and parse only need the CPU. */
+typedef enum {
+	ACTIVATION_PIPE_QUERY = 0,
+	ACTIVATION_PIPE_BUILD,
+	ACTIVATION_PIPE_FETCH,
+	ACTIVATION_PIPE_PARSE,
+	ACTIVATION_PIPE_ACTIVATE,
+	ACTIVATION_PIPE_STAGES
+} activation_pipe_stage_t;
+
+/* Zero anywhere picks the default for that stage. queue_size bounds the
+ * queue in front of each stage; a full queue holds the stage before it. */
+typedef struct {
+	int workers[ACTIVATION_PIPE_STAGES];
+	int queue_size[ACTIVATION_PIPE_STAGES];
+	int deactivate;
+} activation_pipeline_config_t;
+
+/* How one stage fared, to size its pool by: a queue that is always deep in
+ * front of a busy stage wants more workers there. */
+typedef struct {
+	int workers;
+	int queue_size;
+	int peak_depth;
+	double mean_depth;     /* averaged over the whole run */
+	unsigned long processed;
+	double busy;           /* share of its workers' time spent working, 0 to 1 */
+} activation_pipe_stats_t;
+
+/* Runs every session through the stages above, each with its own worker pool
+ * and a bounded queue in front of it, see pipeline.c. stats may be NULL,
+ * otherwise it gets ACTIVATION_PIPE_STAGES entries. */
+extern activation_error_t activation_pipeline_run(activation_session_t* sessions, int count, const activation_pipeline_config_t* config, activation_pipe_stats_t* stats);
+extern const char* activation_pipe_stage_name(activation_pipe_stage_t stage);
+
+extern const char* activation_strerror(activation_error_t err);
+
+#endif
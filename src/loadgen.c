@@ -0,0 +1,363 @@
+/*
+ * loadgen.c
+ * Drives the request path at a stand-in server and reports what it can take.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <plist/plist.h>
+
+#include "libideviceactivate.h"
+#include "activate.h"
+#include "http.h"
+#include "props.h"
+#include "session.h"
+
+#define LOADGEN_URL "http://127.0.0.1:8080/deviceActivation"
+#define LOADGEN_REQUESTS 500        /* per concurrency level */
+#define LOADGEN_MAX_LEVELS 32
+
+static const int default_levels[] = { 1, 2, 4, 8, 16, 32 };
+
+/* One concurrency level: workers take request numbers from next until
+ * count is reached and put each one's latency in its place. */
+typedef struct {
+	int workers;
+	unsigned long count;
+	unsigned long next;
+	unsigned long failed;
+	double* latency_ms;
+	pthread_barrier_t start;
+} loadgen_level;
+
+typedef struct {
+	loadgen_level* level;
+	int id;
+} loadgen_worker;
+
+typedef struct {
+	int workers;
+	unsigned long requests;
+	unsigned long failed;
+	double seconds;
+	double p50, p95, p99, max;
+} loadgen_result;
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static plist_t new_blob(size_t length, uint32_t seed)
+{
+	char* data = malloc(length);
+	size_t i = 0;
+	for (i = 0; i < length; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (char)(seed >> 16);
+	}
+	plist_t node = plist_new_data(data, length);
+	free(data);
+	return node;
+}
+
+/* What props_get() would have found on a device. Each worker keeps one and
+ * takes a reference per request, the way the property cache hands them out. */
+static device_props* loadgen_props(const char* uuid)
+{
+	device_props* props = calloc(1, sizeof(device_props));
+	props->uuid = strdup(uuid);
+	props->device_class = strdup("iPhone");
+	props->imei = strdup("013000000000000");
+	props->imsi = strdup("310000000000000");
+	props->iccid = strdup("8900000000000000000");
+	props->serial_number = strdup("SERIAL");
+	props->activation_state = strdup("Unactivated");
+	props->activation_info = plist_new_dict();
+	plist_dict_set_item(props->activation_info, "ActivationInfoComplete", plist_new_bool(1));
+	plist_dict_set_item(props->activation_info, "ActivationInfoXML", new_blob(8192, 1));
+	plist_dict_set_item(props->activation_info, "FairPlayCertChain", new_blob(1200, 2));
+	props->refs = 1;
+	return props;
+}
+
+static void loadgen_quiet(activation_session_t session, int is_error, const char* message, void* user_data)
+{
+}
+
+/* Everything activate_fetch_record() does once the device has been queried:
+ * build the POST, send it (with whatever retries and hedging are set up)
+ * and parse the record out of the answer. */
+static int loadgen_request(activation_session_t session, device_props* props)
+{
+	plist_t record = NULL;
+
+	__sync_fetch_and_add(&props->refs, 1);
+	session->request.props = props;
+	if (activate_build(session) != 0) {
+		return -1;
+	}
+
+	CURLcode res = http_perform(session->http, &session->request.response, session->cancel);
+	int ret = activate_complete(session, res, &record);
+	if (record != NULL) {
+		plist_free(record);
+	}
+	return ret;
+}
+
+static void* loadgen_worker_main(void* arg)
+{
+	loadgen_worker* worker = (loadgen_worker*)arg;
+	loadgen_level* level = worker->level;
+	activation_callbacks_t callbacks = { NULL, loadgen_quiet, NULL, NULL };
+	activation_session_t session = NULL;
+	char uuid[41];
+
+	snprintf(uuid, sizeof(uuid), "%040d", worker->id + 1);
+	device_props* props = loadgen_props(uuid);
+	int ok = (activation_session_new(&session, uuid, NULL, &callbacks, NULL) == ACTIVATION_E_SUCCESS);
+
+	/* one untimed request first, so connection setup isn't in the numbers */
+	if (ok) {
+		session_enter(session);
+		loadgen_request(session, props);
+		session_leave(session);
+	}
+	pthread_barrier_wait(&level->start);
+
+	for (;;) {
+		unsigned long n = __sync_fetch_and_add(&level->next, 1);
+		if (n >= level->count) {
+			break;
+		}
+
+		double start = now_ms();
+		int ret = -1;
+		if (ok) {
+			session_enter(session);
+			ret = loadgen_request(session, props);
+			session_leave(session);
+		}
+		level->latency_ms[n] = now_ms() - start;
+		if (ret != 0) {
+			__sync_fetch_and_add(&level->failed, 1);
+		}
+	}
+
+	activation_session_free(session);
+	props_release(props);
+	return NULL;
+}
+
+static double percentile(const double* sorted, unsigned long count, double p)
+{
+	unsigned long i = (unsigned long)(p * count);
+	return sorted[(i < count) ? i : count - 1];
+}
+
+static int loadgen_run(int workers, unsigned long count, loadgen_result* result)
+{
+	loadgen_level level;
+	int i = 0;
+
+	memset(&level, 0, sizeof(level));
+	level.workers = workers;
+	level.count = count;
+	level.latency_ms = calloc(count, sizeof(double));
+	pthread_t* threads = calloc(workers, sizeof(pthread_t));
+	loadgen_worker* args = calloc(workers, sizeof(loadgen_worker));
+	if (level.latency_ms == NULL || threads == NULL || args == NULL) {
+		free(level.latency_ms);
+		free(threads);
+		free(args);
+		return -1;
+	}
+	pthread_barrier_init(&level.start, NULL, workers + 1);
+
+	for (i = 0; i < workers; i++) {
+		args[i].level = &level;
+		args[i].id = i;
+		if (pthread_create(&threads[i], NULL, loadgen_worker_main, &args[i]) != 0) {
+			fprintf(stderr, "Unable to start worker thread\n");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&level.start);
+	double start = now_ms();
+	for (i = 0; i < workers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double elapsed = now_ms() - start;
+
+	qsort(level.latency_ms, count, sizeof(double), compare_double);
+	result->workers = workers;
+	result->requests = count;
+	result->failed = level.failed;
+	result->seconds = elapsed / 1000.0;
+	result->p50 = percentile(level.latency_ms, count, 0.50);
+	result->p95 = percentile(level.latency_ms, count, 0.95);
+	result->p99 = percentile(level.latency_ms, count, 0.99);
+	result->max = level.latency_ms[count - 1];
+
+	pthread_barrier_destroy(&level.start);
+	free(level.latency_ms);
+	free(threads);
+	free(args);
+	return 0;
+}
+
+static int parse_levels(char* spec, int* levels)
+{
+	char* save = NULL;
+	char* item = NULL;
+	int count = 0;
+
+	for (item = strtok_r(spec, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (count == LOADGEN_MAX_LEVELS || atoi(item) <= 0) {
+			return -1;
+		}
+		levels[count++] = atoi(item);
+	}
+	return count;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [OPTIONS]\n", name);
+	printf("Sends activation requests to a stand-in server (see ideviceactivate-standin) at\n");
+	printf("each concurrency level in turn and reports throughput and latency as JSON lines.\n\n");
+	printf("  -E URL\t\twhere to send them (default: %s)\n", LOADGEN_URL);
+	printf("  -c LEVELS\tconcurrency levels, e.g. 1,4,16 (default: 1,2,4,8,16,32)\n");
+	printf("  -n COUNT\trequests per level (default: %d)\n", LOADGEN_REQUESTS);
+	printf("  -T MS[,MS]\tconnect timeout, and total timeout per request including retries\n");
+	printf("  -R N\t\tretry a request that failed for a transient reason up to N times\n");
+	printf("  -H\t\thedge requests still unanswered at the p95 latency\n");
+	printf("  -h\t\tprints usage information\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int levels[LOADGEN_MAX_LEVELS];
+	int level_count = 0;
+	unsigned long count = LOADGEN_REQUESTS;
+	loadgen_result results[LOADGEN_MAX_LEVELS];
+	int opt = 0;
+	int i = 0;
+
+	activation_http_config_t http;
+	activation_http_defaults(&http);
+	http.url = LOADGEN_URL;
+
+	while ((opt = getopt(argc, argv, "hHE:c:n:T:R:")) > 0) {
+		switch (opt) {
+		case 'E':
+			http.url = optarg;
+			break;
+
+		case 'c':
+			level_count = parse_levels(optarg, levels);
+			if (level_count <= 0) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'T':
+			http.connect_timeout_ms = atol(optarg);
+			if (strchr(optarg, ',') != NULL) {
+				http.timeout_ms = atol(strchr(optarg, ',') + 1);
+			}
+			break;
+
+		case 'R':
+			http.retries = atoi(optarg);
+			break;
+
+		case 'H':
+			http.hedge = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : -1;
+		}
+	}
+
+	if (count == 0) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (level_count == 0) {
+		level_count = sizeof(default_levels) / sizeof(default_levels[0]);
+		memcpy(levels, default_levels, sizeof(default_levels));
+	}
+
+	if (activation_init() != 0) {
+		return -1;
+	}
+	if (activation_set_http(&http) != 0) {
+		activation_cleanup();
+		return -1;
+	}
+
+	for (i = 0; i < level_count; i++) {
+		loadgen_result* r = &results[i];
+		if (loadgen_run(levels[i], count, r) != 0) {
+			fprintf(stderr, "Unable to allocate sufficent memory\n");
+			activation_cleanup();
+			return -1;
+		}
+		printf("{\"loadgen\":\"level\",\"concurrency\":%d,\"requests\":%lu,\"failed\":%lu,\"seconds\":%.3f,\"per_s\":%.1f,\"p50_ms\":%.2f,\"p95_ms\":%.2f,\"p99_ms\":%.2f,\"max_ms\":%.2f}\n",
+			r->workers, r->requests, r->failed, r->seconds, r->requests / r->seconds, r->p50, r->p95, r->p99, r->max);
+		fflush(stdout);
+	}
+
+	/* the same numbers, for reading rather than for a script */
+	fprintf(stderr, "\n  %11s %8s %7s %9s %9s %9s %9s\n", "concurrency", "req/s", "failed", "p50 ms", "p95 ms", "p99 ms", "max ms");
+	for (i = 0; i < level_count; i++) {
+		loadgen_result* r = &results[i];
+		fprintf(stderr, "  %11d %8.1f %7lu %9.2f %9.2f %9.2f %9.2f\n",
+			r->workers, r->requests / r->seconds, r->failed, r->p50, r->p95, r->p99, r->max);
+	}
+	http_print_stats(stderr);
+
+	activation_cleanup();
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * lockdown.c
+ * The device transport for real devices: usbmux and lockdownd, through
+ * libimobiledevice.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <plist/plist.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+#include "transport.h"
+
+struct device_link {
+	idevice_t device;
+	lockdownd_client_t client;
+};
+
+static device_event_cb lockdown_callback = NULL;
+
+static int lockdown_list(char*** uuids, int* count)
+{
+	return (idevice_get_device_list(uuids, count) == IDEVICE_E_SUCCESS) ? 0 : -1;
+}
+
+static void lockdown_list_free(char** uuids)
+{
+	idevice_device_list_free(uuids);
+}
+
+static void lockdown_event(const idevice_event_t* event, void* user_data)
+{
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		lockdown_callback(DEVICE_ADDED, event->uuid, user_data);
+	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+		lockdown_callback(DEVICE_REMOVED, event->uuid, user_data);
+	}
+}
+
+static int lockdown_subscribe(device_event_cb callback, void* user_data)
+{
+	lockdown_callback = callback;
+	return (idevice_event_subscribe(lockdown_event, user_data) == IDEVICE_E_SUCCESS) ? 0 : -1;
+}
+
+static void lockdown_unsubscribe()
+{
+	idevice_event_unsubscribe();
+}
+
+static int lockdown_connect(const char* uuid, device_link** link)
+{
+	*link = calloc(1, sizeof(device_link));
+	if (*link == NULL) {
+		return -1;
+	}
+
+	idevice_error_t err = idevice_new(&(*link)->device, uuid);
+	if (err != IDEVICE_E_SUCCESS) {
+		free(*link);
+		*link = NULL;
+	}
+	return err;
+}
+
+static int lockdown_handshake(device_link* link)
+{
+	return lockdownd_client_new_with_handshake(link->device, &link->client, "ideviceactivate");
+}
+
+static void lockdown_disconnect(device_link* link)
+{
+	if (link->client != NULL) {
+		lockdownd_client_free(link->client);
+	}
+	if (link->device != NULL) {
+		idevice_free(link->device);
+	}
+	free(link);
+}
+
+static char* lockdown_get_uuid(device_link* link)
+{
+	char* uuid = NULL;
+	idevice_get_uuid(link->device, &uuid);
+	return uuid;
+}
+
+static int lockdown_check(device_link* link)
+{
+	char* type = NULL;
+	lockdownd_error_t err = lockdownd_query_type(link->client, &type);
+	free(type);
+	return err;
+}
+
+static int lockdown_get_value(device_link* link, const char* key, plist_t* value)
+{
+	*value = NULL;
+	return lockdownd_get_value(link->client, NULL, key, value);
+}
+
+static int lockdown_activate(device_link* link, plist_t record)
+{
+	return lockdownd_activate(link->client, record);
+}
+
+static int lockdown_deactivate(device_link* link)
+{
+	return lockdownd_deactivate(link->client);
+}
+
+const device_transport lockdown_transport = {
+	"lockdownd",
+	lockdown_list,
+	lockdown_list_free,
+	lockdown_subscribe,
+	lockdown_unsubscribe,
+	lockdown_connect,
+	lockdown_handshake,
+	lockdown_disconnect,
+	lockdown_get_uuid,
+	lockdown_check,
+	lockdown_get_value,
+	lockdown_activate,
+	lockdown_deactivate,
+};
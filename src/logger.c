@@ -0,0 +1,382 @@
+/*
+ * logger.c
+ * Gets messages out of the way of the threads that produce them.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "logger.h"
+#include "trace.h"
+
+/* A message waiting to be written. seq says whose turn the slot is: equal to
+ * its position in the ring when a producer may fill it, one more once it is
+ * filled and the writer thread may take it. */
+typedef struct {
+	size_t seq;
+	int level;
+	const char* prefix;
+	struct timespec ts;
+	char* heap;              /* the message, when it didn't fit in text */
+	char uuid[41];
+	char text[LOGGER_LINE];
+} logger_slot;
+
+int logger_level = LOGGER_INFO;
+
+static logger_slot* logger_slots = NULL;
+static size_t logger_tail = 0;          /* next position a producer claims */
+static size_t logger_head = 0;          /* next position written, writer thread only */
+static unsigned long logger_written = 0;
+static unsigned long logger_dropped = 0;
+
+static int logger_running = 0;
+static int logger_sleeping = 0;
+static sem_t logger_wake;
+static pthread_t logger_thread;
+
+static FILE* logger_file = NULL;        /* NULL writes plain text to the terminal */
+
+static const char* logger_level_names[] = { "error", "info", "debug" };
+
+/* The same lines the tool has always printed: errors on stderr, the rest on stdout */
+static void logger_print_text(int level, const char* prefix, const char* m)
+{
+	FILE* out = (level == LOGGER_ERROR) ? stderr : stdout;
+	fputs(prefix, out);
+	fputs(m, out);
+	fputc('\n', out);
+}
+
+static void logger_print_string(FILE* out, const char* s)
+{
+	fputc('"', out);
+	for (; *s != '\0'; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			fputc('\\', out);
+			fputc(c, out);
+		} else if (c == '\n') {
+			fputs("\\n", out);
+		} else if (c == '\t') {
+			fputs("\\t", out);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void logger_print_json(const logger_slot* slot, const char* m)
+{
+	fprintf(logger_file, "{\"ts\":%ld.%06ld,\"level\":\"%s\"", (long)slot->ts.tv_sec, slot->ts.tv_nsec / 1000, logger_level_names[slot->level]);
+	if (slot->uuid[0] != '\0') {
+		fputs(",\"udid\":", logger_file);
+		logger_print_string(logger_file, slot->uuid);
+	}
+	fputs(",\"msg\":", logger_file);
+	logger_print_string(logger_file, m);
+	fputs("}\n", logger_file);
+}
+
+/* Writes out everything that is ready, returns how many messages that was */
+static int logger_drain()
+{
+	int count = 0;
+
+	unsigned long dropped = __atomic_exchange_n(&logger_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		char m[96];
+		snprintf(m, sizeof(m), "%lu message(s) dropped, the log couldn't keep up", dropped);
+		logger_slot note;
+		memset(&note, 0, sizeof(note));
+		note.level = LOGGER_ERROR;
+		note.prefix = "";
+		clock_gettime(CLOCK_REALTIME, &note.ts);
+		if (logger_file != NULL) {
+			logger_print_json(&note, m);
+		} else {
+			logger_print_text(LOGGER_ERROR, "", m);
+		}
+	}
+
+	for (;;) {
+		logger_slot* slot = &logger_slots[logger_head & (LOGGER_SLOTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger_head + 1) {
+			break;
+		}
+
+		const char* m = (slot->heap != NULL) ? slot->heap : slot->text;
+		if (logger_file != NULL) {
+			logger_print_json(slot, m);
+		} else {
+			logger_print_text(slot->level, slot->prefix, m);
+		}
+		free(slot->heap);
+		slot->heap = NULL;
+
+		/* hand the slot back for the producer one lap ahead */
+		__atomic_store_n(&slot->seq, logger_head + LOGGER_SLOTS, __ATOMIC_RELEASE);
+		logger_head++;
+		count++;
+	}
+
+	if (count > 0) {
+		if (logger_file != NULL) {
+			fflush(logger_file);
+		} else {
+			fflush(stdout);
+			fflush(stderr);
+		}
+		__atomic_add_fetch(&logger_written, count, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+static int logger_pending()
+{
+	logger_slot* slot = &logger_slots[logger_head & (LOGGER_SLOTS - 1)];
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == logger_head + 1;
+}
+
+/* Sleeps whenever the ring is empty. Producers only post the semaphore when
+ * they find it asleep, and it wakes up on its own now and then regardless,
+ * so a wakeup lost to a race costs a little latency and nothing else. */
+static void* logger_main(void* arg)
+{
+	for (;;) {
+		if (logger_drain() > 0) {
+			continue;
+		}
+		if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		__atomic_store_n(&logger_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!logger_pending() && __atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += 100000000;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			sem_timedwait(&logger_wake, &until);
+		}
+		__atomic_store_n(&logger_sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	logger_drain();
+	return NULL;
+}
+
+static void logger_kick()
+{
+	int sleeping = 1;
+	if (__atomic_compare_exchange_n(&logger_sleeping, &sleeping, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		sem_post(&logger_wake);
+	}
+}
+
+int logger_open(const char* path, int level)
+{
+	sigset_t all;
+	sigset_t old;
+	size_t i = 0;
+
+	logger_level = level;
+
+	if (path != NULL) {
+		logger_file = fopen(path, "a");
+		if (logger_file == NULL) {
+			fprintf(stderr, "Unable to open the log file %s\n", path);
+			return -1;
+		}
+		setvbuf(logger_file, NULL, _IOFBF, 0x10000);
+	}
+
+	logger_slots = calloc(LOGGER_SLOTS, sizeof(logger_slot));
+	if (logger_slots == NULL || sem_init(&logger_wake, 0, 0) != 0) {
+		free(logger_slots);
+		logger_slots = NULL;
+		if (logger_file != NULL) {
+			fclose(logger_file);
+			logger_file = NULL;
+		}
+		return -1;
+	}
+	for (i = 0; i < LOGGER_SLOTS; i++) {
+		logger_slots[i].seq = i;
+	}
+
+	/* signals are for the threads that wait on them (-w uses sigwait()),
+	 * never for this one */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	logger_running = 1;
+	int res = pthread_create(&logger_thread, NULL, logger_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (res != 0) {
+		logger_running = 0;
+		sem_destroy(&logger_wake);
+		free(logger_slots);
+		logger_slots = NULL;
+		if (logger_file != NULL) {
+			fclose(logger_file);
+			logger_file = NULL;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+void logger_close()
+{
+	if (!logger_running) {
+		return;
+	}
+
+	__atomic_store_n(&logger_running, 0, __ATOMIC_RELEASE);
+	sem_post(&logger_wake);
+	pthread_join(logger_thread, NULL);
+
+	sem_destroy(&logger_wake);
+	free(logger_slots);
+	logger_slots = NULL;
+	if (logger_file != NULL) {
+		fclose(logger_file);
+		logger_file = NULL;
+	}
+}
+
+void logger_flush()
+{
+	if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+		fflush(stdout);
+		return;
+	}
+
+	unsigned long target = __atomic_load_n(&logger_tail, __ATOMIC_ACQUIRE);
+	while (__atomic_load_n(&logger_written, __ATOMIC_ACQUIRE) < target) {
+		struct timespec pause = { 0, 1000000 };
+		logger_kick();
+		nanosleep(&pause, NULL);
+	}
+}
+
+/* Claims a slot without ever waiting for one: a full ring means the writer
+ * is stuck behind a slow terminal or disk, and the message is dropped (and
+ * counted) rather than holding up whoever logged it. Takes heap either way. */
+static void logger_push(int level, const char* prefix, const char* m, char* heap)
+{
+	size_t pos = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+	logger_slot* slot = NULL;
+
+	for (;;) {
+		slot = &logger_slots[pos & (LOGGER_SLOTS - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&logger_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			free(heap);
+			__atomic_add_fetch(&logger_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->level = level;
+	slot->prefix = prefix;
+	clock_gettime(CLOCK_REALTIME, &slot->ts);
+	strncpy(slot->uuid, trace_get_uuid(), sizeof(slot->uuid) - 1);
+	slot->uuid[sizeof(slot->uuid) - 1] = '\0';
+
+	slot->heap = heap;
+	if (heap == NULL) {
+		size_t len = strlen(m);
+		if (len < sizeof(slot->text)) {
+			memcpy(slot->text, m, len + 1);
+		} else if ((slot->heap = strdup(m)) == NULL) {
+			/* better cut short than not there at all */
+			memcpy(slot->text, m, sizeof(slot->text) - 1);
+			slot->text[sizeof(slot->text) - 1] = '\0';
+		}
+	}
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	logger_kick();
+}
+
+void logger_write(int level, const char* prefix, const char* m)
+{
+	if (!LOGGER_ENABLED(level)) {
+		return;
+	}
+
+	/* nobody called logger_open(), e.g. a program using the library */
+	if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+		logger_print_text(level, prefix, m);
+		return;
+	}
+
+	logger_push(level, prefix, m, NULL);
+}
+
+void logger_payload(const char* what, const char* data, size_t length)
+{
+	if (!LOGGER_ENABLED(LOGGER_DEBUG)) {
+		return;
+	}
+
+	if (data == NULL) {
+		length = 0;
+	}
+
+	size_t what_len = strlen(what);
+	char* m = malloc(what_len + length + 4);
+	if (m == NULL) {
+		return;
+	}
+	memcpy(m, what, what_len);
+	memcpy(m + what_len, ":\n\n", 3);
+	if (length > 0) {
+		memcpy(m + what_len + 3, data, length);
+	}
+	m[what_len + 3 + length] = '\0';
+
+	if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+		logger_print_text(LOGGER_DEBUG, "", m);
+		free(m);
+		return;
+	}
+
+	logger_push(LOGGER_DEBUG, "", NULL, m);
+}
@@ -0,0 +1,58 @@
+/*
+ * logger.h
+ * Gets messages out of the way of the threads that produce them.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+
+#define LOGGER_ERROR 0
+#define LOGGER_INFO  1
+#define LOGGER_DEBUG 2
+
+/* power of two; once this many messages are waiting, new ones are dropped */
+#define LOGGER_SLOTS 1024
+/* longer messages are copied to the heap instead of into the slot */
+#define LOGGER_LINE  240
+
+/* Anything above this level is thrown away before it is even formatted.
+ * Set by logger_open(), LOGGER_INFO until then. */
+extern int logger_level;
+
+#define LOGGER_ENABLED(level) ((level) <= logger_level)
+
+/* Starts the thread that writes messages out. path NULL keeps them on the
+ * terminal as plain text, anything else gets one JSON object per line.
+ * Must be called before any other thread is started. */
+extern int logger_open(const char* path, int level);
+extern void logger_close();
+
+/* Waits until everything logged so far has been written. */
+extern void logger_flush();
+
+/* prefix only shows on the terminal, e.g. "INFO: " */
+extern void logger_write(int level, const char* prefix, const char* m);
+
+/* A whole payload (a request, a reply, a record) under a heading, logged at
+ * LOGGER_DEBUG. Callers check LOGGER_ENABLED() first to skip building it. */
+extern void logger_payload(const char* what, const char* data, size_t length);
+
+#endif
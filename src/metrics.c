@@ -0,0 +1,552 @@
+/*
+ * metrics.c
+ * Counters and latency histograms, served in the Prometheus text format.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "http.h"
+#include "idevice.h"
+#include "metrics.h"
+#include "spool.h"
+#include "util.h"
+
+#define METRICS_RESULTS 12      /* -ACTIVATION_E_* up to QUEUED, then anything else */
+#define METRICS_BUCKETS 16      /* the bounds below and +Inf */
+#define METRICS_REQUEST_MAX 4096
+#define METRICS_TIMEOUT 2       /* seconds a scraper gets to send its request and take the answer */
+
+int metrics_enabled = 0;
+
+static const uint64_t metrics_bounds[METRICS_BUCKETS - 1] = {
+	1000000ULL, 2500000ULL, 5000000ULL, 10000000ULL, 25000000ULL, 50000000ULL,
+	100000000ULL, 250000000ULL, 500000000ULL, 1000000000ULL, 2500000000ULL,
+	5000000000ULL, 10000000000ULL, 30000000000ULL, 60000000000ULL
+};
+
+static const char* metrics_bound_labels[METRICS_BUCKETS] = {
+	"0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5",
+	"1", "2.5", "5", "10", "30", "60", "+Inf"
+};
+
+static const char* metrics_stage_names[METRICS_STAGES] = {
+	"usbmux_connect", "lockdownd_handshake", "lockdownd_query", "http_fetch", "lockdownd_activate"
+};
+
+static const char* metrics_queue_names[METRICS_QUEUES] = {
+	"pipeline_query", "pipeline_build", "pipeline_fetch", "pipeline_parse", "pipeline_activate",
+	"engine_device", "engine_network"
+};
+
+/* indexed by -err, so [0] (success) and [10] (queued) have series of their own */
+static const char* metrics_reasons[METRICS_RESULTS] = {
+	NULL, "invalid_arg", "no_memory", "no_device", "cache_failed", "cache_mismatch",
+	"fetch_failed", "activate_failed", "deactivate_failed", "cancelled", NULL, "other"
+};
+
+/* One thread's counts. Only the owning thread writes to it, with plain
+ * relaxed stores, so counting is a load and a store on a line nobody else
+ * writes; a scrape reads every shard and adds them up. A thread that exits
+ * hands its shard (counts and all) to the next thread that needs one. */
+typedef struct metrics_shard {
+	unsigned long counters[METRICS_COUNTERS];
+	unsigned long results[METRICS_RESULTS];
+	unsigned long buckets[METRICS_STAGES][METRICS_BUCKETS];
+	uint64_t sums[METRICS_STAGES];
+	long queues[METRICS_QUEUES];
+	int owned;
+	struct metrics_shard* next;
+} __attribute__((aligned(64))) metrics_shard;
+
+static metrics_shard* metrics_shards = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static __thread metrics_shard* metrics_mine = NULL;
+
+static int metrics_fd = -1;
+static int metrics_wake[2] = { -1, -1 };
+static char* metrics_path = NULL;
+static pthread_t metrics_thread;
+
+#define METRICS_ADD(field, n) __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define METRICS_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void metrics_shard_release(void* arg)
+{
+	metrics_shard* shard = (metrics_shard*)arg;
+	pthread_mutex_lock(&metrics_lock);
+	shard->owned = 0;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static void metrics_key_init()
+{
+	pthread_key_create(&metrics_key, metrics_shard_release);
+}
+
+/* The calling thread's shard, NULL if there's no memory for one */
+static metrics_shard* metrics_shard_get()
+{
+	metrics_shard* shard = metrics_mine;
+	if (shard != NULL) {
+		return shard;
+	}
+
+	pthread_once(&metrics_once, metrics_key_init);
+	pthread_mutex_lock(&metrics_lock);
+	for (shard = metrics_shards; shard != NULL && shard->owned; shard = shard->next);
+	if (shard == NULL) {
+		void* memory = NULL;
+		if (posix_memalign(&memory, 64, sizeof(metrics_shard)) != 0) {
+			pthread_mutex_unlock(&metrics_lock);
+			return NULL;
+		}
+		shard = (metrics_shard*)memory;
+		memset(shard, 0, sizeof(metrics_shard));
+		shard->next = metrics_shards;
+		metrics_shards = shard;
+	}
+	shard->owned = 1;
+	pthread_mutex_unlock(&metrics_lock);
+
+	pthread_setspecific(metrics_key, shard);
+	metrics_mine = shard;
+	return shard;
+}
+
+void metrics_count(metrics_counter counter)
+{
+	metrics_shard* shard = metrics_shard_get();
+	if (shard != NULL) {
+		METRICS_ADD(shard->counters[counter], 1);
+	}
+}
+
+/* How a session that got as far as session_done() ended */
+void metrics_result(activation_error_t err)
+{
+	metrics_shard* shard = metrics_shard_get();
+	if (shard != NULL) {
+		int index = (err <= 0 && -err < METRICS_RESULTS - 1) ? -err : METRICS_RESULTS - 1;
+		METRICS_ADD(shard->results[index], 1);
+	}
+}
+
+/* elapsed is in trace_now() units, nanoseconds */
+void metrics_observe(metrics_stage stage, uint64_t elapsed)
+{
+	metrics_shard* shard = metrics_shard_get();
+	if (shard == NULL) {
+		return;
+	}
+
+	int bucket = 0;
+	while (bucket < METRICS_BUCKETS - 1 && elapsed > metrics_bounds[bucket]) {
+		bucket++;
+	}
+	METRICS_ADD(shard->buckets[stage][bucket], 1);
+	METRICS_ADD(shard->sums[stage], elapsed);
+}
+
+/* Items are often added on one thread and taken off on another, so a single
+ * shard's depth can go negative; only the sum means anything. */
+void metrics_queue(metrics_queue_t queue, int delta)
+{
+	metrics_shard* shard = metrics_shard_get();
+	if (shard != NULL) {
+		METRICS_ADD(shard->queues[queue], delta);
+	}
+}
+
+static void metrics_printf(buffer_t* out, const char* format, ...)
+{
+	char line[256];
+	va_list args;
+
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length > 0) {
+		buffer_append(out, line, (length < (int)sizeof(line)) ? (size_t)length : sizeof(line) - 1);
+	}
+}
+
+static void metrics_header(buffer_t* out, const char* name, const char* type, const char* help)
+{
+	metrics_printf(out, "# HELP ideviceactivate_%s %s\n# TYPE ideviceactivate_%s %s\n", name, help, name, type);
+}
+
+/* Adds up every shard and writes the lot out, Prometheus text format 0.0.4 */
+int metrics_format(buffer_t* out)
+{
+	unsigned long counters[METRICS_COUNTERS];
+	unsigned long results[METRICS_RESULTS];
+	unsigned long buckets[METRICS_STAGES][METRICS_BUCKETS];
+	uint64_t sums[METRICS_STAGES];
+	long queues[METRICS_QUEUES];
+	metrics_shard* shard = NULL;
+	int i = 0, j = 0;
+
+	memset(counters, 0, sizeof(counters));
+	memset(results, 0, sizeof(results));
+	memset(buckets, 0, sizeof(buckets));
+	memset(sums, 0, sizeof(sums));
+	memset(queues, 0, sizeof(queues));
+
+	pthread_mutex_lock(&metrics_lock);
+	for (shard = metrics_shards; shard != NULL; shard = shard->next) {
+		for (i = 0; i < METRICS_COUNTERS; i++) {
+			counters[i] += METRICS_READ(shard->counters[i]);
+		}
+		for (i = 0; i < METRICS_RESULTS; i++) {
+			results[i] += METRICS_READ(shard->results[i]);
+		}
+		for (i = 0; i < METRICS_STAGES; i++) {
+			for (j = 0; j < METRICS_BUCKETS; j++) {
+				buckets[i][j] += METRICS_READ(shard->buckets[i][j]);
+			}
+			sums[i] += METRICS_READ(shard->sums[i]);
+		}
+		for (i = 0; i < METRICS_QUEUES; i++) {
+			queues[i] += METRICS_READ(shard->queues[i]);
+		}
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	unsigned long finished = 0;
+	for (i = 0; i < METRICS_RESULTS; i++) {
+		finished += results[i];
+	}
+
+	metrics_header(out, "activations_started_total", "counter", "Activations and deactivations started.");
+	metrics_printf(out, "ideviceactivate_activations_started_total %lu\n", counters[METRICS_STARTED]);
+	metrics_header(out, "activations_succeeded_total", "counter", "Activations and deactivations that succeeded, skipped ones included.");
+	metrics_printf(out, "ideviceactivate_activations_succeeded_total %lu\n", results[0]);
+	metrics_header(out, "activations_queued_total", "counter", "Activations left in the spool for when the server can be reached.");
+	metrics_printf(out, "ideviceactivate_activations_queued_total %lu\n", results[-ACTIVATION_E_QUEUED]);
+	metrics_header(out, "activations_failed_total", "counter", "Activations and deactivations that failed, by reason.");
+	for (i = 1; i < METRICS_RESULTS; i++) {
+		if (metrics_reasons[i] != NULL) {
+			metrics_printf(out, "ideviceactivate_activations_failed_total{reason=\"%s\"} %lu\n", metrics_reasons[i], results[i]);
+		}
+	}
+	/* a session can finish without having started, when it never got to run */
+	metrics_header(out, "activations_in_flight", "gauge", "Activations started and not finished yet.");
+	metrics_printf(out, "ideviceactivate_activations_in_flight %ld\n",
+		(counters[METRICS_STARTED] > finished) ? (long)(counters[METRICS_STARTED] - finished) : 0L);
+
+	metrics_header(out, "stage_duration_seconds", "histogram", "Time spent in each device and server round trip.");
+	for (i = 0; i < METRICS_STAGES; i++) {
+		unsigned long cumulative = 0;
+		for (j = 0; j < METRICS_BUCKETS; j++) {
+			cumulative += buckets[i][j];
+			metrics_printf(out, "ideviceactivate_stage_duration_seconds_bucket{stage=\"%s\",le=\"%s\"} %lu\n",
+				metrics_stage_names[i], metrics_bound_labels[j], cumulative);
+		}
+		metrics_printf(out, "ideviceactivate_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", metrics_stage_names[i], sums[i] / 1e9);
+		metrics_printf(out, "ideviceactivate_stage_duration_seconds_count{stage=\"%s\"} %lu\n", metrics_stage_names[i], cumulative);
+	}
+
+	metrics_header(out, "queue_depth", "gauge", "Sessions waiting in front of each stage, and requests in the spool.");
+	for (i = 0; i < METRICS_QUEUES; i++) {
+		metrics_printf(out, "ideviceactivate_queue_depth{queue=\"%s\"} %ld\n", metrics_queue_names[i], (queues[i] > 0) ? queues[i] : 0L);
+	}
+	if (spool_enabled()) {
+		metrics_printf(out, "ideviceactivate_queue_depth{queue=\"spool\"} %d\n", spool_depth());
+	}
+
+	unsigned long requests = 0, reused = 0;
+	http_stats(&requests, &reused);
+	metrics_header(out, "http_requests_total", "counter", "Requests sent to the activation server, each retry and hedge counted.");
+	metrics_printf(out, "ideviceactivate_http_requests_total %lu\n", requests);
+	metrics_header(out, "http_requests_reused_total", "counter", "Requests that went out on an already open connection.");
+	metrics_printf(out, "ideviceactivate_http_requests_reused_total %lu\n", reused);
+
+	unsigned long handshakes = 0;
+	device_pool_stats(&handshakes, &reused);
+	metrics_header(out, "lockdownd_connections_total", "counter", "lockdownd sessions opened or taken from the pool.");
+	metrics_printf(out, "ideviceactivate_lockdownd_connections_total %lu\n", handshakes + reused);
+	metrics_header(out, "lockdownd_connections_reused_total", "counter", "lockdownd sessions taken from the pool.");
+	metrics_printf(out, "ideviceactivate_lockdownd_connections_reused_total %lu\n", reused);
+
+	metrics_header(out, "cache_lookups_total", "counter", "Lookups in the property snapshot cache and the record store.");
+	metrics_printf(out, "ideviceactivate_cache_lookups_total{cache=\"props\",result=\"hit\"} %lu\n", counters[METRICS_PROPS_HIT]);
+	metrics_printf(out, "ideviceactivate_cache_lookups_total{cache=\"props\",result=\"miss\"} %lu\n", counters[METRICS_PROPS_MISS]);
+	metrics_printf(out, "ideviceactivate_cache_lookups_total{cache=\"records\",result=\"hit\"} %lu\n", counters[METRICS_RECORDS_HIT]);
+	metrics_printf(out, "ideviceactivate_cache_lookups_total{cache=\"records\",result=\"miss\"} %lu\n", counters[METRICS_RECORDS_MISS]);
+
+	return (out->data != NULL) ? 0 : -1;
+}
+
+static int metrics_send(int fd, const char* data, size_t length)
+{
+	while (length > 0) {
+		ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+/* One request per connection: GET /metrics gets the lot, anything else a 404 */
+static void metrics_answer(int fd)
+{
+	char request[METRICS_REQUEST_MAX];
+	size_t length = 0;
+	char header[160];
+	buffer_t body;
+
+	struct timeval timeout = { METRICS_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	while (length < sizeof(request) - 1) {
+		ssize_t got = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			break;
+		}
+		length += got;
+		request[length] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+			break;
+		}
+	}
+	request[length] = '\0';
+
+	if (strncmp(request, "GET /metrics", 12) != 0 || (request[12] != ' ' && request[12] != '?')) {
+		const char* missing = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+		metrics_send(fd, missing, strlen(missing));
+		return;
+	}
+
+	if (buffer_init(&body, 0x2000) != 0) {
+		return;
+	}
+	if (metrics_format(&body) == 0) {
+		snprintf(header, sizeof(header),
+			"HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+			(unsigned long)body.length);
+		if (metrics_send(fd, header, strlen(header)) == 0) {
+			metrics_send(fd, body.data, body.length);
+		}
+	}
+	buffer_free(&body);
+}
+
+/* Scrapes are answered one at a time, they're rare and quick */
+static void* metrics_main(void* arg)
+{
+	struct pollfd fds[2];
+
+	fds[0].fd = metrics_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = metrics_wake[0];
+	fds[1].events = POLLIN;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents != 0) {
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(metrics_fd, NULL, NULL);
+			if (fd >= 0) {
+				metrics_answer(fd);
+				close(fd);
+			}
+		}
+	}
+	return NULL;
+}
+
+/* A path (anything with a '/' in it) is a Unix socket, otherwise PORT or
+ * HOST:PORT, on 127.0.0.1 when there's no host. */
+static int metrics_listen(const char* address)
+{
+	int fd = -1;
+
+	if (strchr(address, '/') != NULL) {
+		struct sockaddr_un addr;
+		if (strlen(address) >= sizeof(addr.sun_path)) {
+			error("The metrics socket path is too long");
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, address);
+
+		/* one left behind by a run that didn't get to clean up */
+		struct stat st;
+		if (lstat(address, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(address);
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			return -1;
+		}
+		metrics_path = strdup(address);
+		return fd;
+	}
+
+	char host[256];
+	const char* port = strrchr(address, ':');
+	if (port != NULL) {
+		size_t length = port - address;
+		if (length >= sizeof(host)) {
+			return -1;
+		}
+		/* [::1]:9100 */
+		if (length >= 2 && address[0] == '[' && address[length - 1] == ']') {
+			address++;
+			length -= 2;
+		}
+		memcpy(host, address, length);
+		host[length] = '\0';
+		port++;
+	} else {
+		strcpy(host, "127.0.0.1");
+		port = address;
+	}
+
+	char* end = NULL;
+	long number = strtol(port, &end, 10);
+	if (end == port || *end != '\0' || number < 1 || number > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct addrinfo hints;
+	struct addrinfo* found = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &found) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct addrinfo* ai = NULL;
+	for (ai = found; ai != NULL; ai = ai->ai_next) {
+		int one = 1;
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(found);
+	return fd;
+}
+
+/* Starts counting and answers scrapes on address until metrics_close().
+ * Counting starts here, so call it before any session is. */
+int metrics_serve(const char* address)
+{
+	char m[300];
+
+	if (metrics_fd >= 0) {
+		error("Metrics are already being served");
+		return -1;
+	}
+
+	metrics_fd = metrics_listen(address);
+	if (metrics_fd < 0) {
+		snprintf(m, sizeof(m), "Unable to serve metrics on %s: %s", address, strerror(errno));
+		error(m);
+		return -1;
+	}
+
+	if (pipe(metrics_wake) != 0 || pthread_create(&metrics_thread, NULL, metrics_main, NULL) != 0) {
+		error("Unable to start the metrics thread");
+		if (metrics_wake[0] >= 0) {
+			close(metrics_wake[0]);
+			close(metrics_wake[1]);
+			metrics_wake[0] = metrics_wake[1] = -1;
+		}
+		close(metrics_fd);
+		metrics_fd = -1;
+		free(metrics_path);
+		metrics_path = NULL;
+		return -1;
+	}
+
+	metrics_enabled = 1;
+	return 0;
+}
+
+/* Stops answering scrapes. The counts stay where they are. */
+void metrics_close()
+{
+	if (metrics_fd < 0) {
+		return;
+	}
+
+	if (write(metrics_wake[1], "x", 1) < 0) {
+		/* the thread is gone already, nothing to wake */
+	}
+	pthread_join(metrics_thread, NULL);
+
+	close(metrics_wake[0]);
+	close(metrics_wake[1]);
+	metrics_wake[0] = metrics_wake[1] = -1;
+	close(metrics_fd);
+	metrics_fd = -1;
+	if (metrics_path != NULL) {
+		unlink(metrics_path);
+		free(metrics_path);
+		metrics_path = NULL;
+	}
+	metrics_enabled = 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * metrics.h
+ * Counters and latency histograms, served in the Prometheus text format.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "libideviceactivate.h"
+#include "buffer.h"
+#include "trace.h"
+
+typedef enum {
+	METRICS_STARTED = 0,
+	METRICS_PROPS_HIT,
+	METRICS_PROPS_MISS,
+	METRICS_RECORDS_HIT,
+	METRICS_RECORDS_MISS,
+	METRICS_COUNTERS
+} metrics_counter;
+
+/* The stages with a latency histogram each */
+typedef enum {
+	METRICS_USBMUX_CONNECT = 0,
+	METRICS_LOCKDOWND_HANDSHAKE,
+	METRICS_LOCKDOWND_QUERY,
+	METRICS_HTTP_FETCH,
+	METRICS_LOCKDOWND_ACTIVATE,
+	METRICS_STAGES
+} metrics_stage;
+
+/* The first five line up with activation_pipe_stage_t */
+typedef enum {
+	METRICS_QUEUE_PIPE_QUERY = 0,
+	METRICS_QUEUE_PIPE_BUILD,
+	METRICS_QUEUE_PIPE_FETCH,
+	METRICS_QUEUE_PIPE_PARSE,
+	METRICS_QUEUE_PIPE_ACTIVATE,
+	METRICS_QUEUE_ENGINE_DEVICE,
+	METRICS_QUEUE_ENGINE_NETWORK,
+	METRICS_QUEUES
+} metrics_queue_t;
+
+/* Set by metrics_serve(). Nothing is counted while it's zero, and the
+ * macros don't even read the clock. */
+extern int metrics_enabled;
+
+extern int metrics_serve(const char* address);
+extern void metrics_close();
+
+/* Each thread counts into its own copy, so these never contend; a scrape
+ * adds the copies up. */
+extern void metrics_count(metrics_counter counter);
+extern void metrics_result(activation_error_t err);
+extern void metrics_observe(metrics_stage stage, uint64_t elapsed);
+extern void metrics_queue(metrics_queue_t queue, int delta);
+
+extern int metrics_format(buffer_t* out);
+
+#define METRICS_COUNT(counter) do { if (metrics_enabled) metrics_count(counter); } while (0)
+#define METRICS_QUEUE(queue, delta) do { if (metrics_enabled) metrics_queue(queue, delta); } while (0)
+#define METRICS_BEGIN(start) uint64_t start = metrics_enabled ? trace_now() : 0
+#define METRICS_END(stage, start) do { if (metrics_enabled) metrics_observe(stage, trace_now() - start); } while (0)
+
+#endif
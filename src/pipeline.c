@@ -0,0 +1,362 @@
+/*
+ * pipeline.c
+ * Runs activations as a pipeline of stages, each with its own worker pool.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "http.h"
+#include "metrics.h"
+#include "session.h"
+#include "trace.h"
+#include "util.h"
+
+#define PIPELINE_DEFAULT_QUEUE_SIZE 32
+
+static const int pipeline_default_workers[ACTIVATION_PIPE_STAGES] = {
+	4,   /* query */
+	1,   /* build */
+	16,  /* fetch */
+	1,   /* parse */
+	4    /* activate */
+};
+
+static const char* pipeline_stage_names[ACTIVATION_PIPE_STAGES] = {
+	"query", "build", "fetch", "parse", "activate"
+};
+
+/* A session on its way through, with whatever one stage leaves the next */
+typedef struct {
+	activation_session_t session;
+	CURLcode res;
+	plist_t record;
+} pipe_item;
+
+/* A bounded queue in front of a stage. Pushing into a full one waits, so a
+ * slow stage holds up the ones before it instead of piling up sessions. The
+ * depth is integrated over time as it changes, for the mean in the stats. */
+typedef struct {
+	pipe_item** slots;
+	metrics_queue_t gauge;
+	int size;
+	int head;
+	int depth;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+	int peak;
+	uint64_t changed;
+	double area;
+} pipe_queue;
+
+struct pipeline;
+
+typedef struct {
+	struct pipeline* pipeline;
+	int index;
+	int workers;
+	int live;
+	uint64_t busy;
+	unsigned long processed;
+} pipe_stage;
+
+typedef struct pipeline {
+	int deactivate;
+	pipe_queue queues[ACTIVATION_PIPE_STAGES];
+	pipe_stage stages[ACTIVATION_PIPE_STAGES];
+} pipeline;
+
+static int pipe_queue_init(pipe_queue* queue, int stage, int size, uint64_t now)
+{
+	memset(queue, 0, sizeof(pipe_queue));
+	queue->slots = calloc(size, sizeof(pipe_item*));
+	if (queue->slots == NULL) {
+		return -1;
+	}
+	queue->gauge = (metrics_queue_t)(METRICS_QUEUE_PIPE_QUERY + stage);
+	queue->size = size;
+	queue->changed = now;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	return 0;
+}
+
+static void pipe_queue_free(pipe_queue* queue)
+{
+	if (queue->slots == NULL) {
+		return;
+	}
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+/* called with the lock held, just before the depth changes */
+static void pipe_queue_account(pipe_queue* queue)
+{
+	uint64_t now = trace_now();
+	queue->area += (double)queue->depth * (now - queue->changed);
+	queue->changed = now;
+}
+
+static void pipe_queue_push(pipe_queue* queue, pipe_item* item)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->depth == queue->size) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+	pipe_queue_account(queue);
+	queue->slots[(queue->head + queue->depth) % queue->size] = item;
+	queue->depth++;
+	if (queue->depth > queue->peak) {
+		queue->peak = queue->depth;
+	}
+	METRICS_QUEUE(queue->gauge, 1);
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Waits for an item; NULL once the queue is closed and empty. */
+static pipe_item* pipe_queue_pop(pipe_queue* queue)
+{
+	pipe_item* item = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->depth == 0 && !queue->closed) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+	if (queue->depth > 0) {
+		pipe_queue_account(queue);
+		item = queue->slots[queue->head];
+		queue->head = (queue->head + 1) % queue->size;
+		queue->depth--;
+		METRICS_QUEUE(queue->gauge, -1);
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+static void pipe_queue_close(pipe_queue* queue)
+{
+	if (queue->slots == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Runs one stage for one session. Returns the stage it goes to next, or -1
+ * if it is done, in which case its done callback has been called. */
+static int pipeline_step(pipeline* p, int stage, pipe_item* item)
+{
+	activation_session_t session = item->session;
+	activation_error_t err = ACTIVATION_E_SUCCESS;
+	int finished = 0;
+
+	session_enter(session);
+	trace_set_uuid(session->uuid);
+
+	switch (stage) {
+	case ACTIVATION_PIPE_QUERY:
+		if (p->deactivate) {
+			err = session_deactivate(session);
+			finished = 1;
+		} else {
+			err = session_query(session, &finished);
+		}
+		break;
+
+	case ACTIVATION_PIPE_BUILD:
+		err = session_build(session);
+		break;
+
+	case ACTIVATION_PIPE_FETCH:
+		item->res = http_perform(session->http, &session->request.response, session->cancel);
+		break;
+
+	case ACTIVATION_PIPE_PARSE:
+		err = session_parse(session, item->res, &item->record);
+		break;
+
+	case ACTIVATION_PIPE_ACTIVATE:
+		err = session_activate(session, item->record);
+		plist_free(item->record);
+		item->record = NULL;
+		finished = 1;
+		break;
+	}
+
+	if (err != ACTIVATION_E_SUCCESS || finished) {
+		session_done(session, err);
+		session_leave(session);
+		return -1;
+	}
+
+	session_leave(session);
+	return stage + 1;
+}
+
+/* Workers of a stage drain its queue; the last one out closes the next
+ * queue, so the pipeline empties front to back. */
+static void* pipeline_worker(void* arg)
+{
+	pipe_stage* stage = (pipe_stage*)arg;
+	pipeline* p = stage->pipeline;
+	pipe_item* item = NULL;
+
+	while ((item = pipe_queue_pop(&p->queues[stage->index])) != NULL) {
+		uint64_t start = trace_now();
+		int next = pipeline_step(p, stage->index, item);
+		__sync_fetch_and_add(&stage->busy, trace_now() - start);
+		__sync_fetch_and_add(&stage->processed, 1);
+
+		if (next >= 0) {
+			pipe_queue_push(&p->queues[next], item);
+		}
+	}
+
+	if (__sync_sub_and_fetch(&stage->live, 1) == 0 && stage->index + 1 < ACTIVATION_PIPE_STAGES) {
+		pipe_queue_close(&p->queues[stage->index + 1]);
+	}
+	return NULL;
+}
+
+const char* activation_pipe_stage_name(activation_pipe_stage_t stage)
+{
+	if (stage < 0 || stage >= ACTIVATION_PIPE_STAGES) {
+		return "unknown";
+	}
+	return pipeline_stage_names[stage];
+}
+
+activation_error_t activation_pipeline_run(activation_session_t* sessions, int count, const activation_pipeline_config_t* config, activation_pipe_stats_t* stats)
+{
+	pipeline p;
+	pthread_t* threads[ACTIVATION_PIPE_STAGES];
+	int wanted[ACTIVATION_PIPE_STAGES];
+	pipe_item* items = NULL;
+	int i = 0;
+	int j = 0;
+
+	if (sessions == NULL || count <= 0) {
+		return ACTIVATION_E_INVALID_ARG;
+	}
+
+	memset(&p, 0, sizeof(p));
+	memset(threads, 0, sizeof(threads));
+	memset(wanted, 0, sizeof(wanted));
+	p.deactivate = (config != NULL) ? config->deactivate : 0;
+
+	activation_error_t err = ACTIVATION_E_SUCCESS;
+	uint64_t start = trace_now();
+
+	items = calloc(count, sizeof(pipe_item));
+	if (items == NULL) {
+		err = ACTIVATION_E_NO_MEMORY;
+	}
+
+	/* every queue has to be there before the first worker can push into it */
+	for (i = 0; i < ACTIVATION_PIPE_STAGES && err == ACTIVATION_E_SUCCESS; i++) {
+		int size = (config != NULL && config->queue_size[i] > 0) ? config->queue_size[i] : PIPELINE_DEFAULT_QUEUE_SIZE;
+		int workers = (config != NULL && config->workers[i] > 0) ? config->workers[i] : pipeline_default_workers[i];
+
+		p.stages[i].pipeline = &p;
+		p.stages[i].index = i;
+		threads[i] = calloc(workers, sizeof(pthread_t));
+		if (threads[i] == NULL || pipe_queue_init(&p.queues[i], i, size, start) != 0) {
+			err = ACTIVATION_E_NO_MEMORY;
+		}
+		wanted[i] = workers;
+	}
+
+	for (i = 0; i < ACTIVATION_PIPE_STAGES && err == ACTIVATION_E_SUCCESS; i++) {
+		for (j = 0; j < wanted[i]; j++) {
+			if (pthread_create(&threads[i][j], NULL, pipeline_worker, &p.stages[i]) != 0) {
+				break;
+			}
+			p.stages[i].workers++;
+		}
+		p.stages[i].live = p.stages[i].workers;
+
+		/* a stage without a single worker would never drain */
+		if (p.stages[i].workers == 0) {
+			err = ACTIVATION_E_NO_MEMORY;
+		}
+	}
+
+	if (err == ACTIVATION_E_SUCCESS) {
+		for (i = 0; i < count; i++) {
+			items[i].session = sessions[i];
+			pipe_queue_push(&p.queues[0], &items[i]);
+		}
+		pipe_queue_close(&p.queues[0]);
+	} else {
+		error("Unable to start the pipeline");
+		for (i = 0; i < ACTIVATION_PIPE_STAGES; i++) {
+			pipe_queue_close(&p.queues[i]);
+		}
+		for (i = 0; i < count; i++) {
+			session_done(sessions[i], err);
+		}
+	}
+
+	for (i = 0; i < ACTIVATION_PIPE_STAGES; i++) {
+		for (j = 0; j < p.stages[i].workers; j++) {
+			pthread_join(threads[i][j], NULL);
+		}
+		free(threads[i]);
+	}
+
+	uint64_t elapsed = trace_now() - start;
+	for (i = 0; i < ACTIVATION_PIPE_STAGES; i++) {
+		pipe_queue* queue = &p.queues[i];
+		pipe_stage* stage = &p.stages[i];
+
+		if (stats != NULL && queue->slots != NULL) {
+			memset(&stats[i], 0, sizeof(activation_pipe_stats_t));
+			stats[i].workers = stage->workers;
+			stats[i].queue_size = queue->size;
+			stats[i].peak_depth = queue->peak;
+			stats[i].processed = stage->processed;
+			if (elapsed > 0) {
+				pipe_queue_account(queue);
+				stats[i].mean_depth = queue->area / elapsed;
+				if (stage->workers > 0) {
+					stats[i].busy = (double)stage->busy / ((double)elapsed * stage->workers);
+				}
+			}
+		}
+		pipe_queue_free(queue);
+	}
+	free(items);
+
+	return err;
+}
@@ -0,0 +1,306 @@
+/*
+ * props.c
+ * Reads everything we need from lockdownd in one go and keeps it around for a
+ * little while, keyed by device UUID.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <plist/plist.h>
+
+#include "metrics.h"
+#include "props.h"
+#include "transport.h"
+#include "util.h"
+
+#define PROPS_BUCKETS 256
+
+/* Each bucket has its own lock, so sessions working on different devices
+ * don't wait on each other. Reference counts are atomic for the same reason. */
+static device_props* buckets[PROPS_BUCKETS];
+static pthread_mutex_t bucket_locks[PROPS_BUCKETS];
+static pthread_once_t props_once = PTHREAD_ONCE_INIT;
+static int props_ttl = PROPS_DEFAULT_TTL;
+
+static void props_init()
+{
+	int i = 0;
+	for (i = 0; i < PROPS_BUCKETS; i++) {
+		pthread_mutex_init(&bucket_locks[i], NULL);
+	}
+}
+
+static unsigned int props_hash(const char* uuid)
+{
+	unsigned int hash = 5381;
+	while (*uuid) {
+		hash = (hash * 33) ^ (unsigned char)*uuid++;
+	}
+	return hash % PROPS_BUCKETS;
+}
+
+static void props_free(device_props* props)
+{
+	free(props->uuid);
+	free(props->device_class);
+	free(props->imei);
+	free(props->imsi);
+	free(props->iccid);
+	free(props->serial_number);
+	free(props->activation_state);
+	if (props->activation_info != NULL) {
+		plist_free(props->activation_info);
+	}
+	free(props);
+}
+
+static char* props_string(plist_t dict, const char* key)
+{
+	char* val = NULL;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node != NULL && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &val);
+	}
+	return val;
+}
+
+/* One GetValue without a key returns the whole root domain, which covers every
+ * string property we care about. ActivationInfo is generated on request and
+ * isn't part of that dictionary on every firmware, so it gets its own query
+ * only when it's missing. */
+static device_props* props_fetch(device_link* link)
+{
+	plist_t dict = NULL;
+
+	METRICS_BEGIN(query_time);
+	device_transport_current->get_value(link, NULL, &dict);
+	METRICS_END(METRICS_LOCKDOWND_QUERY, query_time);
+	if (dict == NULL || plist_get_node_type(dict) != PLIST_DICT) {
+		error("Unable to get device properties from lockdownd");
+		if (dict != NULL) {
+			plist_free(dict);
+		}
+		return NULL;
+	}
+
+	device_props* props = calloc(1, sizeof(device_props));
+	if (props == NULL) {
+		error("Unable to allocate sufficent memory");
+		plist_free(dict);
+		return NULL;
+	}
+
+	props->uuid = props_string(dict, "UniqueDeviceID");
+	props->device_class = props_string(dict, "DeviceClass");
+	props->imei = props_string(dict, "InternationalMobileEquipmentIdentity");
+	props->imsi = props_string(dict, "InternationalMobileSubscriberIdentity");
+	props->iccid = props_string(dict, "IntegratedCircuitCardIdentity");
+	props->serial_number = props_string(dict, "SerialNumber");
+	props->activation_state = props_string(dict, "ActivationState");
+
+	plist_t activation_info = plist_dict_get_item(dict, "ActivationInfo");
+	if (activation_info != NULL && plist_get_node_type(activation_info) == PLIST_DICT) {
+		props->activation_info = plist_copy(activation_info);
+	}
+	plist_free(dict);
+
+	if (props->activation_info == NULL) {
+		METRICS_BEGIN(info_time);
+		device_transport_current->get_value(link, "ActivationInfo", &props->activation_info);
+		METRICS_END(METRICS_LOCKDOWND_QUERY, info_time);
+	}
+
+	props->fetched = time(NULL);
+	props->refs = 1;
+	return props;
+}
+
+/* Moves every expired snapshot in a bucket, and the one for uuid when it
+ * isn't NULL, onto *stale. Called with the bucket's lock held; a device that
+ * is never asked about again would otherwise keep its snapshot for good. */
+static void props_sweep(unsigned int bucket, const char* uuid, time_t now, device_props** stale)
+{
+	device_props** link = &buckets[bucket];
+	while (*link != NULL) {
+		device_props* props = *link;
+		if (now - props->fetched >= props_ttl || (uuid != NULL && !strcmp(props->uuid, uuid))) {
+			*link = props->next;
+			props->next = *stale;
+			*stale = props;
+		} else {
+			link = &props->next;
+		}
+	}
+}
+
+/* Drops the cache's reference to each swept snapshot, outside the lock */
+static void props_release_list(device_props* stale)
+{
+	while (stale != NULL) {
+		device_props* next = stale->next;
+		stale->next = NULL;
+		props_release(stale);
+		stale = next;
+	}
+}
+
+/* A reference to the cached snapshot for uuid if it's still fresh, or NULL */
+static device_props* props_lookup(const char* uuid)
+{
+	device_props* props = NULL;
+	device_props* stale = NULL;
+	unsigned int bucket = props_hash(uuid);
+
+	pthread_mutex_lock(&bucket_locks[bucket]);
+	props_sweep(bucket, NULL, time(NULL), &stale);
+	for (props = buckets[bucket]; props != NULL; props = props->next) {
+		if (!strcmp(props->uuid, uuid)) {
+			__sync_fetch_and_add(&props->refs, 1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bucket_locks[bucket]);
+
+	props_release_list(stale);
+	return props;
+}
+
+/* Returns the property snapshot for a device, from the cache when there's a
+ * fresh one. The caller owns a reference and must hand it back with
+ * props_release(). uuid may be NULL, in which case the device is always asked
+ * and the result is cached under the UUID it reports. */
+device_props* props_get(device_link* link, const char* uuid)
+{
+	device_props* props = NULL;
+
+	pthread_once(&props_once, props_init);
+
+	if (uuid != NULL && (props = props_lookup(uuid)) != NULL) {
+		METRICS_COUNT(METRICS_PROPS_HIT);
+		return props;
+	}
+
+	METRICS_COUNT(METRICS_PROPS_MISS);
+	props = props_fetch(link);
+	if (props == NULL) {
+		return NULL;
+	}
+
+	if (props->uuid == NULL) {
+		if (uuid == NULL) {
+			/* nothing to key it by, so it just doesn't get cached */
+			return props;
+		}
+		props->uuid = strdup(uuid);
+	}
+
+	device_props* stale = NULL;
+	unsigned int bucket = props_hash(props->uuid);
+	pthread_mutex_lock(&bucket_locks[bucket]);
+	props_sweep(bucket, props->uuid, time(NULL), &stale);
+	__sync_fetch_and_add(&props->refs, 1);
+	props->next = buckets[bucket];
+	buckets[bucket] = props;
+	pthread_mutex_unlock(&bucket_locks[bucket]);
+
+	props_release_list(stale);
+	return props;
+}
+
+/* Just the device's ActivationState, for the caller to free. A fresh snapshot
+ * answers it for free; otherwise it's one GetValue for that key alone, which
+ * is much cheaper than props_get() and doesn't make the device generate its
+ * ActivationInfo. Nothing is cached, the state is about to change anyway. */
+char* props_activation_state(device_link* link, const char* uuid)
+{
+	device_props* props = NULL;
+	plist_t node = NULL;
+	char* state = NULL;
+
+	pthread_once(&props_once, props_init);
+
+	if (uuid != NULL && (props = props_lookup(uuid)) != NULL) {
+		state = (props->activation_state != NULL) ? strdup(props->activation_state) : NULL;
+		props_release(props);
+		return state;
+	}
+
+	METRICS_BEGIN(query_time);
+	device_transport_current->get_value(link, "ActivationState", &node);
+	METRICS_END(METRICS_LOCKDOWND_QUERY, query_time);
+	if (node != NULL) {
+		if (plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &state);
+		}
+		plist_free(node);
+	}
+	return state;
+}
+
+void props_release(device_props* props)
+{
+	if (props == NULL) {
+		return;
+	}
+
+	if (__sync_sub_and_fetch(&props->refs, 1) == 0) {
+		props_free(props);
+	}
+}
+
+/* Drops the cached snapshot for a device, e.g. after its activation state has
+ * changed. Anyone still holding a reference keeps a valid copy. */
+void props_invalidate(const char* uuid)
+{
+	device_props* stale = NULL;
+	unsigned int bucket = props_hash(uuid);
+
+	pthread_once(&props_once, props_init);
+
+	pthread_mutex_lock(&bucket_locks[bucket]);
+	props_sweep(bucket, uuid, time(NULL), &stale);
+	pthread_mutex_unlock(&bucket_locks[bucket]);
+
+	props_release_list(stale);
+}
+
+/* Empties the cache, for when the process is done with its devices */
+void props_cleanup()
+{
+	int i = 0;
+
+	pthread_once(&props_once, props_init);
+
+	for (i = 0; i < PROPS_BUCKETS; i++) {
+		pthread_mutex_lock(&bucket_locks[i]);
+		device_props* stale = buckets[i];
+		buckets[i] = NULL;
+		pthread_mutex_unlock(&bucket_locks[i]);
+
+		props_release_list(stale);
+	}
+}
+
+void props_set_ttl(int seconds)
+{
+	props_ttl = seconds;
+}
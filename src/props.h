@@ -0,0 +1,54 @@
+/*
+ * props.h
+ * Reads everything we need from lockdownd in one go and keeps it around for a
+ * little while, keyed by device UUID.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PROPS_H
+#define PROPS_H
+
+#include <time.h>
+#include <plist/plist.h>
+#include "transport.h"
+
+#define PROPS_DEFAULT_TTL 60
+
+typedef struct device_props {
+	char* uuid;
+	char* device_class;
+	char* imei;
+	char* imsi;
+	char* iccid;
+	char* serial_number;
+	char* activation_state;
+	plist_t activation_info;
+
+	time_t fetched;
+	int refs;
+	struct device_props* next;
+} device_props;
+
+extern device_props* props_get(device_link* link, const char* uuid);
+extern char* props_activation_state(device_link* link, const char* uuid);
+extern void props_release(device_props* props);
+extern void props_invalidate(const char* uuid);
+extern void props_cleanup();
+extern void props_set_ttl(int seconds);
+
+#endif
@@ -0,0 +1,484 @@
+/*
+ * records.c
+ * Keeps every activation record we fetch, keyed by device UUID, so a device
+ * we've seen before can be reactivated without asking the server again.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <plist/plist.h>
+
+#include "metrics.h"
+#include "records.h"
+#include "store.h"
+#include "util.h"
+
+#define RECORDS_SHARDS 16
+#define RECORDS_BUCKETS 32
+#define RECORDS_SUFFIX ".plist"
+
+/* The most recently used records stay parsed in memory, in a hash table for
+ * lookups threaded onto a list that keeps them in order of use. Everything
+ * else is one store_get() away, see store.c. The table is split into shards,
+ * each with its own lock and its own share of the LRU, so sessions working on
+ * different devices rarely touch the same lock. */
+typedef struct records_entry {
+	char* uuid;
+	plist_t record;
+	struct records_entry* hash_next;
+	struct records_entry* prev;
+	struct records_entry* next;
+} records_entry;
+
+typedef struct {
+	records_entry* buckets[RECORDS_BUCKETS];
+	records_entry* head;
+	records_entry* tail;
+	int count;
+	pthread_mutex_t lock;
+} records_shard;
+
+static store_t* records_store = NULL;
+static records_shard shards[RECORDS_SHARDS];
+
+static unsigned int records_hash(const char* uuid)
+{
+	unsigned int hash = 5381;
+	while (*uuid) {
+		hash = (hash * 33) ^ (unsigned char)*uuid++;
+	}
+	return hash;
+}
+
+static records_shard* records_shard_for(const char* uuid)
+{
+	return &shards[records_hash(uuid) % RECORDS_SHARDS];
+}
+
+static records_entry** records_bucket(records_shard* shard, const char* uuid)
+{
+	return &shard->buckets[(records_hash(uuid) / RECORDS_SHARDS) % RECORDS_BUCKETS];
+}
+
+/* the shard's lock must be held for all the lru_* helpers */
+static void lru_unlink(records_shard* shard, records_entry* entry)
+{
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		shard->head = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard->tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void lru_push_front(records_shard* shard, records_entry* entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+	if (shard->head != NULL) {
+		shard->head->prev = entry;
+	}
+	shard->head = entry;
+	if (shard->tail == NULL) {
+		shard->tail = entry;
+	}
+}
+
+static records_entry* lru_find(records_shard* shard, const char* uuid)
+{
+	records_entry* entry = NULL;
+	for (entry = *records_bucket(shard, uuid); entry != NULL; entry = entry->hash_next) {
+		if (!strcmp(entry->uuid, uuid)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void lru_remove(records_shard* shard, records_entry* entry)
+{
+	records_entry** link = records_bucket(shard, entry->uuid);
+	while (*link != NULL) {
+		if (*link == entry) {
+			*link = entry->hash_next;
+			break;
+		}
+		link = &(*link)->hash_next;
+	}
+	lru_unlink(shard, entry);
+	shard->count--;
+
+	plist_free(entry->record);
+	free(entry->uuid);
+	free(entry);
+}
+
+/* Takes ownership of record. */
+static void lru_insert(records_shard* shard, const char* uuid, plist_t record)
+{
+	records_entry* entry = lru_find(shard, uuid);
+	if (entry != NULL) {
+		plist_free(entry->record);
+		entry->record = record;
+		lru_unlink(shard, entry);
+		lru_push_front(shard, entry);
+		return;
+	}
+
+	entry = calloc(1, sizeof(records_entry));
+	if (entry == NULL) {
+		plist_free(record);
+		return;
+	}
+	entry->uuid = strdup(uuid);
+	entry->record = record;
+
+	records_entry** bucket = records_bucket(shard, uuid);
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	lru_push_front(shard, entry);
+	shard->count++;
+
+	if (shard->count > RECORDS_LRU_SIZE / RECORDS_SHARDS) {
+		lru_remove(shard, shard->tail);
+	}
+}
+
+int records_open(const char* dir)
+{
+	char fname[512];
+	int i = 0;
+
+	for (i = 0; i < RECORDS_SHARDS; i++) {
+		memset(&shards[i], 0, sizeof(records_shard));
+		pthread_mutex_init(&shards[i].lock, NULL);
+	}
+
+	snprintf(fname, sizeof(fname), "%s/%s", dir, RECORDS_FILE);
+	records_store = store_open(fname);
+	if (records_store == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+void records_close()
+{
+	int i = 0;
+
+	if (records_store == NULL) {
+		return;
+	}
+
+	for (i = 0; i < RECORDS_SHARDS; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		while (shards[i].head != NULL) {
+			lru_remove(&shards[i], shards[i].head);
+		}
+		pthread_mutex_unlock(&shards[i].lock);
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+	store_close(records_store);
+	records_store = NULL;
+}
+
+int records_enabled()
+{
+	return (records_store != NULL);
+}
+
+/* Persists record (as a binary plist) and keeps a parsed copy in memory. */
+int records_save(const char* uuid, plist_t record)
+{
+	if (records_store == NULL || uuid == NULL) {
+		return -1;
+	}
+
+	if (store_put(records_store, uuid, record) != 0) {
+		char m[128];
+		snprintf(m, sizeof(m), "Unable to save the activation record for %s", uuid);
+		error(m);
+		return -1;
+	}
+
+	records_shard* shard = records_shard_for(uuid);
+	pthread_mutex_lock(&shard->lock);
+	lru_insert(shard, uuid, plist_copy(record));
+	pthread_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+/* Returns a copy of the stored record for a device, which the caller frees,
+ * or NULL if we've never fetched one for it. */
+plist_t records_load(const char* uuid)
+{
+	plist_t record = NULL;
+
+	if (records_store == NULL || uuid == NULL) {
+		return NULL;
+	}
+
+	records_shard* shard = records_shard_for(uuid);
+	pthread_mutex_lock(&shard->lock);
+	records_entry* entry = lru_find(shard, uuid);
+	if (entry != NULL) {
+		lru_unlink(shard, entry);
+		lru_push_front(shard, entry);
+		record = plist_copy(entry->record);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (record != NULL) {
+		METRICS_COUNT(METRICS_RECORDS_HIT);
+		return record;
+	}
+
+	if (store_get(records_store, uuid, &record) != 0) {
+		METRICS_COUNT(METRICS_RECORDS_MISS);
+		return NULL;
+	}
+	METRICS_COUNT(METRICS_RECORDS_HIT);
+
+	pthread_mutex_lock(&shard->lock);
+	lru_insert(shard, uuid, plist_copy(record));
+	pthread_mutex_unlock(&shard->lock);
+	return record;
+}
+
+/* One file on its way into the store. A binary plist goes in exactly as it
+ * is on disk, straight from the mapping; XML gets converted. */
+typedef struct {
+	char* path;
+	char* key;
+	char* map;
+	size_t map_length;
+	char* bin;
+	uint32_t bin_length;
+	int ok;
+} records_file;
+
+typedef struct {
+	records_file* files;
+	int count;
+	int next;
+} records_batch;
+
+static void records_load_file(records_file* file)
+{
+	plist_t record = NULL;
+
+	if (buffer_map_from_filename(file->path, &file->map, &file->map_length) != 0) {
+		return;
+	}
+
+	/* parsed either way, so nothing that isn't a plist gets in */
+	if (plist_read_from_buffer(&record, file->map, file->map_length) != 0 || plist_get_node_type(record) != PLIST_DICT) {
+		plist_free(record);
+		return;
+	}
+
+	if (file->map_length >= 8 && memcmp(file->map, "bplist00", 8) == 0) {
+		file->bin = file->map;
+		file->bin_length = file->map_length;
+	} else {
+		char* bin = NULL;
+		plist_to_bin(record, &bin, &file->bin_length);
+		buffer_unmap(file->map, file->map_length);
+		file->map = NULL;
+		file->bin = bin;
+	}
+	plist_free(record);
+	file->ok = (file->bin != NULL);
+}
+
+static void* records_preload_worker(void* arg)
+{
+	records_batch* batch = (records_batch*)arg;
+
+	while (1) {
+		int index = __sync_fetch_and_add(&batch->next, 1);
+		if (index >= batch->count) {
+			break;
+		}
+		records_load_file(&batch->files[index]);
+	}
+	return NULL;
+}
+
+/* Loads one batch on threads workers, then writes it with one store_put_many(). */
+static int records_preload_batch(records_file* files, int count, int threads)
+{
+	records_batch batch;
+	pthread_t workers[RECORDS_PRELOAD_THREADS];
+	int started = 0;
+	int loaded = 0;
+	int i = 0;
+
+	batch.files = files;
+	batch.count = count;
+	batch.next = 0;
+
+	for (i = 0; i < threads - 1 && i < count - 1; i++) {
+		if (pthread_create(&workers[started], NULL, records_preload_worker, &batch) == 0) {
+			started++;
+		}
+	}
+	records_preload_worker(&batch);
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	store_item* items = calloc(count, sizeof(store_item));
+	if (items == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!files[i].ok) {
+			char m[600];
+			snprintf(m, sizeof(m), "Skipping %s, it isn't an activation record", files[i].path);
+			error(m);
+			continue;
+		}
+		items[loaded].key = files[i].key;
+		items[loaded].data = files[i].bin;
+		items[loaded].length = files[i].bin_length;
+		loaded++;
+	}
+
+	int res = store_put_many(records_store, items, loaded);
+	free(items);
+
+	/* anything we had in memory for these devices is out of date now */
+	for (i = 0; i < count && res == 0; i++) {
+		if (!files[i].ok) {
+			continue;
+		}
+		records_shard* shard = records_shard_for(files[i].key);
+		pthread_mutex_lock(&shard->lock);
+		records_entry* entry = lru_find(shard, files[i].key);
+		if (entry != NULL) {
+			lru_remove(shard, entry);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return (res == 0) ? loaded : -1;
+}
+
+static void records_file_free(records_file* file)
+{
+	if (file->bin != NULL && file->bin != file->map) {
+		free(file->bin);
+	}
+	buffer_unmap(file->map, file->map_length);
+	free(file->path);
+	free(file->key);
+	memset(file, 0, sizeof(records_file));
+}
+
+/* Imports every <uuid>.plist in dir, XML or binary, into the record store,
+ * so those devices get activated from them without asking the server. Files
+ * are loaded on up to threads threads (zero for one per CPU) and written in
+ * batches of RECORDS_PRELOAD_BATCH, which also bounds the memory it takes.
+ * Returns how many records were imported. */
+int records_preload(const char* dir, int threads)
+{
+	records_file files[RECORDS_PRELOAD_BATCH];
+	struct dirent* entry = NULL;
+	int count = 0;
+	int total = 0;
+	int res = 0;
+
+	if (records_store == NULL) {
+		error("There is no record store to preload into");
+		return -1;
+	}
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > RECORDS_PRELOAD_THREADS) {
+		threads = RECORDS_PRELOAD_THREADS;
+	}
+
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		char m[600];
+		snprintf(m, sizeof(m), "Unable to open %s", dir);
+		error(m);
+		return -1;
+	}
+
+	memset(files, 0, sizeof(files));
+	while (res >= 0 && (entry = readdir(d)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		size_t suffix = strlen(RECORDS_SUFFIX);
+		if (length <= suffix || strcmp(entry->d_name + length - suffix, RECORDS_SUFFIX) != 0) {
+			continue;
+		}
+
+		records_file* file = &files[count];
+		file->key = strndup(entry->d_name, length - suffix);
+		file->path = malloc(strlen(dir) + length + 2);
+		if (file->key == NULL || file->path == NULL) {
+			/* not counted yet, so the cleanup below won't get to it */
+			records_file_free(file);
+			res = -1;
+			break;
+		}
+		sprintf(file->path, "%s/%s", dir, entry->d_name);
+
+		if (++count == RECORDS_PRELOAD_BATCH) {
+			res = records_preload_batch(files, count, threads);
+			total += (res > 0) ? res : 0;
+			while (count > 0) {
+				records_file_free(&files[--count]);
+			}
+		}
+	}
+	closedir(d);
+
+	if (res >= 0 && count > 0) {
+		res = records_preload_batch(files, count, threads);
+		total += (res > 0) ? res : 0;
+	}
+	while (count > 0) {
+		records_file_free(&files[--count]);
+	}
+
+	if (res < 0) {
+		error("Unable to preload the activation records");
+		return -1;
+	}
+	return total;
+}
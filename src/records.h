@@ -0,0 +1,41 @@
+/*
+ * records.h
+ * Keeps every activation record we fetch, keyed by device UUID, so a device
+ * we've seen before can be reactivated without asking the server again.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RECORDS_H
+#define RECORDS_H
+
+#include <plist/plist.h>
+
+#define RECORDS_FILE "records.db"
+#define RECORDS_LRU_SIZE 256
+#define RECORDS_PRELOAD_BATCH 512
+#define RECORDS_PRELOAD_THREADS 64
+
+extern int records_open(const char* dir);
+extern void records_close();
+extern int records_enabled();
+
+extern int records_save(const char* uuid, plist_t record);
+extern plist_t records_load(const char* uuid);
+extern int records_preload(const char* dir, int threads);
+
+#endif
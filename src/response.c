@@ -0,0 +1,195 @@
+/*
+ * response.c
+ * Collects the activation server's reply as it arrives and finds the plist
+ * inside it on the fly.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <plist/plist.h>
+
+#include "buffer.h"
+#include "response.h"
+#include "util.h"
+
+#define PLIST_OPEN "<plist"
+#define PLIST_CLOSE "</plist>"
+
+/* the reply is usually a few KB, so this is enough to never grow at all */
+#define RESPONSE_INITIAL_SIZE 0x2000
+
+int response_init(activate_response* response, size_t limit)
+{
+	return response_init_arena(response, NULL, limit);
+}
+
+/* With an arena the body lives there, and response_free() leaves it be. */
+int response_init_arena(activate_response* response, arena_t* arena, size_t limit)
+{
+	response->limit = (limit > 0) ? limit : RESPONSE_DEFAULT_LIMIT;
+	response->scanned = 0;
+	response->start = -1;
+	response->end = -1;
+	response->overflow = 0;
+	response->status = 0;
+	return buffer_init_arena(&response->body, arena, RESPONSE_INITIAL_SIZE);
+}
+
+/* Empties a response for another attempt at the same request, keeping the
+ * buffer it already has. */
+void response_reset(activate_response* response)
+{
+	response->body.length = 0;
+	response->scanned = 0;
+	response->start = -1;
+	response->end = -1;
+	response->overflow = 0;
+	response->status = 0;
+}
+
+/* Looks for needle in the part of the body that hasn't been searched yet,
+ * backing up just far enough to catch a match split across two chunks. */
+static long response_scan(activate_response* response, const char* needle, size_t from)
+{
+	size_t needle_len = strlen(needle);
+	size_t begin = response->scanned;
+
+	if (begin >= needle_len - 1) {
+		begin -= needle_len - 1;
+	} else {
+		begin = 0;
+	}
+	if (begin < from) {
+		begin = from;
+	}
+
+	if (response->body.length < begin + needle_len) {
+		return -1;
+	}
+
+	char* match = memmem(response->body.data + begin, response->body.length - begin, needle, needle_len);
+	return (match != NULL) ? (match - response->body.data) : -1;
+}
+
+/* Appends a chunk and advances the search for the plist boundaries. Once the
+ * closing tag has been seen the rest of the reply is dropped on the floor. */
+int response_feed(activate_response* response, const char* data, size_t length)
+{
+	if (response->end >= 0) {
+		return 0;
+	}
+
+	if (response->body.length + length > response->limit) {
+		response->overflow = 1;
+		return -1;
+	}
+
+	if (buffer_append(&response->body, data, length) != 0) {
+		response->overflow = 1;
+		return -1;
+	}
+
+	if (response->start < 0) {
+		response->start = response_scan(response, PLIST_OPEN, 0);
+	}
+
+	if (response->start >= 0) {
+		long close = response_scan(response, PLIST_CLOSE, response->start);
+		if (close >= 0) {
+			response->end = close + strlen(PLIST_CLOSE);
+		}
+	}
+
+	response->scanned = response->body.length;
+	return 0;
+}
+
+/* curl write callback, returning short makes curl abort the transfer */
+size_t response_write_callback(char* data, size_t size, size_t nmemb, void* userdata)
+{
+	activate_response* response = (activate_response*)userdata;
+	size_t total = size * nmemb;
+
+	if (response_feed(response, data, total) != 0) {
+		return 0;
+	}
+	return total;
+}
+
+int response_complete(activate_response* response)
+{
+	return (response->start >= 0 && response->end >= 0);
+}
+
+/* Parses the plist straight out of the receive buffer and pulls the
+ * activation record out of it. */
+int response_get_record(activate_response* response, plist_t* record)
+{
+	if (response->overflow) {
+		error("Activation response is too large");
+		return -1;
+	}
+
+	if (response->start < 0) {
+		error("Unable to locate beginning of ActivationInfo");
+		return -1;
+	}
+
+	if (response->end < 0) {
+		error("Unable to locate end of ActivationInfo");
+		return -1;
+	}
+
+	plist_t ticket_dict = NULL;
+	plist_from_xml(response->body.data + response->start, response->end - response->start, &ticket_dict);
+	if (ticket_dict == NULL) {
+		error("Unable to convert activation ticket into plist");
+		return -1;
+	}
+
+	plist_t iphone_activation_node = plist_dict_get_item(ticket_dict, "iphone-activation");
+	if (!iphone_activation_node) {
+		iphone_activation_node = plist_dict_get_item(ticket_dict, "device-activation");
+		if (!iphone_activation_node) {
+			error("Unable to find device activation node");
+			plist_free(ticket_dict);
+			return -1;
+		}
+	}
+
+	plist_t activation_record = plist_dict_get_item(iphone_activation_node, "activation-record");
+	if (!activation_record) {
+		error("Unable to find activation record node");
+		plist_free(ticket_dict);
+		return -1;
+	}
+
+	/* libplist can't detach a node from its parent, so the record (and only
+	 * the record) still gets copied out before the ticket goes away */
+	*record = plist_copy(activation_record);
+	plist_free(ticket_dict);
+	return 0;
+}
+
+void response_free(activate_response* response)
+{
+	buffer_free(&response->body);
+}
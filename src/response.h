@@ -0,0 +1,53 @@
+/*
+ * response.h
+ * Collects the activation server's reply as it arrives and finds the plist
+ * inside it on the fly.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <plist/plist.h>
+#include "buffer.h"
+
+/* nothing legitimate comes anywhere near this, it only guards against a
+ * misbehaving server filling up our memory */
+#define RESPONSE_DEFAULT_LIMIT 0x100000
+
+typedef struct {
+	buffer_t body;
+	size_t limit;
+	size_t scanned;  /* everything before this has been searched already */
+	long start;      /* offset of "<plist", -1 until seen */
+	long end;        /* offset just past "</plist>", -1 until seen */
+	int overflow;
+	long status;     /* HTTP status, set once the transfer is over */
+} activate_response;
+
+extern int response_init(activate_response* response, size_t limit);
+extern int response_init_arena(activate_response* response, arena_t* arena, size_t limit);
+extern void response_reset(activate_response* response);
+extern int response_feed(activate_response* response, const char* data, size_t length);
+extern size_t response_write_callback(char* data, size_t size, size_t nmemb, void* userdata);
+extern int response_complete(activate_response* response);
+extern int response_get_record(activate_response* response, plist_t* record);
+extern void response_free(activate_response* response);
+
+#endif
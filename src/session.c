@@ -0,0 +1,546 @@
+/*
+ * session.c
+ * The public face of the library, see libideviceactivate.h.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <plist/plist.h>
+
+#include "activate.h"
+#include "cache.h"
+#include "http.h"
+#include "idevice.h"
+#include "metrics.h"
+#include "props.h"
+#include "records.h"
+#include "session.h"
+#include "spool.h"
+#include "trace.h"
+#include "util.h"
+
+int activation_init()
+{
+	return http_init();
+}
+
+void activation_cleanup()
+{
+	spool_close();
+	metrics_close();
+	device_pool_evict(NULL);
+	props_cleanup();
+	transport_use(&lockdown_transport);
+	virtual_cleanup();
+	records_close();
+	http_cleanup();
+}
+
+/* Records are shared by every session in the process, see records.c */
+int activation_keep_records(const char* dir)
+{
+	return records_open(dir);
+}
+
+/* Imports every <uuid>.plist in dir into the store activation_keep_records()
+ * opened, loading them on threads threads (zero for one per CPU). Returns
+ * the number of records imported, or -1. */
+int activation_preload_records(const char* dir, int threads)
+{
+	return records_preload(dir, threads);
+}
+
+/* Requests that can't reach the server are kept in dir and sent once they
+ * can, see spool.c. Whatever an earlier run left there goes out first. */
+int activation_spool(const char* dir)
+{
+	return spool_open(dir);
+}
+
+int activation_spool_wait(long timeout_ms)
+{
+	return spool_wait(timeout_ms);
+}
+
+/* Serves the counters in the Prometheus text format on address (a port,
+ * HOST:PORT or a Unix socket path) until activation_cleanup(), see metrics.c */
+int activation_metrics_serve(const char* address)
+{
+	if (address == NULL) {
+		return -1;
+	}
+	return metrics_serve(address);
+}
+
+void activation_virtual_defaults(activation_virtual_config_t* config)
+{
+	virtual_defaults(config);
+}
+
+/* Every session from here on talks to simulated devices, see virtual.c */
+int activation_use_virtual_devices(const activation_virtual_config_t* config)
+{
+	if (virtual_init(config) != 0) {
+		return -1;
+	}
+	transport_use(&virtual_transport);
+	return 0;
+}
+
+void activation_http_defaults(activation_http_config_t* config)
+{
+	http_defaults(config);
+}
+
+int activation_set_http(const activation_http_config_t* config)
+{
+	return http_configure(config);
+}
+
+static char* session_strdup(const char* s)
+{
+	return (s != NULL) ? strdup(s) : NULL;
+}
+
+static void session_message(int is_error, const char* m, void* data)
+{
+	activation_session_t session = (activation_session_t)data;
+	session->callbacks.message(session, is_error, m, session->user_data);
+}
+
+/* Everything below reports through info() and error(), so for the length of
+ * a call those are pointed at the session's own callback. */
+void session_enter(activation_session_t session)
+{
+	if (session->callbacks.message != NULL) {
+		set_message_handler(session_message, session);
+	}
+}
+
+void session_leave(activation_session_t session)
+{
+	set_message_handler(NULL, NULL);
+}
+
+static int session_cancelled(activation_session_t session)
+{
+	return (session->cancel != NULL && *session->cancel);
+}
+
+void session_stage(activation_session_t session, activation_stage_t stage)
+{
+	if (session->callbacks.stage != NULL) {
+		session->callbacks.stage(session, stage, session->user_data);
+	}
+}
+
+/* Anything but a server side failure may have left lockdownd in a state the
+ * next user of the connection shouldn't inherit. */
+static void session_result(activation_session_t session, activation_error_t result)
+{
+	if (result != ACTIVATION_E_SUCCESS && result != ACTIVATION_E_FETCH_FAILED && result != ACTIVATION_E_QUEUED) {
+		session->broken = 1;
+	}
+}
+
+/* Counted once per session, whichever way it is driven */
+static void session_begin(activation_session_t session)
+{
+	if (!session->started) {
+		session->started = 1;
+		METRICS_COUNT(METRICS_STARTED);
+	}
+}
+
+void session_done(activation_session_t session, activation_error_t result)
+{
+	session_result(session, result);
+	if (metrics_enabled) {
+		session_begin(session);
+		metrics_result(result);
+	}
+	if (session->callbacks.done != NULL) {
+		session->callbacks.done(session, result, session->user_data);
+	}
+}
+
+activation_error_t activation_session_new(activation_session_t* session, const char* uuid, const activation_options_t* options, const activation_callbacks_t* callbacks, void* user_data)
+{
+	if (session == NULL) {
+		return ACTIVATION_E_INVALID_ARG;
+	}
+	*session = NULL;
+
+	activation_session_t s = calloc(1, sizeof(activation_session_private));
+	if (s == NULL) {
+		return ACTIVATION_E_NO_MEMORY;
+	}
+
+	s->uuid = session_strdup(uuid);
+	if (callbacks != NULL) {
+		s->callbacks = *callbacks;
+	}
+	s->user_data = user_data;
+
+	if (options != NULL) {
+		s->cache_mode = options->cache_mode;
+		s->imei = session_strdup(options->imei);
+		s->imsi = session_strdup(options->imsi);
+		s->iccid = session_strdup(options->iccid);
+		s->serial_number = session_strdup(options->serial_number);
+		s->cancel = options->cancel;
+		s->reconcile = options->reconcile;
+
+		if (s->cache_mode != ACTIVATION_CACHE_NONE) {
+			if (options->cache_dir == NULL) {
+				activation_session_free(s);
+				return ACTIVATION_E_INVALID_ARG;
+			}
+			session_enter(s);
+			s->cache = cache_open(options->cache_dir);
+			session_leave(s);
+			if (s->cache == NULL) {
+				activation_session_free(s);
+				return ACTIVATION_E_CACHE_FAILED;
+			}
+		}
+	}
+
+	s->http = http_acquire();
+	if (s->http == NULL || arena_init(&s->arena, ARENA_DEFAULT_CHUNK) != 0) {
+		activation_session_free(s);
+		return ACTIVATION_E_NO_MEMORY;
+	}
+
+	*session = s;
+	return ACTIVATION_E_SUCCESS;
+}
+
+/* Drops the pooled lockdownd session and the cached properties of a device
+ * that went away */
+void activation_forget_device(const char* uuid)
+{
+	if (uuid != NULL) {
+		device_pool_evict(uuid);
+		props_invalidate(uuid);
+	}
+}
+
+void activation_session_free(activation_session_t session)
+{
+	if (session == NULL) {
+		return;
+	}
+
+	activate_discard(session);
+	arena_free(&session->arena);
+	release_device(session->uuid, session->link, !session->broken);
+	cache_close(session->cache);
+	http_release(session->http);
+	free(session->uuid);
+	free(session->imei);
+	free(session->imsi);
+	free(session->iccid);
+	free(session->serial_number);
+	free(session);
+}
+
+const char* activation_session_get_uuid(activation_session_t session)
+{
+	return session->uuid;
+}
+
+/* Connects on first use, every call below goes through here. */
+static activation_error_t session_connect(activation_session_t session)
+{
+	if (session->link != NULL) {
+		return ACTIVATION_E_SUCCESS;
+	}
+
+	session_stage(session, ACTIVATION_STAGE_CONNECTING);
+	if (connect_device(session->uuid, &session->link) != 0) {
+		return ACTIVATION_E_NO_DEVICE;
+	}
+
+	/* everything after this is keyed by UUID, so find out which device we got */
+	if (session->uuid == NULL) {
+		session->uuid = device_transport_current->get_uuid(session->link);
+	}
+
+	if (session->cache_mode == ACTIVATION_CACHE_READ && check_cache(session->cache, session->link, session->uuid) != 0) {
+		error("The selected cache does not match this device :(");
+		return ACTIVATION_E_CACHE_MISMATCH;
+	}
+
+	return ACTIVATION_E_SUCCESS;
+}
+
+/* With reconcile set, a device already in the state a call would leave it
+ * in is left alone. Reading ActivationState is one cheap lockdownd query,
+ * against a request to the activation server and a round of device I/O. A
+ * state that can't be read means doing the work, as without reconcile. */
+static int session_reconciled(activation_session_t session, int activate)
+{
+	char m[128];
+	int done = 0;
+
+	if (!session->reconcile) {
+		return 0;
+	}
+
+	TRACE_BEGIN(state_start);
+	char* state = props_activation_state(session->link, session->uuid);
+	TRACE_END("activation_state", state_start);
+	if (state == NULL) {
+		return 0;
+	}
+
+	if (activate) {
+		done = (!strcmp(state, "Activated") || !strcmp(state, "FactoryActivated"));
+	} else {
+		done = !strcmp(state, "Unactivated");
+	}
+
+	if (done) {
+		snprintf(m, sizeof(m), "Device is already %s, nothing to do", state);
+		task(m);
+		session_stage(session, ACTIVATION_STAGE_SKIPPED);
+	}
+	free(state);
+	return done;
+}
+
+activation_error_t activation_session_connect(activation_session_t session)
+{
+	session_enter(session);
+	activation_error_t err = session_connect(session);
+	session_leave(session);
+	return err;
+}
+
+activation_error_t activation_session_fetch_record(activation_session_t session, plist_t* record)
+{
+	session_enter(session);
+	activation_error_t err = session_connect(session);
+	if (err == ACTIVATION_E_SUCCESS) {
+		int res = activate_fetch_record(session, record);
+		if (res < 0) {
+			error("Unable to fetch activation request");
+			err = ACTIVATION_E_FETCH_FAILED;
+		} else if (res > 0) {
+			err = ACTIVATION_E_QUEUED;
+		}
+	}
+	session_leave(session);
+	return err;
+}
+
+activation_error_t activation_session_activate(activation_session_t session, plist_t record)
+{
+	session_enter(session);
+	activation_error_t err = session_connect(session);
+	if (err == ACTIVATION_E_SUCCESS && !session_reconciled(session, 1)) {
+		if (do_activation(session, record) != 0) {
+			err = ACTIVATION_E_ACTIVATE_FAILED;
+		}
+		props_invalidate(session->uuid);
+	}
+	session_result(session, err);
+	session_leave(session);
+	return err;
+}
+
+activation_error_t session_deactivate(activation_session_t session)
+{
+	session_begin(session);
+	activation_error_t err = session_connect(session);
+	if (err == ACTIVATION_E_SUCCESS && !session_reconciled(session, 0)) {
+		if (deactivate_device(session) != 0) {
+			err = ACTIVATION_E_DEACTIVATE_FAILED;
+		}
+		props_invalidate(session->uuid);
+	}
+	return err;
+}
+
+activation_error_t activation_session_deactivate(activation_session_t session)
+{
+	session_enter(session);
+	activation_error_t err = session_deactivate(session);
+	session_done(session, err);
+	session_leave(session);
+	return err;
+}
+
+/* The whole dance, in two halves either side of the HTTP transfer so that an
+ * event loop can drive the transfer instead (see engine.c). session_start()
+ * uses a stored record if there is one (and nothing on the command line says
+ * otherwise), setting *finished; if not, it leaves a request ready to go on
+ * session->http. The cancel flag is checked between stages. */
+activation_error_t session_start(activation_session_t session, int* finished)
+{
+	activation_error_t err = session_query(session, finished);
+	if (err != ACTIVATION_E_SUCCESS || *finished) {
+		return err;
+	}
+	return session_build(session);
+}
+
+activation_error_t session_finish(activation_session_t session, CURLcode res)
+{
+	plist_t record = NULL;
+
+	activation_error_t err = session_parse(session, res, &record);
+	if (err != ACTIVATION_E_SUCCESS) {
+		return err;
+	}
+
+	err = session_activate(session, record);
+	plist_free(record);
+	return err;
+}
+
+/* session_start() and session_finish() are each two of the steps below, which
+ * the pipeline (see pipeline.c) runs on separate worker pools: query and
+ * activate talk to the device, build and parse only use the CPU. */
+activation_error_t session_query(activation_session_t session, int* finished)
+{
+	*finished = 0;
+
+	session_begin(session);
+	activation_error_t err = session_connect(session);
+	if (err != ACTIVATION_E_SUCCESS) {
+		return err;
+	}
+
+	if (session_cancelled(session)) {
+		return ACTIVATION_E_CANCELLED;
+	}
+
+	if (session_reconciled(session, 1)) {
+		*finished = 1;
+		return ACTIVATION_E_SUCCESS;
+	}
+
+	if (records_enabled() && session->imei == NULL && session->imsi == NULL && session->iccid == NULL && session->serial_number == NULL) {
+		int res = activate_from_store(session);
+		props_invalidate(session->uuid);
+		if (res == 0) {
+			*finished = 1;
+			return ACTIVATION_E_SUCCESS;
+		}
+	}
+
+	task("Creating activation request");
+	if (activate_query(session) < 0) {
+		error("Unable to fetch activation request");
+		return ACTIVATION_E_FETCH_FAILED;
+	}
+
+	return ACTIVATION_E_SUCCESS;
+}
+
+/* While the server is known to be out of reach the request goes straight
+ * to the spool, so the device side doesn't wait out a timeout per device. */
+activation_error_t session_build(activation_session_t session)
+{
+	if (activate_build(session) < 0) {
+		error("Unable to fetch activation request");
+		return ACTIVATION_E_FETCH_FAILED;
+	}
+	if (spool_offline()) {
+		return (activate_spool(session) > 0) ? ACTIVATION_E_QUEUED : ACTIVATION_E_FETCH_FAILED;
+	}
+	return ACTIVATION_E_SUCCESS;
+}
+
+activation_error_t session_parse(activation_session_t session, CURLcode res, plist_t* record)
+{
+	/* a request given up on for a removed device isn't worth spooling */
+	if (session_cancelled(session)) {
+		return ACTIVATION_E_CANCELLED;
+	}
+
+	int ret = activate_complete(session, res, record);
+	if (ret < 0) {
+		error("Unable to fetch activation request");
+		return ACTIVATION_E_FETCH_FAILED;
+	}
+	return (ret > 0) ? ACTIVATION_E_QUEUED : ACTIVATION_E_SUCCESS;
+}
+
+/* Sends a record from session_parse() to the device; the caller still owns
+ * the record. */
+activation_error_t session_activate(activation_session_t session, plist_t record)
+{
+	if (session_cancelled(session)) {
+		return ACTIVATION_E_CANCELLED;
+	}
+
+	int ret = do_activation(session, record);
+	props_invalidate(session->uuid);
+
+	return (ret == 0) ? ACTIVATION_E_SUCCESS : ACTIVATION_E_ACTIVATE_FAILED;
+}
+
+activation_error_t activation_session_run(activation_session_t session)
+{
+	int finished = 0;
+
+	session_enter(session);
+	activation_error_t err = session_start(session, &finished);
+	if (err == ACTIVATION_E_SUCCESS && !finished) {
+		CURLcode res = http_perform(session->http, &session->request.response, session->cancel);
+		err = session_finish(session, res);
+	}
+	session_done(session, err);
+	session_leave(session);
+	return err;
+}
+
+const char* activation_strerror(activation_error_t err)
+{
+	switch (err) {
+	case ACTIVATION_E_SUCCESS:
+		return "success";
+	case ACTIVATION_E_INVALID_ARG:
+		return "invalid argument";
+	case ACTIVATION_E_NO_MEMORY:
+		return "out of memory";
+	case ACTIVATION_E_NO_DEVICE:
+		return "unable to connect";
+	case ACTIVATION_E_CACHE_FAILED:
+		return "unable to open the cache";
+	case ACTIVATION_E_CACHE_MISMATCH:
+		return "not in the selected cache";
+	case ACTIVATION_E_FETCH_FAILED:
+		return "unable to fetch activation record";
+	case ACTIVATION_E_ACTIVATE_FAILED:
+		return "activation failed";
+	case ACTIVATION_E_DEACTIVATE_FAILED:
+		return "deactivation failed";
+	case ACTIVATION_E_CANCELLED:
+		return "cancelled, device removed";
+	case ACTIVATION_E_QUEUED:
+		return "queued, activates once the server can be reached";
+	default:
+		return "unknown error";
+	}
+}
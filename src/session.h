@@ -0,0 +1,81 @@
+/*
+ * session.h
+ * What a library session carries around, for the code behind the public API.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <curl/curl.h>
+
+#include "libideviceactivate.h"
+#include "arena.h"
+#include "buffer.h"
+#include "props.h"
+#include "response.h"
+#include "store.h"
+#include "transport.h"
+
+/* A POST on its way to being built on the session's curl handle, from the
+ * property snapshot it's made of to the response, see activate.c */
+typedef struct {
+	device_props* props;
+	plist_t cached;
+	buffer_t body;        /* the whole multipart body, curl sends it in place */
+	activate_response response;
+	int pending;
+} activation_request;
+
+struct activation_session_private {
+	char* uuid;
+	device_link* link;
+	store_t* cache;
+	CURL* http;
+	activation_request request;
+	arena_t arena;  /* everything one request allocates, reset once it's done */
+
+	activation_cache_mode_t cache_mode;
+	char* imei;
+	char* imsi;
+	char* iccid;
+	char* serial_number;
+	volatile int* cancel;
+	int reconcile;
+	int broken;  /* something went wrong on the device side, don't pool its connection */
+	int started; /* counted in the metrics already */
+
+	activation_callbacks_t callbacks;
+	void* user_data;
+};
+
+extern void session_enter(activation_session_t session);
+extern void session_leave(activation_session_t session);
+extern void session_stage(activation_session_t session, activation_stage_t stage);
+extern void session_done(activation_session_t session, activation_error_t result);
+
+extern activation_error_t session_start(activation_session_t session, int* finished);
+extern activation_error_t session_finish(activation_session_t session, CURLcode res);
+
+extern activation_error_t session_query(activation_session_t session, int* finished);
+extern activation_error_t session_build(activation_session_t session);
+extern activation_error_t session_parse(activation_session_t session, CURLcode res, plist_t* record);
+extern activation_error_t session_activate(activation_session_t session, plist_t record);
+extern activation_error_t session_deactivate(activation_session_t session);
+
+#endif
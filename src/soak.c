@@ -0,0 +1,258 @@
+/*
+ * soak.c
+ * Runs the activation path over and over with a simulated device and server
+ * and fails if memory use keeps growing, for daemons that never restart.
+ *
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <plist/plist.h>
+
+#include "libideviceactivate.h"
+#include "activate.h"
+#include "buffer.h"
+#include "idevice.h"
+#include "props.h"
+#include "response.h"
+#include "session.h"
+
+#define SOAK_ACTIVATIONS 100000
+#define SOAK_WARMUP 5000           /* let the allocator and caches settle first */
+#define SOAK_SAMPLE 10000
+#define SOAK_SESSION_USES 50       /* activations per session before a new one */
+#define SOAK_DEVICES 2000          /* simulated devices the sessions rotate through */
+#define SOAK_ABANDONED 3           /* every third device goes away after its query */
+#define SOAK_PROPS_TTL 1           /* seconds, so those snapshots expire well within a run */
+#define SOAK_MAX_GROWTH_KB 1024
+#define SOAK_RESPONSE_CHUNK 1400   /* about what one TCP segment hands curl */
+
+static long rss_kb()
+{
+	char line[256];
+	long value = -1;
+
+	FILE* f = fopen("/proc/self/status", "r");
+	if (f == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			value = atol(line + 6);
+			break;
+		}
+	}
+	fclose(f);
+	return value;
+}
+
+static plist_t new_blob(size_t length, uint32_t seed)
+{
+	char* data = malloc(length);
+	size_t i = 0;
+	for (i = 0; i < length; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (char)(seed >> 16);
+	}
+	plist_t node = plist_new_data(data, length);
+	free(data);
+	return node;
+}
+
+/* What the server would have sent back */
+static char* soak_response(size_t* length)
+{
+	char* xml = NULL;
+	uint32_t xml_length = 0;
+	buffer_t body;
+
+	plist_t record = plist_new_dict();
+	plist_dict_set_item(record, "AccountToken", new_blob(8192, 5));
+	plist_dict_set_item(record, "DeviceCertificate", new_blob(2048, 7));
+	plist_dict_set_item(record, "unbrick", plist_new_bool(1));
+	plist_t activation = plist_new_dict();
+	plist_dict_set_item(activation, "activation-record", record);
+	plist_t ticket = plist_new_dict();
+	plist_dict_set_item(ticket, "iphone-activation", activation);
+	plist_to_xml(ticket, &xml, &xml_length);
+	plist_free(ticket);
+
+	buffer_init(&body, xml_length + 1024);
+	buffer_append_str(&body, "<html><head><script id=\"protocol\" type=\"text/x-apple-plist\">");
+	buffer_append(&body, xml, xml_length);
+	buffer_append_str(&body, "</script></head><body></body></html>\n");
+	free(xml);
+
+	*length = body.length;
+	return body.data;
+}
+
+static void soak_quiet(activation_session_t session, int is_error, const char* message, void* user_data)
+{
+}
+
+/* One activation, from the property snapshot of a simulated device to the
+ * parsed record, with the transfer played back from reply. Every so often the
+ * server times out or answers 503 instead, so the error paths get soaked as
+ * well. Only a record that made it gets its snapshot invalidated, as
+ * session.c does once it's on the device; the rest have to expire. */
+static int soak_activation(activation_session_t session, const char* uuid, const char* reply, size_t length, unsigned long n)
+{
+	activation_request* request = &session->request;
+	CURLcode res = CURLE_OK;
+	plist_t record = NULL;
+	size_t i = 0;
+	int finished = 0;
+
+	if (session_query(session, &finished) != ACTIVATION_E_SUCCESS || finished) {
+		return -1;
+	}
+
+	/* unplugged before the request was even built */
+	if (n % SOAK_SESSION_USES == SOAK_SESSION_USES - 1 && (n / SOAK_SESSION_USES) % SOAK_ABANDONED == 0) {
+		return 0;
+	}
+
+	if (activate_build(session) != 0) {
+		return -1;
+	}
+
+	if (n % 10 == 3) {
+		res = CURLE_OPERATION_TIMEDOUT;
+	} else {
+		for (i = 0; i < length; i += SOAK_RESPONSE_CHUNK) {
+			size_t chunk = (length - i < SOAK_RESPONSE_CHUNK) ? length - i : SOAK_RESPONSE_CHUNK;
+			response_write_callback((char*)reply + i, 1, chunk, &request->response);
+		}
+		request->response.status = (n % 10 == 7) ? 503 : 200;
+	}
+
+	int ret = activate_complete(session, res, &record);
+	if (record != NULL) {
+		plist_free(record);
+		props_invalidate(uuid);
+	}
+	return (n % 10 == 3 || n % 10 == 7) ? (ret != 0 ? 0 : -1) : ret;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [-n COUNT]\n", name);
+	printf("Runs COUNT simulated activations (default %d) and fails if RSS grows\n", SOAK_ACTIVATIONS);
+	printf("by more than %d KB after the first %d.\n\n", SOAK_MAX_GROWTH_KB, SOAK_WARMUP);
+	printf("  -n COUNT\tnumber of activations\n");
+	printf("  -h\t\tprints usage information\n");
+}
+
+int main(int argc, char* argv[])
+{
+	activation_callbacks_t callbacks = { NULL, soak_quiet, NULL, NULL };
+	activation_session_t session = NULL;
+	unsigned long count = SOAK_ACTIVATIONS;
+	unsigned long n = 0;
+	unsigned long failed = 0;
+	long baseline = -1;
+	long peak = 0;
+	size_t length = 0;
+	char uuid[41];
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "hn:")) > 0) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : -1;
+		}
+	}
+
+	activation_virtual_config_t devices;
+	activation_virtual_defaults(&devices);
+	devices.count = SOAK_DEVICES;
+	devices.connect_ms = 0;
+	devices.handshake_ms = 0;
+	devices.query_ms = 0;
+	devices.activation_info_ms = 0;
+	devices.activate_ms = 0;
+
+	if (activation_init() != 0 || activation_use_virtual_devices(&devices) != 0) {
+		return -1;
+	}
+	props_set_ttl(SOAK_PROPS_TTL);
+	char* reply = soak_response(&length);
+
+	for (n = 0; n < count; n++) {
+		if (n % SOAK_SESSION_USES == 0) {
+			if (session != NULL) {
+				activation_session_free(session);
+				/* the device is unplugged: its link goes, but nothing tells
+				 * the property cache, so its snapshot has to expire */
+				device_pool_evict(uuid);
+			}
+			snprintf(uuid, sizeof(uuid), "%040lx", (n / SOAK_SESSION_USES) % SOAK_DEVICES + 1);
+			if (activation_session_new(&session, uuid, NULL, &callbacks, NULL) != ACTIVATION_E_SUCCESS) {
+				fprintf(stderr, "Unable to create a session\n");
+				return -1;
+			}
+		}
+
+		session_enter(session);
+		if (soak_activation(session, uuid, reply, length, n) != 0) {
+			failed++;
+		}
+		session_leave(session);
+
+		if (n + 1 == SOAK_WARMUP) {
+			baseline = rss_kb();
+		}
+		if ((n + 1) % SOAK_SAMPLE == 0 || n + 1 == count) {
+			long rss = rss_kb();
+			if (rss > peak) {
+				peak = rss;
+			}
+			printf("{\"soak\":\"activations\",\"done\":%lu,\"failed\":%lu,\"rss_kb\":%ld}\n", n + 1, failed, rss);
+			fflush(stdout);
+		}
+	}
+
+	activation_session_free(session);
+	free(reply);
+	activation_cleanup();
+
+	long growth = (baseline >= 0) ? peak - baseline : 0;
+	printf("{\"soak\":\"result\",\"activations\":%lu,\"failed\":%lu,\"rss_baseline_kb\":%ld,\"rss_peak_kb\":%ld,\"rss_growth_kb\":%ld,\"limit_kb\":%d}\n",
+		count, failed, baseline, peak, growth, SOAK_MAX_GROWTH_KB);
+
+	if (failed > 0) {
+		fprintf(stderr, "%lu simulated activation(s) didn't go as expected\n", failed);
+		return 1;
+	}
+	if (growth > SOAK_MAX_GROWTH_KB) {
+		fprintf(stderr, "RSS grew by %ld KB over the run, more than the %d KB allowed\n", growth, SOAK_MAX_GROWTH_KB);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,915 @@
+/*
+ * spool.c
+ * Store and forward for activation requests: whatever the device side
+ * produced while the server was out of reach is journaled here and sent
+ * once it is back, and the devices still attached get their records.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <curl/curl.h>
+#include <plist/plist.h>
+
+#include "libideviceactivate.h"
+#include "form.h"
+#include "http.h"
+#include "records.h"
+#include "response.h"
+#include "spool.h"
+#include "transport.h"
+#include "util.h"
+
+/*
+ * File layout: entries, only ever appended.
+ *
+ *   QUEUED   id, UUID, boundary, request body     device side done, not sent
+ *   FETCHED  id, UUID, record                     sent, device not activated yet
+ *   DONE     id, UUID                             nothing left to do
+ *
+ * An id's newest entry says where it stands. Each append is on disk
+ * (fdatasync) before the caller hears back, and appends that come in while
+ * one sync is running share the next one. A crash can only leave a torn
+ * entry at the very end, which fails its checksum and is cut off on the
+ * next open. Once nothing is left in it the file is truncated to nothing.
+ */
+
+#define SPOOL_MAGIC 0x314c5053 /* "SPL1" */
+#define SPOOL_QUEUED 1
+#define SPOOL_FETCHED 2
+#define SPOOL_DONE 3
+
+typedef struct {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t id;
+	uint32_t uuid_length;
+	uint32_t meta_length;
+	uint32_t data_length;
+	uint32_t checksum;  /* of everything after the header */
+} spool_record;
+
+/* What's still to do for one request. The payload stays in the file. */
+typedef struct spool_entry {
+	uint64_t id;
+	char* uuid;
+	char* boundary;     /* of the body, which another process may have built */
+	int fetched;        /* the payload is the record rather than the request */
+	uint64_t offset;    /* of the payload in the file */
+	uint32_t length;
+	uint64_t next_try;  /* ms, for a record whose device wasn't there */
+	int busy;           /* in the flusher's hands */
+	struct spool_entry* next;
+} spool_entry;
+
+/* One request of a batch on its way to the server */
+typedef struct {
+	spool_entry* entry;
+	char* body;
+	CURL* handle;
+	struct curl_slist* headers;
+	activate_response response;
+	http_request request;
+	int started;
+	int settled;
+	plist_t record;
+} spool_send;
+
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spool_synced_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spool_changed = PTHREAD_COND_INITIALIZER;
+static int spool_fd = -1;
+static char* spool_dir = NULL;
+static uint64_t spool_end = 0;      /* written */
+static uint64_t spool_synced = 0;   /* and on disk */
+static int spool_syncing = 0;
+static int spool_writers = 0;
+static uint64_t spool_next_id = 1;
+
+static spool_entry* spool_head = NULL;
+static spool_entry* spool_tail = NULL;
+static int spool_count = 0;
+
+static int spool_is_offline = 0;     /* written under spool_lock, read without it */
+static uint64_t spool_retry_at = 0;
+static volatile int spool_stopping = 0;
+static int spool_running = 0;
+static pthread_t spool_flusher_thread;
+
+static unsigned long spool_queued = 0;
+static unsigned long spool_sent = 0;
+static unsigned long spool_activated = 0;
+static unsigned long spool_dropped = 0;
+
+static uint64_t spool_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t spool_checksum(const char* data, size_t length)
+{
+	uint32_t hash = 0x811c9dc5;
+	size_t i = 0;
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)data[i]) * 0x01000193;
+	}
+	return hash;
+}
+
+static spool_entry* spool_find(uint64_t id)
+{
+	spool_entry* entry = NULL;
+	for (entry = spool_head; entry != NULL; entry = entry->next) {
+		if (entry->id == id) {
+			break;
+		}
+	}
+	return entry;
+}
+
+static void spool_link(spool_entry* entry)
+{
+	entry->next = NULL;
+	if (spool_tail != NULL) {
+		spool_tail->next = entry;
+	} else {
+		spool_head = entry;
+	}
+	spool_tail = entry;
+	spool_count++;
+}
+
+static void spool_unlink(spool_entry* entry)
+{
+	spool_entry** link = &spool_head;
+	spool_entry* prev = NULL;
+
+	while (*link != NULL && *link != entry) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+	if (*link == NULL) {
+		return;
+	}
+	*link = entry->next;
+	if (spool_tail == entry) {
+		spool_tail = prev;
+	}
+	spool_count--;
+}
+
+static void spool_entry_free(spool_entry* entry)
+{
+	free(entry->uuid);
+	free(entry->boundary);
+	free(entry);
+}
+
+/* Writes one entry and waits until it's on disk. Whoever finds no sync
+ * running starts one for everything written so far; the rest wait for it.
+ * *offset gets where the payload landed. A queued entry is put on the list
+ * before the lock is let go, as spool_compact() could otherwise cut it off
+ * the file in between. */
+static int spool_append(uint32_t type, uint64_t id, const char* uuid, const char* meta, const char* data, uint32_t length, uint64_t* offset, spool_entry* queued)
+{
+	spool_record header;
+	struct iovec iov[4];
+
+	header.magic = SPOOL_MAGIC;
+	header.type = type;
+	header.id = id;
+	header.uuid_length = strlen(uuid);
+	header.meta_length = (meta != NULL) ? strlen(meta) : 0;
+	header.data_length = length;
+
+	/* the checksum runs over the three parts as if they were one */
+	uint32_t hash = 0x811c9dc5;
+	const char* parts[] = { uuid, meta, data };
+	size_t lengths[] = { header.uuid_length, header.meta_length, length };
+	size_t total = sizeof(header);
+	int i = 0;
+	size_t j = 0;
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < lengths[i]; j++) {
+			hash = (hash ^ (unsigned char)parts[i][j]) * 0x01000193;
+		}
+		iov[i + 1].iov_base = (void*)parts[i];
+		iov[i + 1].iov_len = lengths[i];
+		total += lengths[i];
+	}
+	header.checksum = hash;
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+
+	pthread_mutex_lock(&spool_lock);
+	uint64_t at = spool_end;
+	ssize_t written = pwritev(spool_fd, iov, 4, at);
+	if (written != (ssize_t)total) {
+		/* nothing after a partial entry would ever be read back */
+		if (ftruncate(spool_fd, at) != 0) {
+			error("Unable to repair the spool");
+		}
+		pthread_mutex_unlock(&spool_lock);
+		error("Unable to write to the spool");
+		return -1;
+	}
+	spool_end += total;
+	spool_writers++;
+
+	uint64_t mine = spool_end;
+	int res = 0;
+	while (spool_synced < mine && res == 0) {
+		if (spool_syncing) {
+			pthread_cond_wait(&spool_synced_cond, &spool_lock);
+			continue;
+		}
+		spool_syncing = 1;
+		uint64_t target = spool_end;
+		pthread_mutex_unlock(&spool_lock);
+		res = fdatasync(spool_fd);
+		pthread_mutex_lock(&spool_lock);
+		spool_syncing = 0;
+		if (res == 0) {
+			spool_synced = target;
+		}
+		pthread_cond_broadcast(&spool_synced_cond);
+	}
+	uint64_t payload = at + sizeof(header) + header.uuid_length + header.meta_length;
+	if (res == 0 && queued != NULL) {
+		queued->offset = payload;
+		queued->length = length;
+		spool_link(queued);
+	}
+	spool_writers--;
+	pthread_mutex_unlock(&spool_lock);
+
+	if (res != 0) {
+		error("Unable to sync the spool");
+		return -1;
+	}
+	if (offset != NULL) {
+		*offset = payload;
+	}
+	return 0;
+}
+
+/* Nothing is left to do, so nothing in the file is worth keeping. Only when
+ * no append is in progress; called with spool_lock held. */
+static void spool_compact()
+{
+	if (spool_count > 0 || spool_writers > 0 || spool_syncing || spool_end == 0) {
+		return;
+	}
+	if (ftruncate(spool_fd, 0) == 0) {
+		fdatasync(spool_fd);
+		spool_end = 0;
+		spool_synced = 0;
+	}
+}
+
+/* Reads the file back into entries. A torn entry at the end (from a crash
+ * mid-write) is cut off; nothing before it was ever acknowledged. */
+static int spool_recover()
+{
+	struct stat st;
+	spool_record header;
+	uint64_t offset = 0;
+	uint64_t max_id = 0;
+
+	if (fstat(spool_fd, &st) != 0) {
+		return -1;
+	}
+
+	while (offset + sizeof(header) <= (uint64_t)st.st_size) {
+		if (pread(spool_fd, &header, sizeof(header), offset) != sizeof(header)) {
+			break;
+		}
+		if (header.magic != SPOOL_MAGIC || header.type < SPOOL_QUEUED || header.type > SPOOL_DONE ||
+			header.uuid_length == 0 || header.uuid_length > 64 || header.meta_length > 128 || header.data_length > SPOOL_MAX_ENTRY) {
+			break;
+		}
+		size_t length = header.uuid_length + header.meta_length + header.data_length;
+		if (offset + sizeof(header) + length > (uint64_t)st.st_size) {
+			break;
+		}
+
+		/* the payload itself stays on disk, only the small parts are kept */
+		char* parts = malloc(length + 1);
+		if (parts == NULL || pread(spool_fd, parts, length, offset + sizeof(header)) != (ssize_t)length ||
+			spool_checksum(parts, length) != header.checksum) {
+			free(parts);
+			break;
+		}
+
+		uint64_t data_offset = offset + sizeof(header) + header.uuid_length + header.meta_length;
+		spool_entry* entry = spool_find(header.id);
+		if (header.type == SPOOL_QUEUED && entry == NULL) {
+			entry = calloc(1, sizeof(spool_entry));
+			if (entry == NULL) {
+				free(parts);
+				return -1;
+			}
+			entry->id = header.id;
+			entry->uuid = strndup(parts, header.uuid_length);
+			entry->boundary = strndup(parts + header.uuid_length, header.meta_length);
+			entry->offset = data_offset;
+			entry->length = header.data_length;
+			spool_link(entry);
+		} else if (header.type == SPOOL_FETCHED && entry != NULL) {
+			entry->fetched = 1;
+			entry->offset = data_offset;
+			entry->length = header.data_length;
+		} else if (header.type == SPOOL_DONE && entry != NULL) {
+			spool_unlink(entry);
+			spool_entry_free(entry);
+		}
+		free(parts);
+
+		if (header.id > max_id) {
+			max_id = header.id;
+		}
+		offset += sizeof(header) + length;
+	}
+
+	if (offset < (uint64_t)st.st_size) {
+		char m[128];
+		snprintf(m, sizeof(m), "Dropped %llu byte(s) of an unfinished entry at the end of the spool",
+			(unsigned long long)(st.st_size - offset));
+		info(m);
+		if (ftruncate(spool_fd, offset) != 0 || fdatasync(spool_fd) != 0) {
+			return -1;
+		}
+	}
+
+	spool_end = offset;
+	spool_synced = offset;
+	spool_next_id = max_id + 1;
+	return 0;
+}
+
+static void spool_set_offline(int offline)
+{
+	char m[256];
+
+	if (spool_is_offline == offline) {
+		return;
+	}
+	__atomic_store_n(&spool_is_offline, offline, __ATOMIC_RELAXED);
+	if (offline) {
+		snprintf(m, sizeof(m), "The activation server can't be reached, activation requests go to the spool in %s", spool_dir);
+	} else {
+		snprintf(m, sizeof(m), "The activation server is back, sending the %d request(s) in the spool", spool_count);
+	}
+	info(m);
+}
+
+static void spool_finish(spool_entry* entry)
+{
+	/* not writing it down only means doing the work again next time */
+	spool_append(SPOOL_DONE, entry->id, entry->uuid, NULL, NULL, 0, NULL, NULL);
+
+	pthread_mutex_lock(&spool_lock);
+	spool_unlink(entry);
+	spool_compact();
+	pthread_cond_broadcast(&spool_changed);
+	pthread_mutex_unlock(&spool_lock);
+	spool_entry_free(entry);
+}
+
+static int spool_fetched(spool_entry* entry, plist_t record)
+{
+	char* xml = NULL;
+	uint32_t length = 0;
+	uint64_t offset = 0;
+
+	plist_to_xml(record, &xml, &length);
+	if (xml == NULL) {
+		return -1;
+	}
+	int res = spool_append(SPOOL_FETCHED, entry->id, entry->uuid, NULL, xml, length, &offset, NULL);
+	free(xml);
+	if (res != 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&spool_lock);
+	entry->fetched = 1;
+	entry->offset = offset;
+	entry->length = length;
+	pthread_mutex_unlock(&spool_lock);
+	return 0;
+}
+
+static char* spool_read(spool_entry* entry)
+{
+	char* data = malloc(entry->length + 1);
+	if (data == NULL) {
+		return NULL;
+	}
+	if (pread(spool_fd, data, entry->length, entry->offset) != (ssize_t)entry->length) {
+		free(data);
+		return NULL;
+	}
+	data[entry->length] = '\0';
+	return data;
+}
+
+static int spool_send_start(spool_send* send, CURLM* multi)
+{
+	spool_entry* entry = send->entry;
+
+	send->body = spool_read(entry);
+	send->handle = http_acquire();
+	if (send->body == NULL || send->handle == NULL || response_init(&send->response, RESPONSE_DEFAULT_LIMIT) != 0 ||
+		form_headers_for(entry->boundary, &send->headers) != 0) {
+		return -1;
+	}
+
+	CURL* handle = send->handle;
+	if (send->headers != NULL) {
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, send->headers);
+	}
+	curl_easy_setopt(handle, CURLOPT_POSTFIELDS, send->body);
+	curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)entry->length);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &send->response);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &response_write_callback);
+	curl_easy_setopt(handle, CURLOPT_MAXFILESIZE, (long)RESPONSE_DEFAULT_LIMIT);
+	curl_easy_setopt(handle, CURLOPT_URL, http_url());
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, send);
+
+	http_request_init(&send->request, handle, &send->response);
+	return http_request_send(&send->request, multi);
+}
+
+/* Sends every queued request of the batch at once, one attempt each: the
+ * spool is already the retry. Returns 1 if the server was reached by all
+ * of them, 0 if not, with the records found left in each send. */
+static int spool_send_batch(spool_send* sends, int count)
+{
+	CURLMsg* msg = NULL;
+	int running = 0;
+	int left = 0;
+	int pending = 0;
+	int reached = 1;
+	int i = 0;
+
+	CURLM* multi = curl_multi_init();
+	if (multi == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (spool_send_start(&sends[i], multi) == 0) {
+			sends[i].started = 1;
+			pending++;
+		} else {
+			reached = 0;
+		}
+	}
+
+	while (pending > 0 && !spool_stopping) {
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+			spool_send* send = NULL;
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&send);
+			if (http_request_done(&send->request, multi, msg->easy_handle, msg->data.result)) {
+				http_request_finish(&send->request);
+				send->settled = 1;
+				pending--;
+			}
+		}
+		if (pending > 0) {
+			curl_multi_poll(multi, NULL, 0, 250, NULL);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		spool_send* send = &sends[i];
+		if (!send->started) {
+			continue;
+		}
+		if (!send->settled) {
+			/* given up on, the process is going away */
+			curl_multi_remove_handle(multi, send->handle);
+			reached = 0;
+			continue;
+		}
+
+		CURLcode res = send->request.res;
+		long status = send->request.status;
+		if ((res != CURLE_OK && !send->response.overflow) || (res == CURLE_OK && (status == 429 || status >= 500))) {
+			reached = 0;
+			continue;
+		}
+
+		__sync_fetch_and_add(&spool_sent, 1);
+		if (response_get_record(&send->response, &send->record) != 0) {
+			char m[128];
+			snprintf(m, sizeof(m), "The activation server turned down the queued request for %s, dropping it", send->entry->uuid);
+			error(m);
+			__sync_fetch_and_add(&spool_dropped, 1);
+			spool_finish(send->entry);
+			send->entry = NULL;
+			continue;
+		}
+		records_save(send->entry->uuid, send->record);
+		if (spool_fetched(send->entry, send->record) != 0) {
+			plist_free(send->record);
+			send->record = NULL;
+		}
+	}
+
+	curl_multi_cleanup(multi);
+	for (i = 0; i < count; i++) {
+		http_release(sends[i].handle);
+		curl_slist_free_all(sends[i].headers);
+		free(sends[i].body);
+		response_free(&sends[i].response);
+	}
+	return reached;
+}
+
+static int spool_attached(char** devices, int count, const char* uuid)
+{
+	int i = 0;
+	for (i = 0; i < count; i++) {
+		if (!strcmp(devices[i], uuid)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Hands a fetched record to its device if it's attached, the way the tool
+ * would with -f. One that isn't is tried again later. */
+static void spool_deliver(spool_entry* entry, plist_t record, char** devices, int count)
+{
+	activation_session_t session = NULL;
+	plist_t loaded = NULL;
+
+	if (!spool_attached(devices, count, entry->uuid)) {
+		entry->next_try = spool_now() + SPOOL_RETRY_MS;
+		return;
+	}
+
+	if (record == NULL) {
+		char* xml = spool_read(entry);
+		if (xml != NULL) {
+			plist_from_xml(xml, entry->length, &loaded);
+			free(xml);
+		}
+		if (loaded == NULL) {
+			entry->next_try = spool_now() + SPOOL_RETRY_MS;
+			return;
+		}
+		record = loaded;
+	}
+
+	activation_error_t err = activation_session_new(&session, entry->uuid, NULL, NULL, NULL);
+	if (err == ACTIVATION_E_SUCCESS) {
+		err = activation_session_activate(session, record);
+	}
+	activation_session_free(session);
+	if (loaded != NULL) {
+		plist_free(loaded);
+	}
+
+	if (err == ACTIVATION_E_SUCCESS) {
+		char m[128];
+		snprintf(m, sizeof(m), "%s  activated from the spool", entry->uuid);
+		task(m);
+		__sync_fetch_and_add(&spool_activated, 1);
+		spool_finish(entry);
+	} else {
+		entry->next_try = spool_now() + SPOOL_RETRY_MS;
+	}
+}
+
+/* One round: the batch's requests go to the server, then every record in
+ * it (new or from earlier) to its device. */
+static void spool_flush(spool_entry** batch, int count)
+{
+	spool_send sends[SPOOL_BATCH];
+	spool_entry* fetched[SPOOL_BATCH];
+	char** devices = NULL;
+	int attached = 0;
+	int sending = 0;
+	int records = 0;
+	int i = 0;
+
+	memset(sends, 0, sizeof(sends));
+	for (i = 0; i < count; i++) {
+		if (batch[i]->fetched) {
+			fetched[records++] = batch[i];
+		} else {
+			sends[sending++].entry = batch[i];
+		}
+	}
+
+	if (sending > 0) {
+		int reached = spool_send_batch(sends, sending);
+		pthread_mutex_lock(&spool_lock);
+		if (!reached) {
+			spool_retry_at = spool_now() + SPOOL_RETRY_MS;
+		}
+		spool_set_offline(!reached);
+		pthread_mutex_unlock(&spool_lock);
+	}
+
+	if (device_transport_current->list(&devices, &attached) != 0) {
+		devices = NULL;
+		attached = 0;
+	}
+
+	/* a dropped request's entry is gone, spool_finish() freed it */
+	for (i = 0; i < sending; i++) {
+		if (sends[i].entry != NULL && sends[i].entry->fetched) {
+			spool_deliver(sends[i].entry, sends[i].record, devices, attached);
+		}
+		if (sends[i].record != NULL) {
+			plist_free(sends[i].record);
+		}
+	}
+	for (i = 0; i < records; i++) {
+		spool_deliver(fetched[i], NULL, devices, attached);
+	}
+
+	if (devices != NULL) {
+		device_transport_current->list_free(devices);
+	}
+}
+
+/* Picks what can be worked on now: every record whose device is due
+ * another try, and queued requests, up to a batch of them while the server
+ * answers or just one to see if it's back. */
+static int spool_pick(spool_entry** batch)
+{
+	spool_entry* entry = NULL;
+	uint64_t now = spool_now();
+	int limit = SPOOL_BATCH;
+	int count = 0;
+
+	if (spool_is_offline) {
+		limit = (now >= spool_retry_at) ? 1 : 0;
+	}
+
+	for (entry = spool_head; entry != NULL && count < SPOOL_BATCH; entry = entry->next) {
+		if (entry->busy) {
+			continue;
+		}
+		if (entry->fetched ? (entry->next_try > now) : (limit == 0)) {
+			continue;
+		}
+		if (!entry->fetched) {
+			limit--;
+		}
+		entry->busy = 1;
+		batch[count++] = entry;
+	}
+	return count;
+}
+
+static void* spool_flusher(void* arg)
+{
+	spool_entry* batch[SPOOL_BATCH];
+	struct timespec until;
+	int i = 0;
+
+	pthread_mutex_lock(&spool_lock);
+	while (!spool_stopping) {
+		int count = spool_pick(batch);
+		if (count == 0) {
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += 250 * 1000000;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&spool_changed, &spool_lock, &until);
+			continue;
+		}
+
+		pthread_mutex_unlock(&spool_lock);
+		spool_flush(batch, count);
+		pthread_mutex_lock(&spool_lock);
+
+		/* whatever is still in the spool goes back in the pool */
+		spool_entry* entry = NULL;
+		for (entry = spool_head; entry != NULL; entry = entry->next) {
+			for (i = 0; i < count; i++) {
+				if (entry == batch[i]) {
+					entry->busy = 0;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&spool_lock);
+	return NULL;
+}
+
+/* Opens (or creates) dir's spool, picks up whatever an earlier run left
+ * in it and starts sending it. One process per spool. */
+int spool_open(const char* dir)
+{
+	char fname[512];
+	char m[600];
+
+	snprintf(fname, sizeof(fname), "%s/%s", dir, SPOOL_FILE);
+	spool_fd = open(fname, O_RDWR | O_CREAT, 0644);
+	if (spool_fd < 0) {
+		snprintf(m, sizeof(m), "Unable to open the spool %s", fname);
+		error(m);
+		return -1;
+	}
+	if (flock(spool_fd, LOCK_EX | LOCK_NB) != 0) {
+		snprintf(m, sizeof(m), "The spool %s is in use by another process", fname);
+		error(m);
+		close(spool_fd);
+		spool_fd = -1;
+		return -1;
+	}
+
+	spool_dir = strdup(dir);
+	if (spool_dir == NULL || spool_recover() != 0) {
+		error("Unable to read the spool");
+		spool_close();
+		return -1;
+	}
+
+	pthread_mutex_lock(&spool_lock);
+	spool_compact();
+	pthread_mutex_unlock(&spool_lock);
+
+	if (spool_count > 0) {
+		snprintf(m, sizeof(m), "%d activation request(s) left in the spool, sending them", spool_count);
+		info(m);
+	}
+
+	spool_stopping = 0;
+	if (pthread_create(&spool_flusher_thread, NULL, spool_flusher, NULL) != 0) {
+		error("Unable to start the spool flusher");
+		spool_close();
+		return -1;
+	}
+	spool_running = 1;
+	return 0;
+}
+
+/* Stops the flusher. Whatever is still in the spool stays for next time. */
+void spool_close()
+{
+	if (spool_fd < 0) {
+		return;
+	}
+
+	if (spool_running) {
+		pthread_mutex_lock(&spool_lock);
+		spool_stopping = 1;
+		pthread_cond_broadcast(&spool_changed);
+		pthread_mutex_unlock(&spool_lock);
+		pthread_join(spool_flusher_thread, NULL);
+		spool_running = 0;
+	}
+
+	while (spool_head != NULL) {
+		spool_entry* entry = spool_head;
+		spool_head = entry->next;
+		spool_entry_free(entry);
+	}
+	spool_tail = NULL;
+	spool_count = 0;
+	spool_is_offline = 0;
+	spool_end = 0;
+	spool_synced = 0;
+
+	close(spool_fd);
+	spool_fd = -1;
+	free(spool_dir);
+	spool_dir = NULL;
+}
+
+int spool_enabled()
+{
+	return (spool_fd >= 0);
+}
+
+int spool_offline()
+{
+	return (spool_fd >= 0 && __atomic_load_n(&spool_is_offline, __ATOMIC_RELAXED));
+}
+
+int spool_put(const char* uuid, const char* boundary, const char* body, size_t length)
+{
+	if (spool_fd < 0 || uuid == NULL || length > SPOOL_MAX_ENTRY) {
+		return -1;
+	}
+
+	spool_entry* entry = calloc(1, sizeof(spool_entry));
+	if (entry == NULL || (entry->uuid = strdup(uuid)) == NULL || (entry->boundary = strdup(boundary)) == NULL) {
+		if (entry != NULL) {
+			spool_entry_free(entry);
+		}
+		error("Unable to allocate sufficent memory");
+		return -1;
+	}
+
+	pthread_mutex_lock(&spool_lock);
+	entry->id = spool_next_id++;
+	pthread_mutex_unlock(&spool_lock);
+
+	if (spool_append(SPOOL_QUEUED, entry->id, uuid, boundary, body, length, NULL, entry) != 0) {
+		spool_entry_free(entry);
+		return -1;
+	}
+
+	pthread_mutex_lock(&spool_lock);
+	if (!spool_is_offline) {
+		spool_retry_at = spool_now() + SPOOL_RETRY_MS;
+		spool_set_offline(1);
+	}
+	pthread_mutex_unlock(&spool_lock);
+
+	__sync_fetch_and_add(&spool_queued, 1);
+	return 0;
+}
+
+/* Gives the flusher up to timeout_ms to empty the spool, returns how many
+ * requests are still in it. */
+int spool_wait(long timeout_ms)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeout_ms / 1000;
+	until.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&spool_lock);
+	while (spool_count > 0) {
+		if (pthread_cond_timedwait(&spool_changed, &spool_lock, &until) == ETIMEDOUT) {
+			break;
+		}
+	}
+	int count = spool_count;
+	pthread_mutex_unlock(&spool_lock);
+	return count;
+}
+
+/* How many requests are in the spool right now */
+int spool_depth()
+{
+	pthread_mutex_lock(&spool_lock);
+	int count = spool_count;
+	pthread_mutex_unlock(&spool_lock);
+	return count;
+}
+
+void spool_print_stats(FILE* out)
+{
+	if (spool_fd < 0) {
+		return;
+	}
+
+	int count = spool_depth();
+
+	unsigned long queued = __sync_fetch_and_add(&spool_queued, 0);
+	unsigned long sent = __sync_fetch_and_add(&spool_sent, 0);
+	if (queued + sent + count == 0) {
+		return;
+	}
+	fprintf(out, "SPOOL: %lu queued, %lu sent, %lu activated from the spool, %lu dropped, %d still waiting in %s\n",
+		queued, sent, __sync_fetch_and_add(&spool_activated, 0), __sync_fetch_and_add(&spool_dropped, 0), count, spool_dir);
+}
@@ -0,0 +1,50 @@
+/*
+ * spool.h
+ * Activation requests that couldn't reach the server, kept on disk until
+ * they can.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define SPOOL_FILE "spool.db"
+#define SPOOL_BATCH 16          /* requests sent at once when draining */
+#define SPOOL_RETRY_MS 2000     /* between tries while the server is out of reach */
+#define SPOOL_MAX_ENTRY 0x400000
+
+extern int spool_open(const char* dir);
+extern void spool_close();
+extern int spool_enabled();
+
+/* Set from the first request that couldn't be sent until the flusher gets
+ * one through: requests go straight to the spool instead of waiting out
+ * their timeouts and retries. */
+extern int spool_offline();
+
+/* Journals a finished request body for the device, on disk once this returns */
+extern int spool_put(const char* uuid, const char* boundary, const char* body, size_t length);
+
+extern int spool_wait(long timeout_ms);
+extern int spool_depth();
+extern void spool_print_stats(FILE* out);
+
+#endif
@@ -0,0 +1,617 @@
+/*
+ * standin.c
+ * A local stand-in for the activation server, for load testing.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "buffer.h"
+
+#define STANDIN_PORT 8080
+#define STANDIN_RECORD_SIZE 8192
+#define STANDIN_MAX_REQUEST 0x400000   /* far more than any real request */
+
+typedef enum {
+	LATENCY_NONE,
+	LATENCY_FIXED,
+	LATENCY_UNIFORM,
+	LATENCY_EXP,
+	LATENCY_LOGNORMAL
+} latency_kind;
+
+typedef struct {
+	latency_kind kind;
+	double a;
+	double b;
+} latency_t;
+
+typedef struct {
+	int fd;
+	char* data;
+	size_t length;
+	size_t capacity;
+	unsigned int seed;
+} standin_conn;
+
+static latency_t latency = { LATENCY_NONE, 0, 0 };
+static double error_rate = 0.0;
+static int error_status = 503;
+static double drop_rate = 0.0;
+static int verbose = 0;
+
+static char* reply = NULL;            /* the whole 200 answer, built once */
+static size_t reply_length = 0;
+
+static unsigned long served = 0;
+static unsigned long failed = 0;
+static unsigned long dropped = 0;
+static unsigned long rejected = 0;
+static unsigned long connections = 0;
+
+/* ------------------------------------------------------------------ */
+/* what the server answers                                             */
+/* ------------------------------------------------------------------ */
+
+static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* size bytes of noise, base64 encoded in lines the way plist <data> is */
+static int append_blob(buffer_t* out, size_t size, uint32_t seed)
+{
+	char line[80];
+	size_t i = 0;
+	int column = 0;
+	int n = 0;
+
+	for (i = 0; i < size; i += 3) {
+		uint32_t v = 0;
+		int k = 0;
+		for (k = 0; k < 3; k++) {
+			seed = seed * 1103515245 + 12345;
+			v = (v << 8) | ((i + k < size) ? ((seed >> 16) & 0xff) : 0);
+		}
+		line[n++] = base64[(v >> 18) & 0x3f];
+		line[n++] = base64[(v >> 12) & 0x3f];
+		line[n++] = (i + 1 < size) ? base64[(v >> 6) & 0x3f] : '=';
+		line[n++] = (i + 2 < size) ? base64[v & 0x3f] : '=';
+		column += 4;
+		if (column == 68 || i + 3 >= size) {
+			line[n++] = '\n';
+			if (buffer_append_str(out, "\t\t\t") != 0 || buffer_append(out, line, n) != 0) {
+				return -1;
+			}
+			n = 0;
+			column = 0;
+		}
+	}
+	return 0;
+}
+
+/* The same shape albert.apple.com sends: an HTML page with the ticket as a
+ * plist in a script tag. record_size sets the AccountToken's size, which is
+ * most of the answer. */
+static int build_reply(size_t record_size)
+{
+	buffer_t body;
+	char head[256];
+
+	if (buffer_init(&body, record_size * 4 / 3 + 2048) != 0) {
+		return -1;
+	}
+
+	int res = buffer_append_str(&body,
+		"<html><head><script id=\"protocol\" type=\"text/x-apple-plist\">"
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+		"<plist version=\"1.0\">\n<dict>\n"
+		"\t<key>iphone-activation</key>\n\t<dict>\n"
+		"\t\t<key>activation-record</key>\n\t\t<dict>\n"
+		"\t\t\t<key>AccountToken</key>\n\t\t\t<data>\n");
+	res |= append_blob(&body, record_size, 1);
+	res |= buffer_append_str(&body, "\t\t\t</data>\n\t\t\t<key>DeviceCertificate</key>\n\t\t\t<data>\n");
+	res |= append_blob(&body, 1024, 2);
+	res |= buffer_append_str(&body,
+		"\t\t\t</data>\n"
+		"\t\t\t<key>unbrick</key>\n\t\t\t<true/>\n"
+		"\t\t</dict>\n\t\t<key>show-settings</key>\n\t\t<true/>\n"
+		"\t</dict>\n</dict>\n</plist>\n"
+		"</script></head><body></body></html>\n");
+	if (res != 0) {
+		buffer_free(&body);
+		return -1;
+	}
+
+	int head_length = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n", body.length);
+	reply = malloc(head_length + body.length);
+	if (reply == NULL) {
+		buffer_free(&body);
+		return -1;
+	}
+	memcpy(reply, head, head_length);
+	memcpy(reply + head_length, body.data, body.length);
+	reply_length = head_length + body.length;
+	buffer_free(&body);
+	return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* latency and failures                                                */
+/* ------------------------------------------------------------------ */
+
+static double uniform(unsigned int* seed)
+{
+	return (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+}
+
+static double latency_ms(unsigned int* seed)
+{
+	switch (latency.kind) {
+	case LATENCY_FIXED:
+		return latency.a;
+	case LATENCY_UNIFORM:
+		return latency.a + (latency.b - latency.a) * uniform(seed);
+	case LATENCY_EXP:
+		return -latency.a * log(uniform(seed));
+	case LATENCY_LOGNORMAL: {
+		/* Box-Muller, a is the median and b the spread of its log */
+		double z = sqrt(-2.0 * log(uniform(seed))) * cos(2.0 * M_PI * uniform(seed));
+		return latency.a * exp(latency.b * z);
+	}
+	default:
+		return 0;
+	}
+}
+
+/* fixed:MS, uniform:MIN,MAX, exp:MEAN or lognormal:MEDIAN,SIGMA */
+static int parse_latency(const char* spec)
+{
+	const char* value = strchr(spec, ':');
+	if (value == NULL) {
+		return -1;
+	}
+	value++;
+
+	char* end = NULL;
+	latency.a = strtod(value, &end);
+	latency.b = 0;
+	if (*end == ',') {
+		latency.b = strtod(end + 1, &end);
+	}
+	if (*end != '\0' || latency.a < 0 || latency.b < 0) {
+		return -1;
+	}
+
+	if (!strncmp(spec, "fixed:", 6)) {
+		latency.kind = LATENCY_FIXED;
+	} else if (!strncmp(spec, "uniform:", 8) && latency.b >= latency.a) {
+		latency.kind = LATENCY_UNIFORM;
+	} else if (!strncmp(spec, "exp:", 4)) {
+		latency.kind = LATENCY_EXP;
+	} else if (!strncmp(spec, "lognormal:", 10)) {
+		latency.kind = LATENCY_LOGNORMAL;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* HTTP                                                                */
+/* ------------------------------------------------------------------ */
+
+static int send_all(int fd, const char* data, size_t length)
+{
+	while (length > 0) {
+		ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int send_status(int fd, int status, const char* reason)
+{
+	char m[256];
+	int len = snprintf(m, sizeof(m), "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s\n",
+		status, reason, strlen(reason) + 1, reason);
+	return send_all(fd, m, len);
+}
+
+/* Reads more of the connection into c->data, returns 0 once the client has
+ * gone away */
+static ssize_t fill(standin_conn* c)
+{
+	if (c->length == c->capacity) {
+		size_t capacity = c->capacity * 2;
+		if (capacity > STANDIN_MAX_REQUEST) {
+			return -1;
+		}
+		char* data = realloc(c->data, capacity);
+		if (data == NULL) {
+			return -1;
+		}
+		c->data = data;
+		c->capacity = capacity;
+	}
+
+	ssize_t n = 0;
+	do {
+		n = recv(c->fd, c->data + c->length, c->capacity - c->length, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) {
+		c->length += n;
+	}
+	return n;
+}
+
+/* The value of header name in the head (NUL terminated), or NULL */
+static const char* header(const char* head, const char* name, size_t* length)
+{
+	size_t name_length = strlen(name);
+	const char* line = strstr(head, "\r\n");
+
+	while (line != NULL && line[2] != '\r' && line[2] != '\0') {
+		line += 2;
+		const char* next = strstr(line, "\r\n");
+		if (next == NULL) {
+			break;
+		}
+		if (!strncasecmp(line, name, name_length) && line[name_length] == ':') {
+			const char* value = line + name_length + 1;
+			while (*value == ' ' || *value == '\t') {
+				value++;
+			}
+			*length = next - value;
+			return value;
+		}
+		line = next;
+	}
+	return NULL;
+}
+
+/* Just enough of a look at the body to tell an activation request from
+ * anything else: the boundary from the Content-Type, an activation-info part
+ * and the closing delimiter. */
+static int check_form(const char* content_type, size_t type_length, const char* body, size_t length)
+{
+	char boundary[128];
+	char closing[140];
+
+	const char* b = memmem(content_type, type_length, "boundary=", 9);
+	if (strncasecmp(content_type, "multipart/form-data", 19) != 0 || b == NULL) {
+		return -1;
+	}
+	b += 9;
+	size_t boundary_length = type_length - (b - content_type);
+	if (boundary_length == 0 || boundary_length >= sizeof(boundary)) {
+		return -1;
+	}
+	memcpy(boundary, b, boundary_length);
+	boundary[boundary_length] = '\0';
+
+	int closing_length = snprintf(closing, sizeof(closing), "--%s--", boundary);
+	if (memmem(body, length, "name=\"activation-info\"", 22) == NULL || memmem(body, length, closing, closing_length) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Handles one request already at the front of c->data. Returns how many
+ * bytes it took up, 0 if it isn't all there yet, -1 to close. */
+static long handle_request(standin_conn* c)
+{
+	char* end = memmem(c->data, c->length, "\r\n\r\n", 4);
+	size_t length = 0;
+
+	if (end == NULL) {
+		return (c->length >= STANDIN_MAX_REQUEST) ? -1 : 0;
+	}
+	size_t head_length = end - c->data + 4;
+
+	/* make the head a string for the header lookups, the byte is put back */
+	char saved = c->data[head_length - 2];
+	c->data[head_length - 2] = '\0';
+
+	int is_post = !strncmp(c->data, "POST ", 5);
+	int close_after = 0;
+	const char* value = header(c->data, "Connection", &length);
+	if (value != NULL && length == 5 && !strncasecmp(value, "close", 5)) {
+		close_after = 1;
+	}
+	if (header(c->data, "Transfer-Encoding", &length) != NULL) {
+		c->data[head_length - 2] = saved;
+		send_status(c->fd, 411, "Length Required");
+		return -1;
+	}
+	value = header(c->data, "Content-Length", &length);
+	size_t body_length = (value != NULL) ? strtoul(value, NULL, 10) : 0;
+	const char* expect = header(c->data, "Expect", &length);
+	int wants_continue = (expect != NULL && length >= 12 && !strncasecmp(expect, "100-continue", 12));
+	size_t type_length = 0;
+	const char* type = header(c->data, "Content-Type", &type_length);
+	char content_type[256];
+	if (type != NULL && type_length < sizeof(content_type)) {
+		memcpy(content_type, type, type_length);
+		content_type[type_length] = '\0';
+	} else {
+		content_type[0] = '\0';
+		type_length = 0;
+	}
+	c->data[head_length - 2] = saved;
+
+	if (head_length + body_length > STANDIN_MAX_REQUEST) {
+		send_status(c->fd, 413, "Payload Too Large");
+		return -1;
+	}
+	if (c->length < head_length + body_length) {
+		/* asked to, once, before any of the body has arrived */
+		if (wants_continue && c->length == head_length) {
+			send_all(c->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+		}
+		return 0;
+	}
+
+	const char* body = c->data + head_length;
+	if (!is_post || check_form(content_type, type_length, body, body_length) != 0) {
+		__sync_fetch_and_add(&rejected, 1);
+		if (send_status(c->fd, is_post ? 400 : 405, is_post ? "Bad Request" : "Method Not Allowed") != 0) {
+			return -1;
+		}
+		return close_after ? -1 : (long)(head_length + body_length);
+	}
+
+	double wait = latency_ms(&c->seed);
+	if (wait > 0) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)(wait / 1000);
+		ts.tv_nsec = (long)((wait - ts.tv_sec * 1000.0) * 1000000.0);
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+		}
+	}
+
+	double roll = uniform(&c->seed);
+	if (roll < drop_rate) {
+		__sync_fetch_and_add(&dropped, 1);
+		return -1;
+	}
+	if (roll < drop_rate + error_rate) {
+		__sync_fetch_and_add(&failed, 1);
+		if (send_status(c->fd, error_status, "Simulated Error") != 0) {
+			return -1;
+		}
+	} else {
+		__sync_fetch_and_add(&served, 1);
+		if (send_all(c->fd, reply, reply_length) != 0) {
+			return -1;
+		}
+	}
+
+	if (verbose) {
+		fprintf(stderr, "POST %zu bytes, answered after %.1fms\n", body_length, wait);
+	}
+	return close_after ? -1 : (long)(head_length + body_length);
+}
+
+/* One thread per connection, which keeps latency simple: a sleeping request
+ * holds up nothing but its own connection, just like on a real server. */
+static void* connection_main(void* arg)
+{
+	standin_conn* c = (standin_conn*)arg;
+
+	for (;;) {
+		long used = handle_request(c);
+		if (used < 0) {
+			break;
+		}
+		if (used > 0) {
+			memmove(c->data, c->data + used, c->length - used);
+			c->length -= used;
+			continue;
+		}
+		if (fill(c) <= 0) {
+			break;
+		}
+	}
+
+	close(c->fd);
+	free(c->data);
+	free(c);
+	return NULL;
+}
+
+static void* accept_main(void* arg)
+{
+	int server = *(int*)arg;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 0x40000);
+
+	for (;;) {
+		int fd = accept(server, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+				continue;
+			}
+			break;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		standin_conn* c = calloc(1, sizeof(standin_conn));
+		if (c != NULL) {
+			c->capacity = 0x10000;
+			c->data = malloc(c->capacity);
+		}
+		pthread_t thread;
+		if (c == NULL || c->data == NULL) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->fd = fd;
+		c->seed = (unsigned int)(time(NULL) ^ (__sync_add_and_fetch(&connections, 1) * 2654435761u));
+		if (pthread_create(&thread, &attr, connection_main, c) != 0) {
+			close(fd);
+			free(c->data);
+			free(c);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	return NULL;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [OPTIONS]\n", name);
+	printf("Answers activation requests the way the activation server does, for load tests.\n\n");
+	printf("  -p PORT\tport to listen on (default: %d)\n", STANDIN_PORT);
+	printf("  -a ADDRESS\taddress to listen on (default: 127.0.0.1)\n");
+	printf("  -l LATENCY\thow long to take per request, in ms: fixed:MS, uniform:MIN,MAX,\n\t\texp:MEAN or lognormal:MEDIAN,SIGMA (default: answer at once)\n");
+	printf("  -e RATE\tanswer this fraction of requests with an error (default: 0)\n");
+	printf("  -s STATUS\tthe HTTP status of those errors (default: 503)\n");
+	printf("  -x RATE\tclose the connection without answering for this fraction (default: 0)\n");
+	printf("  -r BYTES\tsize of the AccountToken in each record (default: %d)\n", STANDIN_RECORD_SIZE);
+	printf("  -v\t\tprint a line per request\n");
+	printf("  -h\t\tprints usage information\n");
+}
+
+int main(int argc, char* argv[])
+{
+	const char* address = "127.0.0.1";
+	int port = STANDIN_PORT;
+	long record_size = STANDIN_RECORD_SIZE;
+	sigset_t signals;
+	int sig = 0;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "hvp:a:l:e:s:x:r:")) > 0) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+
+		case 'a':
+			address = optarg;
+			break;
+
+		case 'l':
+			if (parse_latency(optarg) != 0) {
+				fprintf(stderr, "Invalid latency %s\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 'e':
+			error_rate = atof(optarg);
+			break;
+
+		case 's':
+			error_status = atoi(optarg);
+			break;
+
+		case 'x':
+			drop_rate = atof(optarg);
+			break;
+
+		case 'r':
+			record_size = atol(optarg);
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : -1;
+		}
+	}
+
+	if (port <= 0 || port > 65535 || error_rate < 0 || drop_rate < 0 || error_rate + drop_rate > 1 || error_status < 100 || error_status > 599 || record_size <= 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (build_reply(record_size) != 0) {
+		fprintf(stderr, "Unable to allocate sufficent memory\n");
+		return -1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address %s\n", address);
+		return -1;
+	}
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, SOMAXCONN) != 0) {
+		fprintf(stderr, "Unable to listen on %s:%d: %s\n", address, port, strerror(errno));
+		return -1;
+	}
+
+	/* block these before any thread exists so only sigwait() ever sees them */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	pthread_t acceptor;
+	if (pthread_create(&acceptor, NULL, accept_main, &server) != 0) {
+		fprintf(stderr, "Unable to start the accept thread\n");
+		return -1;
+	}
+
+	fprintf(stderr, "Listening on http://%s:%d/, reply is %zu bytes\n", address, port, reply_length);
+	sigwait(&signals, &sig);
+
+	fprintf(stderr, "%lu connection(s), %lu request(s) answered, %lu with an error, %lu dropped, %lu rejected\n",
+		connections, served + failed, failed, dropped, rejected);
+	close(server);
+	free(reply);
+	return 0;
+}
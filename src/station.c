@@ -0,0 +1,299 @@
+/*
+ * station.c
+ * Activates every attached device at once, one worker thread per device.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libideviceactivate.h"
+#include "logger.h"
+#include "station.h"
+#include "trace.h"
+#include "transport.h"
+#include "util.h"
+
+typedef struct {
+	activation_job* jobs;
+	int count;
+	int next;
+	pthread_mutex_t lock;
+} station_queue;
+
+static void station_stage(activation_session_t session, activation_stage_t stage, void* user_data)
+{
+	((activation_job*)user_data)->stage = stage;
+}
+
+/* Where a job ended up, called by the library when its session is done. */
+static void station_done(activation_session_t session, activation_error_t err, void* user_data)
+{
+	activation_job* job = (activation_job*)user_data;
+
+	if (err == ACTIVATION_E_QUEUED) {
+		job->status = activation_strerror(err);
+		job->result = 1;
+	} else if (err != ACTIVATION_E_SUCCESS) {
+		job->status = activation_strerror(err);
+		job->result = -1;
+	} else if (job->stage == ACTIVATION_STAGE_SKIPPED) {
+		job->status = job->deactivate ? "already deactivated, skipped" : "already activated, skipped";
+		job->result = 0;
+	} else if (job->deactivate) {
+		job->status = "deactivated";
+		job->result = 0;
+	} else if (job->stage == ACTIVATION_STAGE_ACTIVATING_STORED) {
+		job->status = "activated from stored record";
+		job->result = 0;
+	} else {
+		job->status = "activated";
+		job->result = 0;
+	}
+	job->elapsed = seconds_now() - job->started;
+}
+
+static activation_error_t station_session(activation_job* job, activation_session_t* session)
+{
+	activation_callbacks_t callbacks = { station_stage, NULL, NULL, station_done };
+	activation_options_t options;
+
+	if (job->options != NULL) {
+		options = *job->options;
+	} else {
+		memset(&options, 0, sizeof(options));
+	}
+	options.cancel = &job->cancelled;
+
+	job->result = -1;
+	job->started = seconds_now();
+	return activation_session_new(session, job->uuid, &options, &callbacks, job);
+}
+
+/* What a summary line says about a job */
+const char* station_label(const activation_job* job)
+{
+	if (job->result == 0) {
+		return "OK";
+	}
+	return (job->result > 0) ? "QUEUED" : "FAILED";
+}
+
+/* Runs the whole connect/fetch/activate dance for a single device in its own
+ * library session, so any number can run at once. */
+int station_activate(activation_job* job)
+{
+	activation_session_t session = NULL;
+
+	trace_set_uuid(job->uuid);
+	TRACE_BEGIN(job_start);
+
+	activation_error_t err = station_session(job, &session);
+	if (err != ACTIVATION_E_SUCCESS) {
+		station_done(NULL, err, job);
+	} else if (job->deactivate) {
+		activation_session_deactivate(session);
+	} else {
+		activation_session_run(session);
+	}
+	activation_session_free(session);
+
+	TRACE_END("activation", job_start);
+	return job->result;
+}
+
+/* What each pool and the queue in front of it looked like over the run */
+static void station_pipeline_stats(const activation_pipe_stats_t* stats)
+{
+	int i = 0;
+
+	logger_flush();
+	printf("\nPIPELINE\n");
+	printf("  %-9s %7s %9s %10s %10s %6s\n", "stage", "workers", "processed", "peak queue", "mean queue", "busy");
+	for (i = 0; i < ACTIVATION_PIPE_STAGES; i++) {
+		printf("  %-9s %7d %9lu %6d/%-3d %10.2f %5.0f%%\n", activation_pipe_stage_name(i), stats[i].workers, stats[i].processed,
+			stats[i].peak_depth, stats[i].queue_size, stats[i].mean_depth, stats[i].busy * 100.0);
+	}
+}
+
+/* Hands every job to the library's event loop engine (see engine.c) or, with
+ * a pipeline config, to its staged pipeline (see pipeline.c). */
+static void station_engine(station_queue* queue, int workers, int deactivate, const activation_pipeline_config_t* pipeline)
+{
+	activation_session_t* sessions = calloc(queue->count, sizeof(activation_session_t));
+	int count = 0;
+	int i = 0;
+
+	if (sessions == NULL) {
+		error("Unable to allocate sufficent memory");
+		return;
+	}
+
+	for (i = 0; i < queue->count; i++) {
+		activation_job* job = &queue->jobs[i];
+		activation_error_t err = station_session(job, &sessions[count]);
+		if (err != ACTIVATION_E_SUCCESS) {
+			station_done(NULL, err, job);
+			continue;
+		}
+		count++;
+	}
+
+	if (count > 0 && pipeline != NULL) {
+		activation_pipeline_config_t config = *pipeline;
+		activation_pipe_stats_t stats[ACTIVATION_PIPE_STAGES];
+
+		config.deactivate = deactivate;
+		if (activation_pipeline_run(sessions, count, &config, stats) == ACTIVATION_E_SUCCESS) {
+			station_pipeline_stats(stats);
+		}
+	} else if (count > 0) {
+		activation_engine_run(sessions, count, workers, deactivate);
+	}
+
+	for (i = 0; i < count; i++) {
+		activation_session_free(sessions[i]);
+	}
+	free(sessions);
+}
+
+static void* station_worker(void* arg)
+{
+	station_queue* queue = (station_queue*)arg;
+
+	while (1) {
+		pthread_mutex_lock(&queue->lock);
+		int index = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (index >= queue->count) {
+			break;
+		}
+
+		station_activate(&queue->jobs[index]);
+	}
+
+	return NULL;
+}
+
+/* Enumerates every attached device and activates them in parallel. A worker
+ * count of zero means one thread per device, so the whole rack takes about as
+ * long as its slowest phone. With STATION_ENGINE the workers only do the
+ * device side and a single event loop does all the HTTP; with
+ * STATION_PIPELINE every stage gets the pool pipeline asks for. Returns the
+ * number of devices that failed. */
+int station_run(int workers, int deactivate, const activation_options_t* options, int mode, const activation_pipeline_config_t* pipeline)
+{
+	char** devices = NULL;
+	int count = 0;
+	int failed = 0;
+	int skipped = 0;
+	int queued = 0;
+	int i = 0;
+
+	if (device_transport_current->list(&devices, &count) != 0 || count == 0) {
+		error("No device found, is it plugged in?");
+		return -1;
+	}
+
+	station_queue queue;
+	queue.jobs = calloc(count, sizeof(activation_job));
+	if (queue.jobs == NULL) {
+		error("Unable to allocate sufficent memory");
+		device_transport_current->list_free(devices);
+		return -1;
+	}
+	queue.count = count;
+	queue.next = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	for (i = 0; i < count; i++) {
+		queue.jobs[i].uuid = devices[i];
+		queue.jobs[i].deactivate = deactivate;
+		queue.jobs[i].options = options;
+		queue.jobs[i].status = "not started";
+	}
+
+	double start = seconds_now();
+	pthread_t* threads = NULL;
+
+	if (mode == STATION_ENGINE) {
+		printf("Found %d device(s), using the event loop engine\n", count);
+		station_engine(&queue, workers, deactivate, NULL);
+	} else if (mode == STATION_PIPELINE) {
+		printf("Found %d device(s), using the pipeline\n", count);
+		station_engine(&queue, workers, deactivate, pipeline);
+	} else {
+		if (workers <= 0 || workers > count) {
+			workers = count;
+		}
+
+		printf("Found %d device(s), using %d worker(s)\n", count, workers);
+
+		threads = calloc(workers, sizeof(pthread_t));
+		for (i = 0; i < workers; i++) {
+			if (threads == NULL || pthread_create(&threads[i], NULL, station_worker, &queue) != 0) {
+				error("Unable to start worker thread");
+				workers = i;
+				break;
+			}
+		}
+
+		/* if no thread could be started at all, do the work on this one */
+		if (workers == 0) {
+			station_worker(&queue);
+		}
+
+		for (i = 0; i < workers; i++) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	double elapsed = seconds_now() - start;
+
+	/* whatever the workers logged goes above the summary, not through it */
+	logger_flush();
+	printf("\nSUMMARY\n");
+	for (i = 0; i < count; i++) {
+		activation_job* job = &queue.jobs[i];
+		printf("  %s  %-7s  %6.2fs  %s\n", job->uuid, station_label(job), job->elapsed, job->status);
+		if (job->result < 0) {
+			failed++;
+		} else if (job->result > 0) {
+			queued++;
+		} else if (job->stage == ACTIVATION_STAGE_SKIPPED) {
+			skipped++;
+		}
+	}
+	printf("%d of %d device(s) succeeded in %.2fs", count - failed - queued, count, elapsed);
+	if (skipped > 0) {
+		printf(", %d of them were already done and skipped", skipped);
+	}
+	if (queued > 0) {
+		printf(", %d queued until the server can be reached", queued);
+	}
+	printf("\n");
+
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+	free(queue.jobs);
+	device_transport_current->list_free(devices);
+
+	return failed;
+}
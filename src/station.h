@@ -0,0 +1,47 @@
+/*
+ * station.h
+ * Activates every attached device at once, one worker thread per device.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef STATION_H
+#define STATION_H
+
+#include "libideviceactivate.h"
+
+#define STATION_THREADS 0
+#define STATION_ENGINE 1
+#define STATION_PIPELINE 2
+
+typedef struct {
+	char* uuid;
+	int deactivate;
+	const activation_options_t* options;
+	volatile int cancelled;  /* set when the device goes away mid-job */
+	activation_stage_t stage;  /* the last stage the session reported */
+	int result;              /* 0 on success, 1 if queued in the spool, -1 on failure */
+	const char* status;      /* where the job ended up, for the summary */
+	double started;
+	double elapsed;          /* seconds spent on this device */
+} activation_job;
+
+extern int station_activate(activation_job* job);
+extern const char* station_label(const activation_job* job);
+extern int station_run(int workers, int deactivate, const activation_options_t* options, int mode, const activation_pipeline_config_t* pipeline);
+
+#endif
@@ -0,0 +1,678 @@
+/*
+ * store.c
+ * A single file key/value store for plists: hashed on-disk index, reads
+ * straight out of a shared mapping, one fsync per write.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <plist/plist.h>
+
+#include "store.h"
+#include "util.h"
+
+/*
+ * File layout:
+ *
+ *   header | slot[slots] | record | record | ...
+ *
+ * Slots form an open addressing hash table (linear probing) mapping the hash
+ * of a key to the offset of its newest record. Records are only ever appended;
+ * rewriting a key appends a new record and repoints the slot. When the table
+ * gets too full the whole file is rebuilt at twice the size, without the dead
+ * records, and renamed over the old one. The old file is marked retired so
+ * other processes know to reopen.
+ *
+ * Locking: a pthread rwlock covers threads of this process and flock() on a
+ * separate .lock file covers other processes. The lock file is never renamed,
+ * so it stays valid across rebuilds.
+ */
+
+#define STORE_MAGIC "IDASTOR1"
+#define STORE_VERSION 1
+#define STORE_RECORD_MAGIC 0x31434552 /* "REC1" */
+#define STORE_INITIAL_SLOTS 1024
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+	uint32_t entries;
+	uint32_t retired;
+	uint64_t data_end;
+} store_header;
+
+typedef struct {
+	uint64_t hash;
+	uint64_t offset;
+} store_slot;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t key_length;
+	uint32_t value_length;
+	uint32_t checksum;
+} store_record;
+
+struct store {
+	char* path;
+	int fd;
+	int lock_fd;
+	char* map;
+	size_t map_size;
+
+	pthread_rwlock_t rwlock;
+	pthread_mutex_t readers_lock;
+	int readers;
+};
+
+static uint64_t store_hash(const char* key)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 0x100000001b3ULL;
+	}
+	/* zero marks an empty slot */
+	return (hash == 0) ? 1 : hash;
+}
+
+static uint32_t store_checksum(const char* key, uint32_t key_length, const char* value, uint32_t value_length)
+{
+	uint32_t hash = 0x811c9dc5;
+	uint32_t i = 0;
+	for (i = 0; i < key_length; i++) {
+		hash = (hash ^ (unsigned char)key[i]) * 0x01000193;
+	}
+	for (i = 0; i < value_length; i++) {
+		hash = (hash ^ (unsigned char)value[i]) * 0x01000193;
+	}
+	return hash;
+}
+
+static store_header* store_get_header(store_t* store)
+{
+	return (store_header*)store->map;
+}
+
+static store_slot* store_get_slots(store_t* store)
+{
+	return (store_slot*)(store->map + sizeof(store_header));
+}
+
+/* Writes an empty store with the given number of slots to fd. */
+static int store_format(int fd, uint32_t slots)
+{
+	store_header header;
+	memset(&header, '\0', sizeof(header));
+	memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+	header.version = STORE_VERSION;
+	header.slots = slots;
+	header.data_end = sizeof(store_header) + (uint64_t)slots * sizeof(store_slot);
+
+	if (ftruncate(fd, 0) != 0 || ftruncate(fd, header.data_end) != 0) {
+		return -1;
+	}
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int store_map(store_t* store)
+{
+	struct stat st;
+
+	if (store->map != NULL) {
+		munmap(store->map, store->map_size);
+		store->map = NULL;
+		store->map_size = 0;
+	}
+
+	if (fstat(store->fd, &st) != 0 || st.st_size < (off_t)sizeof(store_header)) {
+		return -1;
+	}
+
+	char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, store->fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	store->map = map;
+	store->map_size = st.st_size;
+
+	store_header* header = store_get_header(store);
+	if (memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) != 0 || header->version != STORE_VERSION) {
+		char m[512];
+		snprintf(m, sizeof(m), "%s is not a cache file this version understands", store->path);
+		error(m);
+		return -1;
+	}
+	return 0;
+}
+
+/* Is the mapping behind what's on disk? Callers hold at least a shared lock. */
+static int store_stale(store_t* store)
+{
+	if (store->map == NULL) {
+		return 1;
+	}
+	store_header* header = store_get_header(store);
+	return header->retired || header->data_end > store->map_size;
+}
+
+/* Brings the mapping up to date. Callers hold the rwlock exclusively. */
+static int store_refresh(store_t* store)
+{
+	if (store->map != NULL && store_get_header(store)->retired) {
+		int fd = open(store->path, O_RDWR);
+		if (fd < 0) {
+			return -1;
+		}
+		close(store->fd);
+		store->fd = fd;
+	}
+
+	if (store_stale(store)) {
+		return store_map(store);
+	}
+	return 0;
+}
+
+/* flock() locks belong to the open file, not the thread, so concurrent
+ * readers in this process share one shared lock and the last one out drops
+ * it. */
+static void store_lock_shared(store_t* store)
+{
+	pthread_mutex_lock(&store->readers_lock);
+	if (store->readers++ == 0) {
+		flock(store->lock_fd, LOCK_SH);
+	}
+	pthread_mutex_unlock(&store->readers_lock);
+}
+
+static void store_unlock_shared(store_t* store)
+{
+	pthread_mutex_lock(&store->readers_lock);
+	if (--store->readers == 0) {
+		flock(store->lock_fd, LOCK_UN);
+	}
+	pthread_mutex_unlock(&store->readers_lock);
+}
+
+static int store_read_begin(store_t* store)
+{
+	while (1) {
+		pthread_rwlock_rdlock(&store->rwlock);
+		store_lock_shared(store);
+		if (!store_stale(store)) {
+			return 0;
+		}
+		store_unlock_shared(store);
+		pthread_rwlock_unlock(&store->rwlock);
+
+		pthread_rwlock_wrlock(&store->rwlock);
+		flock(store->lock_fd, LOCK_SH);
+		int res = store_refresh(store);
+		flock(store->lock_fd, LOCK_UN);
+		pthread_rwlock_unlock(&store->rwlock);
+		if (res != 0) {
+			return -1;
+		}
+	}
+}
+
+static void store_read_end(store_t* store)
+{
+	store_unlock_shared(store);
+	pthread_rwlock_unlock(&store->rwlock);
+}
+
+static int store_write_begin(store_t* store)
+{
+	pthread_rwlock_wrlock(&store->rwlock);
+	flock(store->lock_fd, LOCK_EX);
+	if (store_refresh(store) != 0) {
+		flock(store->lock_fd, LOCK_UN);
+		pthread_rwlock_unlock(&store->rwlock);
+		return -1;
+	}
+	return 0;
+}
+
+static void store_write_end(store_t* store)
+{
+	flock(store->lock_fd, LOCK_UN);
+	pthread_rwlock_unlock(&store->rwlock);
+}
+
+/* Copies out the header of the record at offset if the record is intact and
+ * belongs to key. Records follow each other unpadded, so they are read with
+ * memcpy() rather than through a pointer into the mapping. */
+static int store_record_at(store_t* store, uint64_t offset, const char* key, store_record* record)
+{
+	if (offset + sizeof(store_record) > store->map_size) {
+		return -1;
+	}
+
+	memcpy(record, store->map + offset, sizeof(store_record));
+	const char* data = store->map + offset + sizeof(store_record);
+	if (record->magic != STORE_RECORD_MAGIC || offset + sizeof(store_record) + record->key_length + record->value_length > store->map_size) {
+		return -1;
+	}
+
+	if (key != NULL && (record->key_length != strlen(key) || memcmp(data, key, record->key_length) != 0)) {
+		return -1;
+	}
+
+	/* a torn write from a crash shows up here and reads as a miss */
+	if (record->checksum != store_checksum(data, record->key_length, data + record->key_length, record->value_length)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Finds the slot holding key, or the empty slot it would go in. *found is
+ * the offset of key's record, zero when there isn't one. */
+static uint32_t store_find_slot(store_t* store, const char* key, uint64_t hash, uint64_t* found)
+{
+	store_header* header = store_get_header(store);
+	store_slot* slots = store_get_slots(store);
+	uint32_t mask = header->slots - 1;
+	uint32_t index = hash & mask;
+	store_record record;
+
+	*found = 0;
+	while (slots[index].hash != 0) {
+		if (slots[index].hash == hash && store_record_at(store, slots[index].offset, key, &record) == 0) {
+			*found = slots[index].offset;
+			return index;
+		}
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+/* Rewrites the live records into a fresh file with room for more keys and
+ * swaps it in. Callers hold the write lock. */
+static int store_grow(store_t* store)
+{
+	store_header* header = store_get_header(store);
+	store_slot* old_slots = store_get_slots(store);
+	uint32_t slots = header->slots * 2;
+	uint32_t entries = 0;
+	uint32_t i = 0;
+
+	size_t tmp_len = strlen(store->path) + 5;
+	char* tmp = malloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.tmp", store->path);
+
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || store_format(fd, slots) != 0) {
+		error("Unable to grow the cache file");
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return -1;
+	}
+
+	store_slot* new_slots = calloc(slots, sizeof(store_slot));
+	uint64_t data_end = sizeof(store_header) + (uint64_t)slots * sizeof(store_slot);
+
+	for (i = 0; i < header->slots; i++) {
+		if (old_slots[i].hash == 0) {
+			continue;
+		}
+
+		store_record record;
+		if (store_record_at(store, old_slots[i].offset, NULL, &record) != 0) {
+			continue;
+		}
+
+		size_t size = sizeof(store_record) + record.key_length + record.value_length;
+		if (pwrite(fd, store->map + old_slots[i].offset, size, data_end) != (ssize_t)size) {
+			break;
+		}
+
+		uint32_t index = old_slots[i].hash & (slots - 1);
+		while (new_slots[index].hash != 0) {
+			index = (index + 1) & (slots - 1);
+		}
+		new_slots[index].hash = old_slots[i].hash;
+		new_slots[index].offset = data_end;
+
+		data_end += size;
+		entries++;
+	}
+
+	store_header new_header;
+	memcpy(&new_header, header, sizeof(new_header));
+	new_header.slots = slots;
+	new_header.entries = entries;
+	new_header.retired = 0;
+	new_header.data_end = data_end;
+
+	int res = -1;
+	if (i == header->slots
+	    && pwrite(fd, new_slots, slots * sizeof(store_slot), sizeof(store_header)) == (ssize_t)(slots * sizeof(store_slot))
+	    && pwrite(fd, &new_header, sizeof(new_header), 0) == sizeof(new_header)
+	    && fsync(fd) == 0
+	    && rename(tmp, store->path) == 0) {
+		res = 0;
+	}
+	free(new_slots);
+
+	if (res != 0) {
+		error("Unable to grow the cache file");
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+
+	/* tell everyone still looking at the old file to go find the new one */
+	uint32_t retired = 1;
+	pwrite(store->fd, &retired, sizeof(retired), offsetof(store_header, retired));
+
+	close(store->fd);
+	store->fd = fd;
+	return store_map(store);
+}
+
+store_t* store_open(const char* path)
+{
+	store_t* store = calloc(1, sizeof(store_t));
+	if (store == NULL) {
+		return NULL;
+	}
+
+	size_t lock_len = strlen(path) + 6;
+	char* lock_path = malloc(lock_len);
+	snprintf(lock_path, lock_len, "%s.lock", path);
+
+	store->path = strdup(path);
+	store->fd = -1;
+	store->lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+	free(lock_path);
+	pthread_rwlock_init(&store->rwlock, NULL);
+	pthread_mutex_init(&store->readers_lock, NULL);
+
+	char m[512];
+	if (store->lock_fd < 0) {
+		snprintf(m, sizeof(m), "Unable to open the lock file for %s", path);
+		error(m);
+		store_close(store);
+		return NULL;
+	}
+
+	flock(store->lock_fd, LOCK_EX);
+	store->fd = open(path, O_RDWR | O_CREAT, 0600);
+
+	struct stat st;
+	int res = -1;
+	if (store->fd >= 0 && fstat(store->fd, &st) == 0) {
+		res = 0;
+		if (st.st_size == 0) {
+			res = store_format(store->fd, STORE_INITIAL_SLOTS);
+		}
+		if (res == 0) {
+			res = store_map(store);
+		}
+	}
+	flock(store->lock_fd, LOCK_UN);
+
+	if (res != 0) {
+		snprintf(m, sizeof(m), "Unable to open %s", path);
+		error(m);
+		store_close(store);
+		return NULL;
+	}
+
+	return store;
+}
+
+void store_close(store_t* store)
+{
+	if (store == NULL) {
+		return;
+	}
+
+	if (store->map != NULL) {
+		munmap(store->map, store->map_size);
+	}
+	if (store->fd >= 0) {
+		close(store->fd);
+	}
+	if (store->lock_fd >= 0) {
+		close(store->lock_fd);
+	}
+	pthread_rwlock_destroy(&store->rwlock);
+	pthread_mutex_destroy(&store->readers_lock);
+	free(store->path);
+	free(store);
+}
+
+/* Stores value (as a binary plist) under key. The record is synced before
+ * the slot is pointed at it, so a crash leaves either the old value or the
+ * new one, never a slot pointing at a record that didn't make it to disk. */
+int store_put(store_t* store, const char* key, plist_t value)
+{
+	char* bin = NULL;
+	uint32_t bin_length = 0;
+
+	plist_to_bin(value, &bin, &bin_length);
+	if (bin == NULL) {
+		return -1;
+	}
+
+	if (store_write_begin(store) != 0) {
+		free(bin);
+		return -1;
+	}
+
+	store_header* header = store_get_header(store);
+	if ((uint64_t)(header->entries + 1) * 10 > (uint64_t)header->slots * 7) {
+		if (store_grow(store) != 0) {
+			store_write_end(store);
+			free(bin);
+			return -1;
+		}
+		header = store_get_header(store);
+	}
+
+	uint64_t hash = store_hash(key);
+	uint64_t existing = 0;
+	uint32_t index = store_find_slot(store, key, hash, &existing);
+
+	store_record record;
+	record.magic = STORE_RECORD_MAGIC;
+	record.key_length = strlen(key);
+	record.value_length = bin_length;
+	record.checksum = store_checksum(key, record.key_length, bin, bin_length);
+
+	struct iovec iov[3];
+	iov[0].iov_base = &record;
+	iov[0].iov_len = sizeof(record);
+	iov[1].iov_base = (void*)key;
+	iov[1].iov_len = record.key_length;
+	iov[2].iov_base = bin;
+	iov[2].iov_len = bin_length;
+	ssize_t size = sizeof(record) + record.key_length + bin_length;
+
+	store_slot slot;
+	slot.hash = hash;
+	slot.offset = header->data_end;
+
+	store_header new_header;
+	memcpy(&new_header, header, sizeof(new_header));
+	new_header.data_end += size;
+	if (existing == 0) {
+		new_header.entries++;
+	}
+
+	int res = -1;
+	if (pwritev(store->fd, iov, 3, slot.offset) == size
+	    && fdatasync(store->fd) == 0
+	    && pwrite(store->fd, &slot, sizeof(slot), sizeof(store_header) + (uint64_t)index * sizeof(store_slot)) == sizeof(slot)
+	    && pwrite(store->fd, &new_header, sizeof(new_header), 0) == sizeof(new_header)
+	    && fdatasync(store->fd) == 0) {
+		res = 0;
+	}
+
+	store_write_end(store);
+	free(bin);
+	return res;
+}
+
+/* Stores a batch of binary plists, syncing the records once and then the
+ * index and header once for the lot instead of per value. Keys must be
+ * distinct within a batch. */
+int store_put_many(store_t* store, const store_item* items, int count)
+{
+	int i = 0;
+
+	if (count <= 0) {
+		return 0;
+	}
+
+	if (store_write_begin(store) != 0) {
+		return -1;
+	}
+
+	/* grow up front: what gets appended below isn't in the mapping yet, so
+	 * store_grow() couldn't carry it over */
+	store_header* header = store_get_header(store);
+	while ((uint64_t)(header->entries + count) * 10 > (uint64_t)header->slots * 7) {
+		if (store_grow(store) != 0) {
+			store_write_end(store);
+			return -1;
+		}
+		header = store_get_header(store);
+	}
+
+	store_header new_header;
+	memcpy(&new_header, header, sizeof(new_header));
+
+	/* the records go down and are synced before any slot points at them,
+	 * so a crash can't leave the index naming data that never made it */
+	int res = 0;
+	uint64_t offset = new_header.data_end;
+	for (i = 0; i < count; i++) {
+		store_record record;
+		record.magic = STORE_RECORD_MAGIC;
+		record.key_length = strlen(items[i].key);
+		record.value_length = items[i].length;
+		record.checksum = store_checksum(items[i].key, record.key_length, items[i].data, items[i].length);
+
+		struct iovec iov[3];
+		iov[0].iov_base = &record;
+		iov[0].iov_len = sizeof(record);
+		iov[1].iov_base = (void*)items[i].key;
+		iov[1].iov_len = record.key_length;
+		iov[2].iov_base = (void*)items[i].data;
+		iov[2].iov_len = items[i].length;
+		ssize_t size = sizeof(record) + record.key_length + items[i].length;
+
+		if (pwritev(store->fd, iov, 3, offset) != size) {
+			res = -1;
+			break;
+		}
+		offset += size;
+	}
+
+	if (res != 0 || fdatasync(store->fd) != 0) {
+		store_write_end(store);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint64_t hash = store_hash(items[i].key);
+		uint64_t existing = 0;
+		uint32_t index = store_find_slot(store, items[i].key, hash, &existing);
+
+		store_slot slot;
+		slot.hash = hash;
+		slot.offset = new_header.data_end;
+
+		/* the slot write lands in the mapping, so later keys in the batch
+		 * probe past it */
+		if (pwrite(store->fd, &slot, sizeof(slot), sizeof(store_header) + (uint64_t)index * sizeof(store_slot)) != sizeof(slot)) {
+			res = -1;
+			break;
+		}
+
+		new_header.data_end += sizeof(store_record) + strlen(items[i].key) + items[i].length;
+		if (existing == 0) {
+			new_header.entries++;
+		}
+	}
+
+	if (pwrite(store->fd, &new_header, sizeof(new_header), 0) != sizeof(new_header) || fdatasync(store->fd) != 0) {
+		res = -1;
+	}
+
+	store_write_end(store);
+	return res;
+}
+
+/* Looks key up and parses its value straight out of the mapping. Returns -1
+ * and leaves *value NULL when there's no such key. */
+int store_get(store_t* store, const char* key, plist_t* value)
+{
+	uint64_t offset = 0;
+	store_record record;
+
+	*value = NULL;
+	if (store_read_begin(store) != 0) {
+		return -1;
+	}
+
+	store_find_slot(store, key, store_hash(key), &offset);
+	if (offset != 0) {
+		memcpy(&record, store->map + offset, sizeof(record));
+		plist_from_bin(store->map + offset + sizeof(record) + record.key_length, record.value_length, value);
+	}
+
+	store_read_end(store);
+	return (*value != NULL) ? 0 : -1;
+}
+
+int store_count(store_t* store)
+{
+	if (store_read_begin(store) != 0) {
+		return -1;
+	}
+	int entries = store_get_header(store)->entries;
+	store_read_end(store);
+	return entries;
+}
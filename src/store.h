@@ -0,0 +1,46 @@
+/*
+ * store.h
+ * A single file key/value store for plists: hashed on-disk index, reads
+ * straight out of a shared mapping, one fsync per write.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+typedef struct store store_t;
+
+/* A value that is already a binary plist, for store_put_many() */
+typedef struct {
+	const char* key;
+	const char* data;
+	uint32_t length;
+} store_item;
+
+extern store_t* store_open(const char* path);
+extern void store_close(store_t* store);
+
+extern int store_put(store_t* store, const char* key, plist_t value);
+extern int store_put_many(store_t* store, const store_item* items, int count);
+extern int store_get(store_t* store, const char* key, plist_t* value);
+extern int store_count(store_t* store);
+
+#endif
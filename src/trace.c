@@ -0,0 +1,112 @@
+/*
+ * trace.c
+ * Timing spans for each stage of an activation, written as JSON lines.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "util.h"
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static uint64_t trace_epoch = 0;
+static pid_t trace_pid = 0;
+
+/* Spans are tagged with the device the current thread is working on */
+static __thread char trace_uuid[41];
+static __thread pid_t trace_tid = 0;
+
+uint64_t trace_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Must be called before any thread is started. */
+int trace_open(const char* path)
+{
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (trace_fd < 0) {
+		error("Unable to open the trace file");
+		return -1;
+	}
+
+	trace_epoch = trace_now();
+	trace_pid = getpid();
+	trace_enabled = 1;
+	return 0;
+}
+
+void trace_close()
+{
+	trace_enabled = 0;
+	if (trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+const char* trace_get_uuid()
+{
+	return trace_uuid;
+}
+
+void trace_set_uuid(const char* uuid)
+{
+	if (uuid == NULL) {
+		trace_uuid[0] = '\0';
+		return;
+	}
+	strncpy(trace_uuid, uuid, sizeof(trace_uuid) - 1);
+	trace_uuid[sizeof(trace_uuid) - 1] = '\0';
+}
+
+/* One line per span, in Chrome's "complete event" shape, so the file can be
+ * grepped as is or wrapped into an array for chrome://tracing. Each line goes
+ * out in a single O_APPEND write, which keeps threads from interleaving
+ * without taking a lock. */
+void trace_span(const char* name, uint64_t start, uint64_t end)
+{
+	char line[256];
+
+	if (trace_fd < 0) {
+		return;
+	}
+
+	if (trace_tid == 0) {
+		trace_tid = (pid_t)syscall(SYS_gettid);
+	}
+
+	int len = snprintf(line, sizeof(line),
+		"{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"udid\":\"%s\"}}\n",
+		name, (start - trace_epoch) / 1000.0, (end - start) / 1000.0, (int)trace_pid, (int)trace_tid, trace_uuid);
+	if (len > 0 && len < (int)sizeof(line)) {
+		if (write(trace_fd, line, len) < 0) {
+			/* losing a span isn't worth failing an activation over */
+		}
+	}
+}
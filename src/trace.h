@@ -0,0 +1,42 @@
+/*
+ * trace.h
+ * Timing spans for each stage of an activation, written as JSON lines.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Set by trace_open(). Everything below is a no-op while it's zero, and the
+ * macros don't even read the clock. */
+extern int trace_enabled;
+
+extern int trace_open(const char* path);
+extern void trace_close();
+
+extern void trace_set_uuid(const char* uuid);
+extern const char* trace_get_uuid();
+extern uint64_t trace_now();
+extern void trace_span(const char* name, uint64_t start, uint64_t end);
+
+#define TRACE_BEGIN(start) uint64_t start = trace_enabled ? trace_now() : 0
+#define TRACE_END(name, start) do { if (trace_enabled) trace_span(name, start, trace_now()); } while (0)
+
+#endif
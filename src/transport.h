@@ -0,0 +1,82 @@
+/*
+ * transport.h
+ * What the activation code needs from a device, whoever ends up answering:
+ * lockdownd over usbmux (lockdown.c) or simulated devices (virtual.c).
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <plist/plist.h>
+#include "libideviceactivate.h"
+
+/* One connection to one device, what's in it is up to the transport */
+typedef struct device_link device_link;
+
+typedef enum {
+	DEVICE_ADDED = 1,
+	DEVICE_REMOVED
+} device_event_t;
+
+typedef void (*device_event_cb)(device_event_t event, const char* uuid, void* user_data);
+
+/* Everything returns 0 on success. Errors are the transport's own codes
+ * (lockdownd's for the real one), only good for printing. Calls on
+ * different links may come from different threads at once. */
+typedef struct {
+	const char* name;
+
+	/* the UUIDs of every attached device, freed with list_free() */
+	int (*list)(char*** uuids, int* count);
+	void (*list_free)(char** uuids);
+
+	/* callback runs on the transport's own thread until unsubscribe() */
+	int (*subscribe)(device_event_cb callback, void* user_data);
+	void (*unsubscribe)();
+
+	/* connect() reaches the device (the first one, with a NULL uuid),
+	 * handshake() opens the lockdownd session every call below needs */
+	int (*connect)(const char* uuid, device_link** link);
+	int (*handshake)(device_link* link);
+	void (*disconnect)(device_link* link);
+	char* (*get_uuid)(device_link* link);
+
+	/* a cheap round trip, to tell whether an idle session still works */
+	int (*check)(device_link* link);
+
+	/* GetValue in the root domain, the whole domain as a dict when key is NULL */
+	int (*get_value)(device_link* link, const char* key, plist_t* value);
+	int (*activate)(device_link* link, plist_t record);
+	int (*deactivate)(device_link* link);
+} device_transport;
+
+/* The transport every connection goes through, lockdown_transport unless
+ * something else was put in place before the first session, see idevice.c */
+extern const device_transport* device_transport_current;
+extern const device_transport lockdown_transport;
+extern const device_transport virtual_transport;
+
+extern void transport_use(const device_transport* t);
+
+/* Builds the devices virtual_transport simulates, see virtual.c */
+extern void virtual_defaults(activation_virtual_config_t* config);
+extern int virtual_init(const activation_virtual_config_t* config);
+extern void virtual_cleanup();
+
+#endif
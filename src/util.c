@@ -24,18 +24,26 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <plist/plist.h>
-#include <libimobiledevice/lockdown.h>
 
+#include "logger.h"
 #include "util.h"
 
 int buffer_read_from_filename(const char *filename, char **buffer, uint32_t *length) {
 	FILE *f;
 	uint64_t size;
 
+	char m[512];
+
 	f = fopen(filename, "rb");
 	if(f == NULL) {
-		printf("Unable to open file %s\n", filename);
+		snprintf(m, sizeof(m), "Unable to open file %s", filename);
+		error(m);
 		return -1;
 	}
 
@@ -44,10 +52,13 @@ int buffer_read_from_filename(const char *filename, char **buffer, uint32_t *len
 	rewind(f);
 
 	*buffer = (char*) malloc(sizeof(char) * size);
-	if (fread(*buffer, sizeof(char), size, f) != size) {
-		printf("Unable to read %llu bytes from '%s'.\n", size, filename);
+	if (*buffer == NULL || fread(*buffer, sizeof(char), size, f) != size) {
+		snprintf(m, sizeof(m), "Unable to read %llu bytes from '%s'.", (unsigned long long)size, filename);
+		error(m);
 		free(*buffer);
 		*buffer = NULL;
+		fclose(f);
+		return -1;
 	}
 	fclose(f);
 
@@ -55,65 +66,112 @@ int buffer_read_from_filename(const char *filename, char **buffer, uint32_t *len
 	return 0;
 }
 
-int plist_read_from_filename(plist_t *plist, const char *filename) {
-	char *buffer = NULL;
-	uint32_t length;
+/* Maps a whole file read-only instead of copying it into the heap; give it
+ * back with buffer_unmap(). Fails quietly, callers know what to say. */
+int buffer_map_from_filename(const char *filename, char **buffer, size_t *length) {
+	struct stat st;
 
-	if (filename == NULL) {
-		printf("No filename specified\n");
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		return -1;
 	}
 
-	if(buffer_read_from_filename(filename, &buffer, &length) < 0) {
-		printf("Unable to read file\n");
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > UINT32_MAX) {
+		close(fd);
 		return -1;
 	}
 
-	if (buffer ==  NULL) {
-		printf("Buffer returned null\n");
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
 		return -1;
 	}
 
-	if (memcmp(buffer, "bplist00", 8) == 0) {
+	*buffer = (char*)map;
+	*length = st.st_size;
+	return 0;
+}
+
+void buffer_unmap(char *buffer, size_t length) {
+	if (buffer != NULL) {
+		munmap(buffer, length);
+	}
+}
+
+/* Parses a plist in either format straight out of buffer, no copy first. */
+int plist_read_from_buffer(plist_t *plist, const char *buffer, size_t length) {
+	*plist = NULL;
+
+	if (length >= 8 && memcmp(buffer, "bplist00", 8) == 0) {
 		plist_from_bin(buffer, length, plist);
 	} else {
 		plist_from_xml(buffer, length, plist);
 	}
 
-	free(buffer);
-
-	return 0;
+	return (*plist != NULL) ? 0 : -1;
 }
 
-/* This one is a wrapper for p0sixninja's rather repetetive code... */
-char *lockdownd_get_string_value(lockdownd_client_t client, const char *what)
-{
-	plist_t val_node=NULL;
-	char* val=NULL;
+int plist_read_from_filename(plist_t *plist, const char *filename) {
+	char *buffer = NULL;
+	size_t length = 0;
 
-	lockdownd_get_value(client, NULL, what, &val_node);
-	if (!val_node || plist_get_node_type(val_node) != PLIST_STRING) {
-		fprintf(stderr, "Unable to get %s from lockdownd\n", what);
-		return NULL;
+	if (filename == NULL) {
+		error("No filename specified");
+		return -1;
+	}
+
+	if (buffer_map_from_filename(filename, &buffer, &length) < 0) {
+		error("Unable to read file");
+		return -1;
 	}
-	plist_get_string_val(val_node, &val);
-	plist_free(val_node);
 
-	return (char *)val;
+	int res = plist_read_from_buffer(plist, buffer, length);
+	buffer_unmap(buffer, length);
+
+	return res;
+}
+
+/* Per thread, so every library session can have its own, see session.c */
+static __thread message_handler handler = NULL;
+static __thread void *handler_data = NULL;
+
+void set_message_handler(message_handler h, void *data)
+{
+	handler = h;
+	handler_data = data;
 }
 
 /* This is really just a function to allow some hooking into Gtk stuff in iDeviceActivator... */
 void info(const char *m)
 {
-	printf("INFO: %s\n", m);
+	if (handler != NULL) {
+		handler(0, m, handler_data);
+		return;
+	}
+	logger_write(LOGGER_INFO, "INFO: ", m);
 }
 
 void error(const char *m)
 {
-	fprintf(stderr, "%s\n", m);
+	if (handler != NULL) {
+		handler(1, m, handler_data);
+		return;
+	}
+	logger_write(LOGGER_ERROR, "", m);
 }
 
 void task(const char *m)
 {
-	printf("%s\n", m);	
+	if (handler != NULL) {
+		handler(0, m, handler_data);
+		return;
+	}
+	logger_write(LOGGER_INFO, "", m);
+}
+
+double seconds_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
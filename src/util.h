@@ -19,14 +19,23 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-#include <libimobiledevice/lockdown.h>
+#include <plist/plist.h>
 
 // These just wrap p0sixninja's original code, just trying to clean up...
 extern int plist_read_from_filename(plist_t *plist, const char *filename);
 extern int buffer_read_from_filename(const char *filename, char **buffer, uint32_t *length);
-extern char *lockdownd_get_string_value(lockdownd_client_t client, const char *what);
+extern int buffer_map_from_filename(const char *filename, char **buffer, size_t *length);
+extern void buffer_unmap(char *buffer, size_t length);
+extern int plist_read_from_buffer(plist_t *plist, const char *buffer, size_t length);
 
 // The main purpose of these two is to provide a way to mod the behavior, plus a bit of shorthand ;)
 extern void info(const char *m);
 extern void error(const char *m);
 extern void task(const char *m);
+
+// Sends info(), error() and task() from the calling thread somewhere else, NULL puts them back on the terminal
+typedef void (*message_handler)(int is_error, const char *m, void *data);
+extern void set_message_handler(message_handler handler, void *data);
+
+// Wall clock time in seconds, for telling how long something took
+extern double seconds_now();
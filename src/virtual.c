@@ -0,0 +1,447 @@
+/*
+ * virtual.c
+ * A device transport with no devices behind it: any number of simulated
+ * iPhones that answer like lockdownd would, only from memory and after a
+ * configurable wait.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <plist/plist.h>
+
+#include "idevice.h"
+#include "transport.h"
+#include "util.h"
+
+#define VIRTUAL_CERT_CHAIN_SIZE 1200
+#define VIRTUAL_SIGNATURE_SIZE 128
+
+/* Everything about one device that can change, or that differs from the
+ * next one. A real device answers one request at a time, so does this. */
+typedef struct {
+	char uuid[41];
+	char imei[16];
+	char imsi[16];
+	char iccid[20];
+	char serial_number[13];
+	const char* activation_state;
+	unsigned int seed;
+	pthread_mutex_t lock;
+} virtual_device;
+
+struct device_link {
+	virtual_device* device;
+	unsigned int seed;
+	int handshaken;
+};
+
+static activation_virtual_config_t virtual_config;
+static virtual_device* virtual_devices = NULL;
+static int virtual_count = 0;
+static plist_t virtual_properties = NULL;      /* on top of what each device makes up */
+static plist_t virtual_activation_info = NULL; /* the same payload for every device */
+
+static device_event_cb virtual_callback = NULL;
+static void* virtual_callback_data = NULL;
+static pthread_t virtual_announcer;
+static volatile int virtual_subscribed = 0;
+
+void virtual_defaults(activation_virtual_config_t* config)
+{
+	memset(config, 0, sizeof(activation_virtual_config_t));
+	config->count = 100;
+	config->activation_state = "Unactivated";
+	config->activation_info_size = 8192;
+	config->connect_ms = 2;
+	config->handshake_ms = 40;
+	config->query_ms = 8;
+	config->activation_info_ms = 150;
+	config->activate_ms = 300;
+}
+
+/* Somewhere between half and one and a half times ms, so a thousand devices
+ * started together don't all answer in the same instant. */
+static void virtual_wait(unsigned int* seed, long ms)
+{
+	if (ms <= 0) {
+		return;
+	}
+
+	long us = ms * 500 + rand_r(seed) % (ms * 1000 + 1);
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+	}
+}
+
+static plist_t virtual_blob(size_t length, uint32_t seed)
+{
+	char* data = malloc(length);
+	size_t i = 0;
+
+	if (data == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < length; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (char)(seed >> 16);
+	}
+	plist_t node = plist_new_data(data, length);
+	free(data);
+	return node;
+}
+
+/* UUIDs are the device's number in hex, so finding one takes no search */
+static virtual_device* virtual_find(const char* uuid)
+{
+	if (virtual_count == 0) {
+		return NULL;
+	}
+	if (uuid == NULL) {
+		return &virtual_devices[0];
+	}
+	if (strlen(uuid) != 40) {
+		return NULL;
+	}
+
+	unsigned long i = strtoul(uuid + 32, NULL, 16);
+	if (i == 0 || i > (unsigned long)virtual_count || strcmp(virtual_devices[i - 1].uuid, uuid)) {
+		return NULL;
+	}
+	return &virtual_devices[i - 1];
+}
+
+int virtual_init(const activation_virtual_config_t* config)
+{
+	int i = 0;
+
+	if (config->count <= 0 || config->activation_info_size < 0 || config->connect_ms < 0 || config->handshake_ms < 0 ||
+		config->query_ms < 0 || config->activation_info_ms < 0 || config->activate_ms < 0) {
+		error("Invalid virtual device settings");
+		return -1;
+	}
+
+	/* pooled links point into the devices about to be freed */
+	device_pool_evict(NULL);
+	virtual_cleanup();
+	virtual_config = *config;
+	if (virtual_config.activation_state == NULL) {
+		virtual_config.activation_state = "Unactivated";
+	}
+
+	if (config->properties != NULL) {
+		if (plist_read_from_filename(&virtual_properties, config->properties) < 0 || virtual_properties == NULL ||
+			plist_get_node_type(virtual_properties) != PLIST_DICT) {
+			error("Unable to read virtual device properties");
+			virtual_cleanup();
+			return -1;
+		}
+
+		/* a payload in the file is sent as is, and only when asked for */
+		plist_t info = plist_dict_get_item(virtual_properties, "ActivationInfo");
+		if (info != NULL) {
+			virtual_activation_info = plist_copy(info);
+			plist_dict_remove_item(virtual_properties, "ActivationInfo");
+		}
+	}
+
+	if (virtual_activation_info == NULL) {
+		virtual_activation_info = plist_new_dict();
+		plist_dict_insert_item(virtual_activation_info, "ActivationInfoComplete", plist_new_bool(1));
+		plist_dict_insert_item(virtual_activation_info, "ActivationInfoXML", virtual_blob(config->activation_info_size, 1));
+		plist_dict_insert_item(virtual_activation_info, "FairPlayCertChain", virtual_blob(VIRTUAL_CERT_CHAIN_SIZE, 2));
+		plist_dict_insert_item(virtual_activation_info, "FairPlaySignature", virtual_blob(VIRTUAL_SIGNATURE_SIZE, 3));
+	}
+
+	virtual_devices = calloc(config->count, sizeof(virtual_device));
+	if (virtual_devices == NULL) {
+		error("Unable to allocate sufficent memory");
+		virtual_cleanup();
+		return -1;
+	}
+	virtual_count = config->count;
+
+	for (i = 0; i < virtual_count; i++) {
+		virtual_device* dev = &virtual_devices[i];
+		snprintf(dev->uuid, sizeof(dev->uuid), "%040x", i + 1);
+		snprintf(dev->imei, sizeof(dev->imei), "01300%010d", i + 1);
+		snprintf(dev->imsi, sizeof(dev->imsi), "31041%010d", i + 1);
+		snprintf(dev->iccid, sizeof(dev->iccid), "890141%013d", i + 1);
+		snprintf(dev->serial_number, sizeof(dev->serial_number), "VT%09d", i + 1);
+		dev->activation_state = virtual_config.activation_state;
+		dev->seed = i + 1;
+		pthread_mutex_init(&dev->lock, NULL);
+	}
+
+	return 0;
+}
+
+/* Only once nothing is connected through virtual_transport any more */
+void virtual_cleanup()
+{
+	int i = 0;
+
+	for (i = 0; i < virtual_count; i++) {
+		pthread_mutex_destroy(&virtual_devices[i].lock);
+	}
+	free(virtual_devices);
+	virtual_devices = NULL;
+	virtual_count = 0;
+
+	if (virtual_properties != NULL) {
+		plist_free(virtual_properties);
+		virtual_properties = NULL;
+	}
+	if (virtual_activation_info != NULL) {
+		plist_free(virtual_activation_info);
+		virtual_activation_info = NULL;
+	}
+}
+
+static int virtual_list(char*** uuids, int* count)
+{
+	int i = 0;
+
+	*uuids = calloc(virtual_count + 1, sizeof(char*));
+	if (*uuids == NULL) {
+		return -1;
+	}
+	for (i = 0; i < virtual_count; i++) {
+		(*uuids)[i] = strdup(virtual_devices[i].uuid);
+	}
+	*count = virtual_count;
+	return 0;
+}
+
+static void virtual_list_free(char** uuids)
+{
+	int i = 0;
+
+	if (uuids == NULL) {
+		return;
+	}
+	for (i = 0; uuids[i] != NULL; i++) {
+		free(uuids[i]);
+	}
+	free(uuids);
+}
+
+/* Every device is plugged in as soon as someone is listening */
+static void* virtual_announce(void* arg)
+{
+	int i = 0;
+
+	for (i = 0; i < virtual_count && virtual_subscribed; i++) {
+		virtual_callback(DEVICE_ADDED, virtual_devices[i].uuid, virtual_callback_data);
+	}
+	return NULL;
+}
+
+static int virtual_subscribe(device_event_cb callback, void* user_data)
+{
+	virtual_callback = callback;
+	virtual_callback_data = user_data;
+	virtual_subscribed = 1;
+	if (pthread_create(&virtual_announcer, NULL, virtual_announce, NULL) != 0) {
+		virtual_subscribed = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void virtual_unsubscribe()
+{
+	if (virtual_subscribed) {
+		virtual_subscribed = 0;
+		pthread_join(virtual_announcer, NULL);
+	}
+}
+
+static int virtual_connect(const char* uuid, device_link** link)
+{
+	virtual_device* dev = virtual_find(uuid);
+
+	*link = NULL;
+	if (dev == NULL) {
+		return -1;
+	}
+
+	*link = calloc(1, sizeof(device_link));
+	if (*link == NULL) {
+		return -1;
+	}
+	(*link)->device = dev;
+	(*link)->seed = (unsigned int)(uintptr_t)*link ^ dev->seed;
+
+	virtual_wait(&(*link)->seed, virtual_config.connect_ms);
+	return 0;
+}
+
+static int virtual_handshake(device_link* link)
+{
+	pthread_mutex_lock(&link->device->lock);
+	virtual_wait(&link->seed, virtual_config.handshake_ms);
+	link->handshaken = 1;
+	pthread_mutex_unlock(&link->device->lock);
+	return 0;
+}
+
+static void virtual_disconnect(device_link* link)
+{
+	free(link);
+}
+
+static char* virtual_get_uuid(device_link* link)
+{
+	return strdup(link->device->uuid);
+}
+
+static int virtual_check(device_link* link)
+{
+	if (!link->handshaken) {
+		return -1;
+	}
+	pthread_mutex_lock(&link->device->lock);
+	virtual_wait(&link->seed, virtual_config.query_ms);
+	pthread_mutex_unlock(&link->device->lock);
+	return 0;
+}
+
+/* The root domain as this device would report it right now */
+static plist_t virtual_root(virtual_device* dev)
+{
+	plist_dict_iter iter = NULL;
+	char* key = NULL;
+	plist_t item = NULL;
+
+	plist_t dict = plist_new_dict();
+	plist_dict_insert_item(dict, "UniqueDeviceID", plist_new_string(dev->uuid));
+	plist_dict_insert_item(dict, "DeviceClass", plist_new_string("iPhone"));
+	plist_dict_insert_item(dict, "ProductType", plist_new_string("iPhone3,1"));
+	plist_dict_insert_item(dict, "ProductVersion", plist_new_string("4.0"));
+	plist_dict_insert_item(dict, "SerialNumber", plist_new_string(dev->serial_number));
+	plist_dict_insert_item(dict, "InternationalMobileEquipmentIdentity", plist_new_string(dev->imei));
+	plist_dict_insert_item(dict, "InternationalMobileSubscriberIdentity", plist_new_string(dev->imsi));
+	plist_dict_insert_item(dict, "IntegratedCircuitCardIdentity", plist_new_string(dev->iccid));
+	plist_dict_insert_item(dict, "ActivationState", plist_new_string(dev->activation_state));
+
+	if (virtual_properties == NULL) {
+		return dict;
+	}
+	plist_dict_new_iter(virtual_properties, &iter);
+	for (;;) {
+		plist_dict_next_item(virtual_properties, iter, &key, &item);
+		if (key == NULL) {
+			break;
+		}
+		plist_dict_remove_item(dict, key);
+		plist_dict_insert_item(dict, key, plist_copy(item));
+		free(key);
+		key = NULL;
+	}
+	free(iter);
+	return dict;
+}
+
+static int virtual_get_value(device_link* link, const char* key, plist_t* value)
+{
+	virtual_device* dev = link->device;
+	int activation_info = (key != NULL && !strcmp(key, "ActivationInfo"));
+
+	*value = NULL;
+	if (!link->handshaken) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	virtual_wait(&link->seed, activation_info ? virtual_config.activation_info_ms : virtual_config.query_ms);
+	if (activation_info) {
+		*value = plist_copy(virtual_activation_info);
+	} else {
+		plist_t dict = virtual_root(dev);
+		if (key == NULL) {
+			*value = dict;
+		} else {
+			plist_t item = plist_dict_get_item(dict, key);
+			*value = (item != NULL) ? plist_copy(item) : NULL;
+			plist_free(dict);
+		}
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return (*value != NULL) ? 0 : -1;
+}
+
+/* lockdownd only takes a record it can make sense of, a dict is as far as
+ * this one looks */
+static int virtual_activate(device_link* link, plist_t record)
+{
+	virtual_device* dev = link->device;
+	int res = -1;
+
+	if (!link->handshaken) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	virtual_wait(&link->seed, virtual_config.activate_ms);
+	if (record != NULL && plist_get_node_type(record) == PLIST_DICT) {
+		dev->activation_state = "Activated";
+		res = 0;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return res;
+}
+
+static int virtual_deactivate(device_link* link)
+{
+	virtual_device* dev = link->device;
+
+	if (!link->handshaken) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	virtual_wait(&link->seed, virtual_config.activate_ms);
+	dev->activation_state = "Unactivated";
+	pthread_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+const device_transport virtual_transport = {
+	"virtual",
+	virtual_list,
+	virtual_list_free,
+	virtual_subscribe,
+	virtual_unsubscribe,
+	virtual_connect,
+	virtual_handshake,
+	virtual_disconnect,
+	virtual_get_uuid,
+	virtual_check,
+	virtual_get_value,
+	virtual_activate,
+	virtual_deactivate,
+};
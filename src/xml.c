@@ -0,0 +1,238 @@
+/*
+ * xml.c
+ * Writes plist nodes as XML straight into a buffer.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <plist/plist.h>
+
+#include "buffer.h"
+#include "xml.h"
+
+/* base64 lines are wrapped like libplist does, so the output is the same
+ * fragment the old plist_to_xml() + strstr() dance used to cut out */
+#define XML_BASE64_LINE 68
+
+/* seconds between the unix epoch and the plist epoch (2001-01-01) */
+#define XML_MAC_EPOCH 978307200
+
+static const char base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int xml_indent(buffer_t* buffer, int depth)
+{
+	if (buffer_reserve(buffer, depth) != 0) {
+		return -1;
+	}
+	memset(buffer->data + buffer->length, '\t', depth);
+	buffer->length += depth;
+	buffer->data[buffer->length] = '\0';
+	return 0;
+}
+
+/* Appends str with the five XML special characters escaped. */
+static int xml_escape(buffer_t* buffer, const char* str)
+{
+	const char* run = str;
+	const char* p = NULL;
+
+	for (p = str; *p; p++) {
+		const char* entity = NULL;
+		switch (*p) {
+		case '&': entity = "&amp;"; break;
+		case '<': entity = "&lt;"; break;
+		case '>': entity = "&gt;"; break;
+		case '"': entity = "&quot;"; break;
+		case '\'': entity = "&apos;"; break;
+		default: continue;
+		}
+		if (buffer_append(buffer, run, p - run) != 0 || buffer_append_str(buffer, entity) != 0) {
+			return -1;
+		}
+		run = p + 1;
+	}
+
+	return buffer_append(buffer, run, p - run);
+}
+
+static int xml_base64(buffer_t* buffer, const unsigned char* data, uint64_t length, int depth)
+{
+	uint64_t encoded = ((length + 2) / 3) * 4;
+	uint64_t lines = encoded / XML_BASE64_LINE + 1;
+	uint64_t i = 0;
+	int column = 0;
+
+	if (buffer_reserve(buffer, encoded + lines * (depth + 1)) != 0) {
+		return -1;
+	}
+
+	char* out = buffer->data + buffer->length;
+	for (i = 0; i < length; i += 3) {
+		uint32_t chunk = data[i] << 16;
+		if (i + 1 < length) chunk |= data[i + 1] << 8;
+		if (i + 2 < length) chunk |= data[i + 2];
+
+		if (column == XML_BASE64_LINE) {
+			*out++ = '\n';
+			memset(out, '\t', depth);
+			out += depth;
+			column = 0;
+		}
+
+		*out++ = base64_table[(chunk >> 18) & 0x3f];
+		*out++ = base64_table[(chunk >> 12) & 0x3f];
+		*out++ = (i + 1 < length) ? base64_table[(chunk >> 6) & 0x3f] : '=';
+		*out++ = (i + 2 < length) ? base64_table[chunk & 0x3f] : '=';
+		column += 4;
+	}
+
+	buffer->length = out - buffer->data;
+	buffer->data[buffer->length] = '\0';
+	return 0;
+}
+
+int xml_write_node(buffer_t* buffer, plist_t node, int depth)
+{
+	char tmp[64];
+	int res = 0;
+	uint32_t i = 0;
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_DICT: {
+		plist_dict_iter iter = NULL;
+		char* key = NULL;
+		plist_t item = NULL;
+
+		res |= buffer_append_str(buffer, "<dict>\n");
+		plist_dict_new_iter(node, &iter);
+		while (res == 0) {
+			plist_dict_next_item(node, iter, &key, &item);
+			if (key == NULL) {
+				break;
+			}
+			res |= xml_indent(buffer, depth + 1);
+			res |= buffer_append_str(buffer, "<key>");
+			res |= xml_escape(buffer, key);
+			res |= buffer_append_str(buffer, "</key>\n");
+			res |= xml_indent(buffer, depth + 1);
+			res |= xml_write_node(buffer, item, depth + 1);
+			free(key);
+			key = NULL;
+		}
+		free(iter);
+		res |= xml_indent(buffer, depth);
+		res |= buffer_append_str(buffer, "</dict>");
+		break;
+	}
+
+	case PLIST_ARRAY:
+		res |= buffer_append_str(buffer, "<array>\n");
+		for (i = 0; res == 0 && i < plist_array_get_size(node); i++) {
+			res |= xml_indent(buffer, depth + 1);
+			res |= xml_write_node(buffer, plist_array_get_item(node, i), depth + 1);
+		}
+		res |= xml_indent(buffer, depth);
+		res |= buffer_append_str(buffer, "</array>");
+		break;
+
+	case PLIST_STRING: {
+		char* val = NULL;
+		plist_get_string_val(node, &val);
+		res |= buffer_append_str(buffer, "<string>");
+		res |= xml_escape(buffer, val ? val : "");
+		res |= buffer_append_str(buffer, "</string>");
+		free(val);
+		break;
+	}
+
+	case PLIST_DATA: {
+		char* val = NULL;
+		uint64_t length = 0;
+		plist_get_data_val(node, &val, &length);
+		res |= buffer_append_str(buffer, "<data>\n");
+		res |= xml_indent(buffer, depth);
+		res |= xml_base64(buffer, (const unsigned char*)val, length, depth);
+		res |= buffer_append_str(buffer, "\n");
+		res |= xml_indent(buffer, depth);
+		res |= buffer_append_str(buffer, "</data>");
+		free(val);
+		break;
+	}
+
+	case PLIST_BOOLEAN: {
+		uint8_t val = 0;
+		plist_get_bool_val(node, &val);
+		res |= buffer_append_str(buffer, val ? "<true/>" : "<false/>");
+		break;
+	}
+
+	case PLIST_UINT: {
+		uint64_t val = 0;
+		plist_get_uint_val(node, &val);
+		snprintf(tmp, sizeof(tmp), "<integer>%llu</integer>", (unsigned long long)val);
+		res |= buffer_append_str(buffer, tmp);
+		break;
+	}
+
+	case PLIST_REAL: {
+		double val = 0;
+		plist_get_real_val(node, &val);
+		snprintf(tmp, sizeof(tmp), "<real>%f</real>", val);
+		res |= buffer_append_str(buffer, tmp);
+		break;
+	}
+
+	case PLIST_DATE: {
+		int32_t sec = 0;
+		int32_t usec = 0;
+		struct tm tm;
+		plist_get_date_val(node, &sec, &usec);
+		time_t t = (time_t)sec + XML_MAC_EPOCH;
+		gmtime_r(&t, &tm);
+		strftime(tmp, sizeof(tmp), "<date>%Y-%m-%dT%H:%M:%SZ</date>", &tm);
+		res |= buffer_append_str(buffer, tmp);
+		break;
+	}
+
+	default:
+		/* a key, UID or anything newer has no XML form here, and leaving it
+		 * out would leave a <key> without a value */
+		return -1;
+	}
+
+	res |= buffer_append_str(buffer, "\n");
+	return (res == 0) ? 0 : -1;
+}
+
+/* Writes node without the <?xml ...?> and <plist> wrapper around it, which is
+ * the form the activation server wants ActivationInfo in. The trailing newline
+ * is dropped so the fragment ends right at the closing tag. */
+int xml_write_fragment(buffer_t* buffer, plist_t node)
+{
+	if (xml_write_node(buffer, node, 0) != 0) {
+		return -1;
+	}
+
+	buffer->length--;
+	buffer->data[buffer->length] = '\0';
+	return 0;
+}
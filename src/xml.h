@@ -0,0 +1,31 @@
+/*
+ * xml.h
+ * Writes plist nodes as XML straight into a buffer.
+ *
+ * Copyright (c) 2010 Joshua Hill and boxingsquirrel. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef XML_H
+#define XML_H
+
+#include <plist/plist.h>
+#include "buffer.h"
+
+extern int xml_write_node(buffer_t* buffer, plist_t node, int depth);
+extern int xml_write_fragment(buffer_t* buffer, plist_t node);
+
+#endif